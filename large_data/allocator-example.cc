@@ -0,0 +1,115 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Containers with the default allocator and with huge_page_allocator.h:
+// random reads from a large std::vector, and inserts and lookups in a
+// std::unordered_map.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "huge_page_allocator.h"
+
+using std::cout;
+
+namespace {
+    const size_t kVectorSize = 64 << 20;   // 512 MB of uint64_t
+    const size_t kReads = 32 << 20;
+    const size_t kMapSize = 2 << 20;
+
+    double Seconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    uint64_t Next(uint64_t* state) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        return *state;
+    }
+
+    template <typename Vector>
+    void GatherTest(const char* name, Vector& v) {
+        uint64_t state = 88172645463325252ull;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < v.size(); i++) {
+            v[i] = i;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kReads; i++) {
+            sum += v[Next(&state) % v.size()];
+        }
+        double elapsed = Seconds(start);
+        cout << "vector " << name << ": " << elapsed * 1e9 / kReads
+             << " ns per random read" << (sum == 0 ? "!" : "") << "\n";
+    }
+
+    template <typename Map>
+    void MapTest(const char* name, Map& map) {
+        uint64_t state = 2463534242ull;
+        uint64_t found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kMapSize; i++) {
+            map[Next(&state)] = i;
+        }
+        state = 2463534242ull;
+        for (size_t i = 0; i < kMapSize; i++) {
+            found += map.count(Next(&state));
+        }
+        double elapsed = Seconds(start);
+        cout << "unordered_map " << name << ": " << elapsed * 1e9 / kMapSize
+             << " ns per insert and lookup" << (found == 0 ? "!" : "")
+             << "\n";
+    }
+}  // namespace
+
+int main() {
+    {
+        std::vector<uint64_t> v(kVectorSize);
+        GatherTest("std::allocator", v);
+    }
+    {
+        std::vector<uint64_t, iodlr::HugePageAllocator<uint64_t>> v(
+            kVectorSize);
+        GatherTest("HugePageAllocator", v);
+    }
+    {
+        std::unordered_map<uint64_t, uint64_t> map;
+        MapTest("std::allocator", map);
+    }
+    {
+        iodlr::HugePagePoolResource pool;
+        std::pmr::unordered_map<uint64_t, uint64_t> map(&pool);
+        MapTest("HugePagePoolResource", map);
+    }
+    {
+        iodlr::HugePageMonotonicResource arena;
+        std::pmr::unordered_map<uint64_t, uint64_t> map(&arena);
+        MapTest("HugePageMonotonicResource", map);
+    }
+    return 0;
+}
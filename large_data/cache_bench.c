@@ -0,0 +1,123 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Allocate, fill and free large buffers over and over, as a query engine does
+// with per-query hash tables, with iodlr_allocate_ex() and iodlr_deallocate()
+// and with the mapping cache in each clearing mode. `make bench-cache` runs it.
+//
+// usage: cache-bench [size in MB] [rounds]
+//
+// Each round allocates buffers of the full, three quarters and half the size,
+// writes every small page of each and frees them.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void Fill(char* buffer, size_t size, int round) {
+  for (size_t offset = 0; offset < size; offset += IODLR_PAGE_SIZE_4K) {
+    buffer[offset] = (char)round;
+  }
+}
+
+static void RunDirect(size_t size, int rounds) {
+  double start = Now();
+
+  for (int round = 0; round < rounds; round++) {
+    for (int part = 4; part >= 2; part--) {
+      iodlr_allocation allocation;
+      if (!iodlr_allocate_ex(size / 4 * part, IODLR_PAGE_SIZE_1G,
+                             &allocation)) {
+        perror("iodlr_allocate_ex");
+        exit(1);
+      }
+      Fill(allocation.addr, size / 4 * part, round);
+      iodlr_deallocate(allocation.addr, allocation.size);
+    }
+  }
+  printf("%-16s %8.1f us per buffer\n", "direct",
+         (Now() - start) * 1e6 / (rounds * 3));
+}
+
+static void RunCached(const char* name, iodlr_cache_clear clear, size_t size,
+                      int rounds) {
+  iodlr_cache_config config = {IODLR_PAGE_SIZE_1G, 4, 0, clear};
+  iodlr_cache_stats stats;
+
+  iodlr_cache_configure(&config);
+  iodlr_cache_trim(0);
+  iodlr_cache_stats before;
+  iodlr_cache_get_stats(&before);
+
+  double start = Now();
+  for (int round = 0; round < rounds; round++) {
+    for (int part = 4; part >= 2; part--) {
+      iodlr_allocation allocation;
+      if (!iodlr_cache_allocate(size / 4 * part, IODLR_PAGE_SIZE_1G,
+                                &allocation)) {
+        perror("iodlr_cache_allocate");
+        exit(1);
+      }
+      Fill(allocation.addr, size / 4 * part, round);
+      iodlr_cache_deallocate(&allocation);
+    }
+  }
+  double elapsed = Now() - start;
+  iodlr_cache_get_stats(&stats);
+  uint64_t hits = stats.hits - before.hits;
+  uint64_t misses = stats.misses - before.misses;
+  printf("%-16s %8.1f us per buffer, hit rate %.1f%%, saved %.1f us in "
+         "syscalls and up to %.1f us in faults per hit\n",
+         name, elapsed * 1e6 / (rounds * 3),
+         100.0 * hits / (hits + misses),
+         hits ? (stats.saved_syscall_ns - before.saved_syscall_ns) / 1e3 /
+                hits : 0.0,
+         hits ? (stats.saved_fault_ns - before.saved_fault_ns) / 1e3 / hits :
+                0.0);
+}
+
+int main(int argc, char** argv) {
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 64) << 20;
+  int rounds = argc > 2 ? atoi(argv[2]) : 50;
+
+  if (size < IODLR_PAGE_SIZE_2M || rounds < 1) {
+    fprintf(stderr, "usage: %s [size in MB, at least 2] [rounds]\n", argv[0]);
+    return 1;
+  }
+  RunDirect(size, rounds);
+  RunCached("cache keep", iodlr_cache_keep, size, rounds);
+  RunCached("cache zero", iodlr_cache_zero, size, rounds);
+  RunCached("cache dontneed", iodlr_cache_dontneed, size, rounds);
+  iodlr_cache_trim(0);
+  return 0;
+}
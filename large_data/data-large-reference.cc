@@ -27,19 +27,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <x86intrin.h>
-
-#ifndef MAP_HUGETLB
-# define MAP_HUGETLB 0x40000
-#endif
-
-#ifndef MAP_HUGE_1GB
-# define MAP_HUGE_1GB (30 << 26)
-#endif
-
-# define FLAGS_1G MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | MAP_HUGE_1GB
-# define FLAGS_2M MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB
-# define FLAGS_4K MAP_ANONYMOUS | MAP_PRIVATE
-
+#include "large_data.h"
 
 /* 8G memory allocation */
 #define SIZE_8G 8ul << 30 
@@ -60,85 +48,9 @@
 #define NCHUNKS NCHUNKS_8G
 
 
-#include <climits>
-#include <cstring>
 #include <iostream>
-#include <fstream>
-#include <sstream>
-
-
-#include <unistd.h>
-size_t iodlr_get_default_page_size() {
-return (size_t)(sysconf(_SC_PAGESIZE));
-}
 
-using std::string;
-using std::ifstream;
-using std::istringstream;
 using std::cout;
-using std::getline;
-
-uint64_t iodlr_procmeminfo(string key) {
-    ifstream ifs("/proc/meminfo");
-    string map_line;
-
-    while(getline(ifs,map_line)){
-        istringstream iss(map_line);
-        string keyname;
-        uint64_t value;
-        string kb;
-        iss >> keyname;
-        iss >> value;
-        iss >> kb;
-        if (keyname == key) {
-                return value;
-        }
-    }
-    return -1; // nothing found
-
-}
-
-bool iodlr_hp_enabled() {
-    uint64_t val = iodlr_procmeminfo("HugePages_Total:");
-    if (val > 0 )
-        return true;
-    else 
-        return false;
-}
-
-size_t iodlr_get_hp_size() {
-    uint64_t val = iodlr_procmeminfo("Hugepagesize:");
-    if (val > 0) {
-        return val * 1024;
-    }
-    return -1;
-}
-
-
-void * iodlr_allocate(size_t s, size_t pgsz) {
-    int flags=FLAGS_4K;
-    void *data;
-    if (pgsz ==  1048576* 1024)
-       flags = FLAGS_1G;
-    else if (pgsz == 2048*1024)
-       flags = FLAGS_2M;
-
-    data = mmap(NULL, s,
-                         PROT_READ | PROT_WRITE, flags,
-                         -1, 0);
-    assert(data != MAP_FAILED);
-    return data;
-}
-
-void iodlr_deallocate(char *d, size_t s) {
-    int i;
-    i = munmap (d, s);
-    assert (i != -1);
-}
-
-void zerofill(char *d, size_t s) {
-    memset (d, 0, s);
-}
 
 void touch(char *d, size_t stride, size_t index, size_t size) {
 
@@ -156,15 +68,23 @@ int64_t dotest(size_t s) {
         int i;
         size_t stride = (SIZE)/NCHUNKS;
         uint64_t start, end;
+        iodlr_allocation allocation;
+        // Fault the pages in on every CPU rather than memset() them: the
+        // kernel has zeroed them already. This is left out of the cycle
+        // count, which covers the strided reads only.
+        if (!iodlr_allocate_populated_ex(SIZE, s, 0, &allocation)) {
+          cout << "Allocation of " << (SIZE) << " bytes failed\n";
+          return -1;
+        }
+        char *data = (char *)allocation.addr;
         start = __rdtsc();
-        char *data = (char *)iodlr_allocate(SIZE, s);
-        zerofill(data, SIZE);
         for (i=0; i < 4096; i++) {
           touch(data, stride, i, SIZE);
         }
-        iodlr_deallocate(data, SIZE);
         end = __rdtsc();
-        cout << "Cycles for " << s << " = " << (end - start) << "\n";
+        iodlr_deallocate(data, allocation.size);
+        cout << "Cycles for " << s << " (" << iodlr_page_kind_str(allocation.kind)
+             << ") = " << (end - start) << "\n";
         return (end - start);
 }
 
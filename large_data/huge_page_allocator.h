@@ -0,0 +1,393 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Standard library allocators on huge pages, on top of iodlr_allocate_ex().
+// Header only; link with liblarge_data.a.
+//
+//   std::vector<double, iodlr::HugePageAllocator<double>> v;
+//
+//   iodlr::HugePagePoolResource pool;
+//   std::pmr::unordered_map<int, std::pmr::string> map(&pool);
+//
+// Blocks of up to 64 KB are carved from huge page chunks and recycled through
+// free lists per power of two size, so node based containers do not map a
+// page per node. Larger blocks are mapped on their own and unmapped when
+// freed. HugePageAllocator works from C++11; the memory resources need C++17.
+
+#ifndef HUGE_PAGE_ALLOCATOR_H_
+#define HUGE_PAGE_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include "large_data.h"
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define IODLR_HAVE_PMR 1
+#endif
+#endif
+
+namespace iodlr {
+    namespace detail {
+        inline uintptr_t AlignUp(uintptr_t value, size_t alignment) {
+            return (value + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        }
+
+        // Map at least `bytes` with pages of up to `max_page_size`. Throws
+        // std::bad_alloc if not even small pages are left.
+        inline iodlr_allocation Map(size_t bytes, size_t max_page_size) {
+            iodlr_allocation allocation;
+            if (!iodlr_allocate_ex(bytes, max_page_size, &allocation)) {
+                throw std::bad_alloc();
+            }
+            return allocation;
+        }
+
+        // Power of two blocks of 16 bytes to 64 KB, carved from chunks of
+        // huge pages and kept on a free list per size once freed. Blocks are
+        // aligned to their size. Not thread safe; memory goes back to the
+        // kernel only in Release().
+        class Pool {
+          public:
+            static constexpr size_t kMinBlock = 16;
+            static constexpr size_t kMaxBlock = 64 << 10;
+
+            Pool(size_t max_page_size, size_t chunk_size)
+                : max_page_size_(max_page_size),
+                  chunk_size_(chunk_size > IODLR_PAGE_SIZE_2M ?
+                              chunk_size : IODLR_PAGE_SIZE_2M) {}
+            ~Pool() { Release(); }
+            Pool(const Pool&) = delete;
+            Pool& operator=(const Pool&) = delete;
+
+            static bool Fits(size_t bytes, size_t alignment) {
+                return bytes <= kMaxBlock && alignment <= kMaxBlock;
+            }
+
+            void* Allocate(size_t bytes, size_t alignment) {
+                int index = ClassOf(bytes, alignment);
+                size_t block = kMinBlock << index;
+                if (free_[index] != nullptr) {
+                    FreeBlock* result = free_[index];
+                    free_[index] = result->next;
+                    return result;
+                }
+                char* ptr = reinterpret_cast<char*>(
+                    AlignUp(reinterpret_cast<uintptr_t>(next_), block));
+                if (next_ == nullptr || ptr + block > end_) {
+                    AddChunk();
+                    ptr = reinterpret_cast<char*>(
+                        AlignUp(reinterpret_cast<uintptr_t>(next_), block));
+                }
+                next_ = ptr + block;
+                return ptr;
+            }
+
+            void Deallocate(void* ptr, size_t bytes, size_t alignment) {
+                int index = ClassOf(bytes, alignment);
+                FreeBlock* block = static_cast<FreeBlock*>(ptr);
+                block->next = free_[index];
+                free_[index] = block;
+            }
+
+            void Release() {
+                while (chunks_ != nullptr) {
+                    Chunk* chunk = chunks_;
+                    chunks_ = chunk->next;
+                    iodlr_deallocate(reinterpret_cast<char*>(chunk),
+                                     chunk->size);
+                }
+                for (FreeBlock*& head : free_) {
+                    head = nullptr;
+                }
+                next_ = end_ = nullptr;
+            }
+
+          private:
+            struct Chunk {
+                Chunk* next;
+                size_t size;
+            };
+            struct FreeBlock {
+                FreeBlock* next;
+            };
+            static constexpr int kClasses = 13;
+
+            static int ClassOf(size_t bytes, size_t alignment) {
+                size_t size = bytes > alignment ? bytes : alignment;
+                int index = 0;
+                while ((kMinBlock << index) < size) {
+                    index++;
+                }
+                return index;
+            }
+
+            void AddChunk() {
+                iodlr_allocation allocation = Map(chunk_size_, max_page_size_);
+                Chunk* chunk = static_cast<Chunk*>(allocation.addr);
+                chunk->next = chunks_;
+                chunk->size = allocation.size;
+                chunks_ = chunk;
+                next_ = reinterpret_cast<char*>(chunk + 1);
+                end_ = reinterpret_cast<char*>(chunk) + allocation.size;
+            }
+
+            size_t max_page_size_;
+            size_t chunk_size_;
+            Chunk* chunks_ = nullptr;
+            char* next_ = nullptr;
+            char* end_ = nullptr;
+            FreeBlock* free_[kClasses] = {};
+        };
+
+        // The pool behind every HugePageAllocator of one page size. Its chunks
+        // are 2 MB even for 1 GB pages, so a few small blocks do not take a
+        // whole gigabyte. It is never destroyed, so containers with static
+        // storage duration can still free into it at exit.
+        template <size_t PageSize>
+        struct SharedPool {
+            static Pool& Get() {
+                static Pool* pool = new Pool(PageSize, IODLR_PAGE_SIZE_2M);
+                return *pool;
+            }
+            static std::mutex& Lock() {
+                static std::mutex* lock = new std::mutex();
+                return *lock;
+            }
+        };
+    }  // namespace detail
+
+    // A standard Allocator whose memory comes from pages of up to PageSize
+    // bytes: IODLR_PAGE_SIZE_1G, IODLR_PAGE_SIZE_2M or IODLR_PAGE_SIZE_4K.
+    // Stateless; all allocators of one page size share a pool for small
+    // blocks.
+    template <typename T, size_t PageSize = IODLR_PAGE_SIZE_2M>
+    class HugePageAllocator {
+        static_assert(alignof(T) <= IODLR_PAGE_SIZE_4K,
+                      "HugePageAllocator aligns to at most a small page");
+
+      public:
+        using value_type = T;
+        using size_type = size_t;
+        using difference_type = ptrdiff_t;
+        using propagate_on_container_move_assignment = std::true_type;
+        using is_always_equal = std::true_type;
+
+        template <typename U>
+        struct rebind {
+            using other = HugePageAllocator<U, PageSize>;
+        };
+
+        HugePageAllocator() noexcept {}
+        template <typename U>
+        HugePageAllocator(const HugePageAllocator<U, PageSize>&) noexcept {}
+
+        T* allocate(size_t n) {
+            if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+                throw std::bad_array_new_length();
+            }
+            size_t bytes = n * sizeof(T);
+            if (detail::Pool::Fits(bytes, alignof(T))) {
+                std::lock_guard<std::mutex> guard(
+                    detail::SharedPool<PageSize>::Lock());
+                return static_cast<T*>(
+                    detail::SharedPool<PageSize>::Get().Allocate(bytes,
+                                                                 alignof(T)));
+            }
+            return static_cast<T*>(detail::Map(bytes, PageSize).addr);
+        }
+
+        void deallocate(T* ptr, size_t n) noexcept {
+            size_t bytes = n * sizeof(T);
+            if (detail::Pool::Fits(bytes, alignof(T))) {
+                std::lock_guard<std::mutex> guard(
+                    detail::SharedPool<PageSize>::Lock());
+                detail::SharedPool<PageSize>::Get().Deallocate(ptr, bytes,
+                                                               alignof(T));
+                return;
+            }
+            // The mapping is not remembered: iodlr_deallocate() unmaps all of
+            // it given the size asked for, as only explicit huge page mappings
+            // are longer than that rounded up to a small page.
+            iodlr_deallocate(reinterpret_cast<char*>(ptr), bytes);
+        }
+    };
+
+    template <typename T, typename U, size_t PageSize>
+    bool operator==(const HugePageAllocator<T, PageSize>&,
+                    const HugePageAllocator<U, PageSize>&) noexcept {
+        return true;
+    }
+
+    template <typename T, typename U, size_t PageSize>
+    bool operator!=(const HugePageAllocator<T, PageSize>&,
+                    const HugePageAllocator<U, PageSize>&) noexcept {
+        return false;
+    }
+
+#ifdef IODLR_HAVE_PMR
+    // A monotonic arena: allocation bumps a pointer through chunks of huge
+    // pages, deallocation does nothing, and release() or the destructor
+    // unmaps everything. Each new chunk is twice the size of the last.
+    class HugePageMonotonicResource : public std::pmr::memory_resource {
+      public:
+        explicit HugePageMonotonicResource(
+            size_t initial_size = IODLR_PAGE_SIZE_2M,
+            size_t max_page_size = IODLR_PAGE_SIZE_2M)
+            : max_page_size_(max_page_size),
+              next_size_(initial_size > 0 ? initial_size : IODLR_PAGE_SIZE_2M) {}
+        ~HugePageMonotonicResource() override { release(); }
+        HugePageMonotonicResource(const HugePageMonotonicResource&) = delete;
+        HugePageMonotonicResource& operator=(
+            const HugePageMonotonicResource&) = delete;
+
+        void release() {
+            while (chunks_ != nullptr) {
+                Chunk* chunk = chunks_;
+                chunks_ = chunk->next;
+                iodlr_deallocate(reinterpret_cast<char*>(chunk), chunk->size);
+            }
+            next_ = end_ = nullptr;
+        }
+
+      protected:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            char* ptr = reinterpret_cast<char*>(
+                detail::AlignUp(reinterpret_cast<uintptr_t>(next_), alignment));
+            if (next_ == nullptr || ptr > end_ ||
+                bytes > static_cast<size_t>(end_ - ptr)) {
+                size_t needed = sizeof(Chunk) + alignment + bytes;
+                size_t size = next_size_ > needed ? next_size_ : needed;
+                iodlr_allocation allocation = detail::Map(size, max_page_size_);
+                Chunk* chunk = static_cast<Chunk*>(allocation.addr);
+                chunk->next = chunks_;
+                chunk->size = allocation.size;
+                chunks_ = chunk;
+                end_ = reinterpret_cast<char*>(chunk) + allocation.size;
+                ptr = reinterpret_cast<char*>(detail::AlignUp(
+                    reinterpret_cast<uintptr_t>(chunk + 1), alignment));
+                if (next_size_ < IODLR_PAGE_SIZE_1G) {
+                    next_size_ *= 2;
+                }
+            }
+            next_ = ptr + bytes;
+            return ptr;
+        }
+
+        void do_deallocate(void*, size_t, size_t) override {}
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const
+            noexcept override {
+            return this == &other;
+        }
+
+      private:
+        struct Chunk {
+            Chunk* next;
+            size_t size;
+        };
+
+        size_t max_page_size_;
+        size_t next_size_;
+        Chunk* chunks_ = nullptr;
+        char* next_ = nullptr;
+        char* end_ = nullptr;
+    };
+
+    // A pooled resource: blocks of up to 64 KB come from the free lists of a
+    // pool of huge page chunks of `chunk_size` bytes, larger ones are mapped
+    // on their own. Like std::pmr::unsynchronized_pool_resource it is not
+    // thread safe, and frees everything on release() or destruction.
+    class HugePagePoolResource : public std::pmr::memory_resource {
+      public:
+        explicit HugePagePoolResource(
+            size_t max_page_size = IODLR_PAGE_SIZE_2M,
+            size_t chunk_size = IODLR_PAGE_SIZE_2M)
+            : max_page_size_(max_page_size), pool_(max_page_size, chunk_size) {}
+        ~HugePagePoolResource() override { release(); }
+        HugePagePoolResource(const HugePagePoolResource&) = delete;
+        HugePagePoolResource& operator=(const HugePagePoolResource&) = delete;
+
+        void release() {
+            for (auto& large : large_) {
+                iodlr_deallocate(static_cast<char*>(large.second.addr),
+                                 large.second.size);
+            }
+            large_.clear();
+            pool_.Release();
+        }
+
+      protected:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            if (detail::Pool::Fits(bytes, alignment)) {
+                return pool_.Allocate(bytes, alignment);
+            }
+            // Huge page mappings are aligned to 2 MB, small page ones only to
+            // a page, so map enough to align within.
+            size_t slack = alignment > IODLR_PAGE_SIZE_4K ? alignment : 0;
+            iodlr_allocation allocation =
+                detail::Map(bytes + slack, max_page_size_);
+            void* ptr = reinterpret_cast<void*>(detail::AlignUp(
+                reinterpret_cast<uintptr_t>(allocation.addr), alignment));
+            try {
+                large_.emplace(ptr, allocation);
+            } catch (...) {
+                iodlr_deallocate(static_cast<char*>(allocation.addr),
+                                 allocation.size);
+                throw;
+            }
+            return ptr;
+        }
+
+        void do_deallocate(void* ptr, size_t bytes, size_t alignment)
+            override {
+            if (detail::Pool::Fits(bytes, alignment)) {
+                pool_.Deallocate(ptr, bytes, alignment);
+                return;
+            }
+            auto large = large_.find(ptr);
+            if (large != large_.end()) {
+                iodlr_deallocate(static_cast<char*>(large->second.addr),
+                                 large->second.size);
+                large_.erase(large);
+            }
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const
+            noexcept override {
+            return this == &other;
+        }
+
+      private:
+        size_t max_page_size_;
+        detail::Pool pool_;
+        std::unordered_map<void*, iodlr_allocation> large_;
+    };
+#endif  // IODLR_HAVE_PMR
+};  // namespace iodlr
+
+#endif  // HUGE_PAGE_ALLOCATOR_H_
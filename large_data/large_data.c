@@ -0,0 +1,267 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+#define FLAGS_1G (MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | MAP_HUGE_1GB)
+#define FLAGS_2M (MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | MAP_HUGE_2MB)
+#define FLAGS_4K (MAP_ANONYMOUS | MAP_PRIVATE)
+
+#define THP_ENABLED_FILE "/sys/kernel/mm/transparent_hugepage/enabled"
+
+// Read a value in kB, or a count, from /proc/meminfo. Returns 0 if the key is
+// not there.
+static uint64_t iodlr_procmeminfo(const char* key) {
+  char line[256];
+  uint64_t value = 0;
+  size_t len = strlen(key);
+  FILE* ifs = fopen("/proc/meminfo", "r");
+
+  if (ifs == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), ifs) != NULL) {
+    if (strncmp(line, key, len) == 0 &&
+        sscanf(line + len, "%" SCNu64, &value) == 1) {
+      break;
+    }
+  }
+  fclose(ifs);
+  return value;
+}
+
+// Check whether explicit huge pages of the default size are configured.
+bool iodlr_hp_enabled(void) {
+  return iodlr_procmeminfo("HugePages_Total:") > 0;
+}
+
+// The default explicit huge page size in bytes, or 0 if unknown.
+size_t iodlr_get_hp_size(void) {
+  return iodlr_procmeminfo("Hugepagesize:") * 1024;
+}
+
+size_t iodlr_get_default_page_size(void) {
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Uses open() and read() rather than stdio, which would allocate, so that the
+// allocation functions below can back a malloc() implementation.
+static bool IsThpEnabled(void) {
+  char text[128];
+  int fd = open(THP_ENABLED_FILE, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t len = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (len <= 0) {
+    return false;
+  }
+  text[len] = 0;
+  return strstr(text, "[never]") == NULL;
+}
+
+static bool MapHugetlb(size_t page_size, int flags, iodlr_page_kind kind,
+                       size_t size, iodlr_allocation* allocation) {
+  size_t mapped = align_up(size, page_size);
+  void* addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  allocation->addr = addr;
+  allocation->size = mapped;
+  allocation->page_size = page_size;
+  allocation->kind = kind;
+  return true;
+}
+
+// Map a 2 MB aligned region and ask for transparent huge pages. mmap() only
+// aligns to small pages, so one large page more is mapped and the ends are
+// trimmed. The end is only rounded up to a small page, so that the mapping can
+// be unmapped with the size asked for; a partial last large page is left to
+// small pages.
+static bool MapThp(size_t size, iodlr_allocation* allocation) {
+  size_t mapped = align_up(size, iodlr_get_default_page_size());
+  char* addr = mmap(NULL, mapped + IODLR_PAGE_SIZE_2M, PROT_READ | PROT_WRITE,
+                    FLAGS_4K, -1, 0);
+
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  char* aligned = (char*)align_up((uintptr_t)addr, IODLR_PAGE_SIZE_2M);
+  if (aligned > addr) {
+    munmap(addr, aligned - addr);
+  }
+  munmap(aligned + mapped, addr + IODLR_PAGE_SIZE_2M - aligned);
+  if (madvise(aligned, mapped, MADV_HUGEPAGE) != 0) {
+    munmap(aligned, mapped);
+    return false;
+  }
+  allocation->addr = aligned;
+  allocation->size = mapped;
+  allocation->page_size = IODLR_PAGE_SIZE_2M;
+  allocation->kind = iodlr_page_thp;
+  return true;
+}
+
+// Allocate `size` bytes with the largest pages available, up to
+// `max_page_size`, trying in turn
+// 1. 1 GB explicit huge pages,
+// 2. 2 MB explicit huge pages,
+// 3. a 2 MB aligned region advised for transparent huge pages,
+// 4. small pages.
+// Page sizes larger than `size` are skipped, so a small buffer does not take a
+// whole huge page. Explicit huge pages are reserved when they are mapped, so an
+// empty pool makes that step fail here rather than fault later. Returns false
+// only if not even small pages could be mapped. Free the memory with
+// iodlr_deallocate(allocation->addr, allocation->size).
+// Fire the allocate_return probe for a mapping made, or for none if NULL.
+static bool Allocated(const iodlr_allocation* allocation) {
+  if (allocation == NULL) {
+    IODLR_PROBE3(allocate_return, NULL, 0, iodlr_page_small);
+    return false;
+  }
+  IODLR_PROBE3(allocate_return, allocation->addr, allocation->size,
+               allocation->kind);
+  return true;
+}
+
+bool iodlr_allocate_ex(size_t size, size_t max_page_size,
+                       iodlr_allocation* allocation) {
+  IODLR_PROBE2(allocate_entry, size, max_page_size);
+  if (size == 0) {
+    errno = EINVAL;
+    return Allocated(NULL);
+  }
+  if (max_page_size >= IODLR_PAGE_SIZE_1G && size >= IODLR_PAGE_SIZE_1G) {
+    if (MapHugetlb(IODLR_PAGE_SIZE_1G, FLAGS_1G, iodlr_page_hugetlb_1g, size,
+                   allocation)) {
+      return Allocated(allocation);
+    }
+    IODLR_PROBE2(allocate_fallback, size, iodlr_page_hugetlb_1g);
+  }
+  if (max_page_size >= IODLR_PAGE_SIZE_2M && size >= IODLR_PAGE_SIZE_2M) {
+    if (MapHugetlb(IODLR_PAGE_SIZE_2M, FLAGS_2M, iodlr_page_hugetlb_2m, size,
+                   allocation)) {
+      return Allocated(allocation);
+    }
+    IODLR_PROBE2(allocate_fallback, size, iodlr_page_hugetlb_2m);
+    if (IsThpEnabled()) {
+      if (MapThp(size, allocation)) {
+        return Allocated(allocation);
+      }
+      IODLR_PROBE2(allocate_fallback, size, iodlr_page_thp);
+    }
+  }
+
+  size_t page_size = iodlr_get_default_page_size();
+  size_t mapped = align_up(size, page_size);
+  void* addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, FLAGS_4K, -1, 0);
+  if (addr == MAP_FAILED) {
+    return Allocated(NULL);
+  }
+  allocation->addr = addr;
+  allocation->size = mapped;
+  allocation->page_size = page_size;
+  allocation->kind = iodlr_page_small;
+  return Allocated(allocation);
+}
+
+// Only the transparent huge page step of iodlr_allocate_ex(): map a 2 MB
+// aligned region advised with MADV_HUGEPAGE, without taking explicit huge
+// pages, which are reserved whether touched or not. Returns false if
+// transparent huge pages are disabled.
+bool iodlr_allocate_thp(size_t size, iodlr_allocation* allocation) {
+  if (size == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  IODLR_PROBE2(allocate_entry, size, IODLR_PAGE_SIZE_2M);
+  if (!IsThpEnabled() || !MapThp(size, allocation)) {
+    return Allocated(NULL);
+  }
+  return Allocated(allocation);
+}
+
+// mmap `s` bytes with pages of up to `pgsz` bytes, falling back to smaller
+// pages as iodlr_allocate_ex() does. Returns NULL on failure.
+void* iodlr_allocate(size_t s, size_t pgsz) {
+  iodlr_allocation allocation;
+
+  if (!iodlr_allocate_ex(s, pgsz, &allocation)) {
+    return NULL;
+  }
+  return allocation.addr;
+}
+
+// Unmap memory from iodlr_allocate() or iodlr_allocate_ex(). Explicit huge
+// page mappings can only be unmapped in whole pages, so if `s` is the size
+// asked for rather than the size mapped, it is rounded up to the huge page
+// size. Other mappings end at the size asked for, rounded up to a small page,
+// as munmap() rounds `s` itself.
+void iodlr_deallocate(char* d, size_t s) {
+  IODLR_PROBE2(deallocate, d, s);
+  if (munmap(d, s) == 0 || errno != EINVAL) {
+    return;
+  }
+  if (munmap(d, align_up(s, IODLR_PAGE_SIZE_2M)) == 0 || errno != EINVAL) {
+    return;
+  }
+  munmap(d, align_up(s, IODLR_PAGE_SIZE_1G));
+}
+
+const char* iodlr_page_kind_str(iodlr_page_kind kind) {
+  switch (kind) {
+    case iodlr_page_hugetlb_1g:
+      return "hugetlb-1G";
+    case iodlr_page_hugetlb_2m:
+      return "hugetlb-2M";
+    case iodlr_page_thp:
+      return "thp";
+    case iodlr_page_small:
+      return "small";
+  }
+  return "unknown";
+}
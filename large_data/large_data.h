@@ -0,0 +1,137 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+#ifndef LARGE_DATA_H_
+#define LARGE_DATA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IODLR_PAGE_SIZE_4K  ((size_t)4 << 10)
+#define IODLR_PAGE_SIZE_2M  ((size_t)2 << 20)
+#define IODLR_PAGE_SIZE_1G  ((size_t)1 << 30)
+
+// How the memory of an allocation is backed, from the most to the least
+// preferred. Transparent huge pages are aligned and advised, but the kernel
+// may still back parts of them with small pages.
+typedef enum {
+  iodlr_page_hugetlb_1g,
+  iodlr_page_hugetlb_2m,
+  iodlr_page_thp,
+  iodlr_page_small
+} iodlr_page_kind;
+
+typedef struct {
+  void*           addr;
+  size_t          size;       // the size asked for, rounded up to page_size
+                              // or, for transparent huge pages, a small page
+  size_t          page_size;  // 2 MB for transparent huge pages
+  iodlr_page_kind kind;
+} iodlr_allocation;
+
+// A contiguous range covered by parts with different page sizes, largest
+// first, as iodlr_allocate_mixed() returns it.
+#define IODLR_MAX_SEGMENTS 4
+
+typedef struct {
+  void*            addr;
+  size_t           size;
+  unsigned         count;
+  iodlr_allocation segments[IODLR_MAX_SEGMENTS];  // in address order
+} iodlr_layout;
+
+bool iodlr_hp_enabled(void);
+size_t iodlr_get_hp_size(void);
+size_t iodlr_get_default_page_size(void);
+
+bool iodlr_allocate_ex(size_t size, size_t max_page_size,
+                       iodlr_allocation* allocation);
+bool iodlr_allocate_thp(size_t size, iodlr_allocation* allocation);
+void* iodlr_allocate(size_t s, size_t pgsz);
+void iodlr_deallocate(char* d, size_t s);
+bool iodlr_populate(const iodlr_allocation* allocation, unsigned nthreads);
+bool iodlr_allocate_populated_ex(size_t size, size_t max_page_size,
+                                 unsigned nthreads,
+                                 iodlr_allocation* allocation);
+void* iodlr_allocate_populated(size_t s, size_t pgsz, unsigned nthreads);
+
+bool iodlr_allocate_mixed(size_t size, size_t max_page_size,
+                          iodlr_layout* layout);
+void iodlr_deallocate_mixed(const iodlr_layout* layout);
+
+bool iodlr_allocate_onnode(size_t size, size_t max_page_size, int node,
+                           iodlr_allocation* allocation);
+bool iodlr_allocate_local(size_t size, size_t max_page_size,
+                          iodlr_allocation* allocation);
+bool iodlr_allocate_interleaved(size_t size, size_t max_page_size,
+                                iodlr_allocation* allocation);
+int iodlr_numa_node_count(void);
+int iodlr_numa_current_node(void);
+int iodlr_numa_node_of(const void* addr);
+const char* iodlr_page_kind_str(iodlr_page_kind kind);
+
+// A cache of freed mappings for programs that allocate and free large buffers
+// over and over. Reusing a mapping saves the mmap() and munmap() calls, the TLB
+// shootdown of the unmap and, unless the cache is told to give the pages back,
+// the page faults and kernel zeroing of the next first touch.
+typedef enum {
+  iodlr_cache_keep,      // reused memory holds what it held when freed
+  iodlr_cache_zero,      // cleared with memset() when freed; stays resident
+  iodlr_cache_dontneed   // MADV_DONTNEED when freed; pages go back to the
+                         // system and fault in zeroed on reuse
+} iodlr_cache_clear;
+
+typedef struct {
+  size_t            max_bytes;      // total size of cached mappings
+  unsigned          max_per_class;  // cached mappings per size class
+  unsigned          max_age_ms;     // unmap mappings idle longer; 0 never
+  iodlr_cache_clear clear;
+} iodlr_cache_config;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t released;          // mappings unmapped by the limits or trims
+  size_t   cached_bytes;
+  size_t   cached_mappings;
+  uint64_t saved_syscall_ns;  // estimated mmap() and munmap() time avoided
+  uint64_t saved_fault_ns;    // at most the time to populate the reused
+                              // mappings afresh, less the time to clear them
+} iodlr_cache_stats;
+
+void iodlr_cache_configure(const iodlr_cache_config* config);
+bool iodlr_cache_allocate(size_t size, size_t max_page_size,
+                          iodlr_allocation* allocation);
+void iodlr_cache_deallocate(const iodlr_allocation* allocation);
+size_t iodlr_cache_trim(size_t keep_bytes);
+void iodlr_cache_get_stats(iodlr_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LARGE_DATA_H_
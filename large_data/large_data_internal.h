@@ -0,0 +1,95 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Helpers shared by the library, the preloaded libraries and the benchmarks.
+// Not part of the interface; everything here is static inline, so it can be
+// used in code that runs inside malloc().
+
+#ifndef LARGE_DATA_INTERNAL_H_
+#define LARGE_DATA_INTERNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../large_page-c/lp_probes.h"
+
+static inline size_t align_up(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Parse a size such as "512K", "2M", "1G" or "64MB". A number without a suffix
+// is taken as MB. `*end` is set past what was parsed, or to `text` if it does
+// not start with a number.
+static inline size_t ParseSize(const char* text, char** end) {
+  unsigned long long value = strtoull(text, end, 10);
+  size_t shift = 20;
+
+  if (*end == text) {
+    return 0;
+  }
+  switch (**end) {
+    case 'g': case 'G': shift = 30; (*end)++; break;
+    case 'm': case 'M': shift = 20; (*end)++; break;
+    case 'k': case 'K': shift = 10; (*end)++; break;
+  }
+  if (**end == 'b' || **end == 'B') {
+    (*end)++;
+  }
+  return (size_t)value << shift;
+}
+
+// ParseSize() for a whole string, such as the value of an environment
+// variable. Returns `fallback` if it is not a size.
+static inline size_t ParseSizeOr(const char* text, size_t fallback) {
+  char* end;
+  size_t size = ParseSize(text, &end);
+
+  return end == text || *end != 0 ? fallback : size;
+}
+
+typedef struct {
+  int locked;
+} spinlock;
+
+static inline void CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// A test-and-test-and-set lock for short critical sections. It needs no
+// initialization and never allocates.
+static inline void SpinLock(spinlock* lock) {
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+      CpuRelax();
+    }
+  }
+}
+
+static inline void SpinUnlock(spinlock* lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif  // LARGE_DATA_INTERNAL_H_
@@ -0,0 +1,620 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// A malloc() replacement that serves the heap from huge pages. Preload it with
+// LD_PRELOAD=liblpmalloc.so.
+//
+// Memory comes from arenas mapped with iodlr_allocate_ex(), so they use
+// explicit huge pages where the pool has room and transparent huge pages
+// otherwise. Arenas are cut into 2 MB aligned spans. A span serves one size
+// class and starts with a span_header, so free() finds the header of any
+// pointer by masking its address. Each thread keeps a cache of free objects
+// per size class, which it uses without locks; it refills from and flushes to
+// a central free list per class in batches. Requests too big for a size class
+// take a whole span, or are mapped on their own once they do not fit one.
+//
+// The objects of a size class that is a power of two start one object into
+// the span rather than right after the header, which leaves the number of
+// objects per span unchanged and aligns every object to its size. Alignments
+// beyond a small page are served from those classes.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SPAN_SIZE            IODLR_PAGE_SIZE_2M
+#define SPAN_MASK            (~(uintptr_t)(SPAN_SIZE - 1))
+#define SPAN_HEADER_SIZE     64
+#define SPAN_MAGIC           0x6e617073u  // "span"
+#define LARGE_MAGIC          0x6772616cu  // "larg"
+
+// 16 byte steps up to 128 bytes, then four classes per power of two.
+#define NUM_CLASSES          52
+#define MAX_SMALL_SIZE       ((size_t)256 << 10)
+#define MIN_ALIGNMENT        16
+#define MAX_SMALL_ALIGNMENT  4096
+
+#define DEFAULT_ARENA_SIZE   ((size_t)64 << 20)
+#define TCACHE_BATCH_BYTES   ((size_t)16 << 10)
+#define TCACHE_MAX_BATCH     64
+
+#define TLS_IE __attribute__((tls_model("initial-exec")))
+
+typedef struct {
+  uint32_t magic;
+  uint32_t size_class;
+  size_t   object_size;
+  char*    objects;       // the first object
+  void*    mapping;       // large allocations mapped on their own
+  size_t   mapping_size;
+  size_t   usable;        // large allocations: usable bytes from the pointer
+  bool     aligned;       // some objects were handed out at an offset
+} span_header;
+
+_Static_assert(sizeof(span_header) <= SPAN_HEADER_SIZE,
+               "span_header does not fit in front of the objects");
+
+typedef struct {
+  spinlock lock;
+  void*    free_list;
+  char*    bump;          // the part of the newest span not yet carved
+  char*    bump_end;
+} __attribute__((aligned(64))) central_bin;
+
+typedef struct {
+  void*    head;
+  uint32_t count;
+} tcache_bin;
+
+static central_bin central[NUM_CLASSES];
+static uint32_t class_batch[NUM_CLASSES];
+
+static spinlock span_lock;
+static char* arena_next;
+static char* arena_end;
+static void* free_spans;
+
+static spinlock init_lock;
+static bool initialized;
+static size_t arena_size = DEFAULT_ARENA_SIZE;
+static size_t max_page_size = IODLR_PAGE_SIZE_2M;
+static pthread_key_t tcache_key;
+
+static uint64_t arena_bytes[iodlr_page_small + 1];
+static uint64_t large_mapped_bytes;
+
+static __thread tcache_bin tcache[NUM_CLASSES] TLS_IE;
+static __thread bool tcache_registered TLS_IE;
+static __thread bool tcache_disabled TLS_IE;
+
+static inline unsigned SizeToClass(size_t size) {
+  if (size <= 128) {
+    return size == 0 ? 0 : (unsigned)((size - 1) >> 4);
+  }
+  size_t s = size - 1;
+  unsigned lg = 63 - __builtin_clzll(s);
+  return 8 + (lg - 7) * 4 + (unsigned)((s >> (lg - 2)) & 3);
+}
+
+static inline size_t ClassToSize(unsigned size_class) {
+  if (size_class < 8) {
+    return (size_t)(size_class + 1) << 4;
+  }
+  unsigned lg = 7 + (size_class - 8) / 4;
+  return ((size_t)1 << lg) + (((size_class - 8) % 4 + 1) << (lg - 2));
+}
+
+// Where the first object of a span of `object_size` objects starts.
+static inline size_t FirstObjectOffset(size_t object_size) {
+  return object_size > SPAN_HEADER_SIZE &&
+         (object_size & (object_size - 1)) == 0 ? object_size :
+         SPAN_HEADER_SIZE;
+}
+
+static inline span_header* SpanOf(const void* ptr) {
+  return (span_header*)(((uintptr_t)ptr - 1) & SPAN_MASK);
+}
+
+// Write a message without stdio, which may allocate.
+static void Say(const char* text) {
+  ssize_t ignored = write(STDERR_FILENO, text, strlen(text));
+  (void)ignored;
+}
+
+static void __attribute__((noreturn)) Corrupted(const char* what) {
+  Say("lpmalloc: ");
+  Say(what);
+  Say(": invalid pointer\n");
+  abort();
+}
+
+static void ThreadExit(void* unused);
+
+static void Initialize(void) {
+  SpinLock(&init_lock);
+  if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+    const char* env = getenv("LPMALLOC_PAGE_SIZE");
+    if (env != NULL) {
+      max_page_size = ParseSizeOr(env, max_page_size);
+    }
+    env = getenv("LPMALLOC_ARENA_SIZE");
+    if (env != NULL) {
+      arena_size = ParseSizeOr(env, arena_size);
+    }
+    if (arena_size < max_page_size) {
+      arena_size = max_page_size;
+    }
+    arena_size = align_up(arena_size, SPAN_SIZE);
+
+    for (unsigned i = 0; i < NUM_CLASSES; i++) {
+      size_t batch = TCACHE_BATCH_BYTES / ClassToSize(i);
+      class_batch[i] = batch < 1 ? 1 :
+                       batch > TCACHE_MAX_BATCH ? TCACHE_MAX_BATCH : batch;
+    }
+    pthread_key_create(&tcache_key, ThreadExit);
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+  }
+  SpinUnlock(&init_lock);
+}
+
+static inline void EnsureInitialized(void) {
+  if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+    Initialize();
+  }
+}
+
+// Map `size` bytes aligned to a span. Explicit and transparent huge page
+// mappings already are; a small page mapping is redone with room to align it.
+static bool MapSpans(size_t size, iodlr_allocation* allocation) {
+  if (!iodlr_allocate_ex(size, max_page_size, allocation)) {
+    return false;
+  }
+  if (((uintptr_t)allocation->addr & ~SPAN_MASK) == 0) {
+    return true;
+  }
+  iodlr_deallocate(allocation->addr, allocation->size);
+
+  size_t mapped = align_up(size, SPAN_SIZE);
+  char* addr = mmap(NULL, mapped + SPAN_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  char* aligned = (char*)align_up((uintptr_t)addr, SPAN_SIZE);
+  if (aligned > addr) {
+    munmap(addr, aligned - addr);
+  }
+  munmap(aligned + mapped, addr + SPAN_SIZE - aligned);
+  allocation->addr = aligned;
+  allocation->size = mapped;
+  return true;
+}
+
+// Take a span from the central free list, or carve one from the current
+// arena, mapping a new arena when it is used up.
+static void* NewSpan(void) {
+  void* span;
+
+  SpinLock(&span_lock);
+  span = free_spans;
+  if (span != NULL) {
+    free_spans = *(void**)span;
+  } else {
+    if (arena_next == arena_end) {
+      iodlr_allocation allocation;
+      if (!MapSpans(arena_size, &allocation)) {
+        SpinUnlock(&span_lock);
+        return NULL;
+      }
+      arena_next = allocation.addr;
+      arena_end = arena_next + allocation.size;
+      arena_bytes[allocation.kind] += allocation.size;
+    }
+    span = arena_next;
+    arena_next += SPAN_SIZE;
+  }
+  SpinUnlock(&span_lock);
+  return span;
+}
+
+static void FreeSpan(void* span) {
+  SpinLock(&span_lock);
+  *(void**)span = free_spans;
+  free_spans = span;
+  SpinUnlock(&span_lock);
+}
+
+// Move up to a batch of objects of `size_class` from the central bin into the
+// calling thread's cache, and return one more for the caller.
+static void* Refill(unsigned size_class) {
+  central_bin* bin = &central[size_class];
+  tcache_bin* cache = &tcache[size_class];
+  size_t object_size = ClassToSize(size_class);
+  uint32_t wanted = tcache_disabled ? 1 : class_batch[size_class] + 1;
+  void* result = NULL;
+
+  SpinLock(&bin->lock);
+  while (wanted > 0) {
+    void* obj = bin->free_list;
+    if (obj != NULL) {
+      bin->free_list = *(void**)obj;
+    } else {
+      if (bin->bump + object_size > bin->bump_end) {
+        span_header* span = NewSpan();
+        if (span == NULL) {
+          break;
+        }
+        span->magic = SPAN_MAGIC;
+        span->size_class = size_class;
+        span->object_size = object_size;
+        span->objects = (char*)span + FirstObjectOffset(object_size);
+        span->aligned = false;
+        bin->bump = span->objects;
+        bin->bump_end = (char*)span + SPAN_SIZE;
+      }
+      obj = bin->bump;
+      bin->bump += object_size;
+    }
+    if (result == NULL) {
+      result = obj;
+    } else {
+      *(void**)obj = cache->head;
+      cache->head = obj;
+      cache->count++;
+    }
+    wanted--;
+  }
+  SpinUnlock(&bin->lock);
+  return result;
+}
+
+// Return the oldest half of the cache of `size_class`, or all of it, to the
+// central bin.
+static void Flush(unsigned size_class, uint32_t keep) {
+  tcache_bin* cache = &tcache[size_class];
+  central_bin* bin = &central[size_class];
+
+  if (cache->count <= keep) {
+    return;
+  }
+  void** last = &cache->head;
+  for (uint32_t i = 0; i < keep; i++) {
+    last = (void**)*last;
+  }
+  void* first = *last;
+  void* tail = first;
+  while (*(void**)tail != NULL) {
+    tail = *(void**)tail;
+  }
+  *last = NULL;
+  cache->count = keep;
+
+  SpinLock(&bin->lock);
+  *(void**)tail = bin->free_list;
+  bin->free_list = first;
+  SpinUnlock(&bin->lock);
+}
+
+static void ThreadExit(void* unused) {
+  (void)unused;
+  tcache_disabled = true;
+  for (unsigned i = 0; i < NUM_CLASSES; i++) {
+    Flush(i, 0);
+  }
+}
+
+static void* AllocSmallSlow(unsigned size_class) {
+  EnsureInitialized();
+  if (!tcache_registered && !tcache_disabled) {
+    // pthread_setspecific() may allocate, so mark the thread first.
+    tcache_registered = true;
+    pthread_setspecific(tcache_key, (void*)1);
+  }
+  void* obj = Refill(size_class);
+  if (obj == NULL) {
+    errno = ENOMEM;
+  }
+  return obj;
+}
+
+static inline void* AllocSmall(size_t size) {
+  unsigned size_class = SizeToClass(size);
+  tcache_bin* cache = &tcache[size_class];
+  void* obj = cache->head;
+
+  if (__builtin_expect(obj != NULL, 1)) {
+    cache->head = *(void**)obj;
+    cache->count--;
+    return obj;
+  }
+  return AllocSmallSlow(size_class);
+}
+
+// Allocate `size` bytes aligned to `alignment` beyond the size classes. Up to
+// a span they take a span from the central free list; bigger ones are mapped
+// on their own, with the header in the span below the pointer.
+static void* AllocLarge(size_t size, size_t alignment) {
+  size_t offset = alignment > SPAN_HEADER_SIZE ? alignment : SPAN_HEADER_SIZE;
+  span_header* span;
+  char* ptr;
+
+  EnsureInitialized();
+  if (offset < SPAN_SIZE && size <= SPAN_SIZE - offset) {
+    span = NewSpan();
+    if (span == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    ptr = (char*)span + offset;
+    span->mapping = NULL;
+    span->mapping_size = 0;
+    span->usable = SPAN_SIZE - offset;
+  } else {
+    iodlr_allocation allocation;
+    if (size > SIZE_MAX - offset || !MapSpans(size + offset, &allocation)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    ptr = (char*)align_up((uintptr_t)allocation.addr + SPAN_HEADER_SIZE,
+                         alignment);
+    span = SpanOf(ptr);
+    span->mapping = allocation.addr;
+    span->mapping_size = allocation.size;
+    span->usable = (char*)allocation.addr + allocation.size - ptr;
+    __atomic_add_fetch(&large_mapped_bytes, allocation.size, __ATOMIC_RELAXED);
+  }
+  span->magic = LARGE_MAGIC;
+  span->size_class = NUM_CLASSES;
+  span->object_size = 0;
+  span->objects = ptr;
+  span->aligned = false;
+  return ptr;
+}
+
+static void FreeLarge(span_header* span, void* ptr) {
+  if (span->magic != LARGE_MAGIC || span->objects != ptr) {
+    Corrupted("free");
+  }
+  span->magic = 0;
+  if (span->mapping == NULL) {
+    FreeSpan(span);
+    return;
+  }
+  __atomic_sub_fetch(&large_mapped_bytes, span->mapping_size,
+                     __ATOMIC_RELAXED);
+  iodlr_deallocate(span->mapping, span->mapping_size);
+}
+
+static inline char* ObjectStart(const span_header* span, const void* ptr) {
+  size_t index = ((const char*)ptr - span->objects) / span->object_size;
+  return span->objects + index * span->object_size;
+}
+
+// malloc() itself is not called from here: the compiler turns malloc() and
+// memset() into calloc(), which would then call itself.
+static inline void* Allocate(size_t size) {
+  if (__builtin_expect(size <= MAX_SMALL_SIZE, 1)) {
+    return AllocSmall(size);
+  }
+  return AllocLarge(size, MIN_ALIGNMENT);
+}
+
+static void* AllocAligned(size_t alignment, size_t size) {
+  if (alignment <= MIN_ALIGNMENT) {
+    return Allocate(size);
+  }
+  // With no room past the aligned pointer, a zero size request could be
+  // aligned onto the start of the next object.
+  if (size == 0) {
+    size = 1;
+  }
+  if (alignment <= MAX_SMALL_ALIGNMENT &&
+      size <= MAX_SMALL_SIZE - (alignment - MIN_ALIGNMENT)) {
+    char* obj = AllocSmall(size + alignment - MIN_ALIGNMENT);
+    if (obj == NULL) {
+      return NULL;
+    }
+    char* ptr = (char*)align_up((uintptr_t)obj, alignment);
+    // Other threads read the flag in free().
+    if (ptr != obj) {
+      __atomic_store_n(&SpanOf(obj)->aligned, true, __ATOMIC_RELAXED);
+    }
+    return ptr;
+  }
+  // A power of two class at least as large as the alignment.
+  if (size <= MAX_SMALL_SIZE && alignment <= MAX_SMALL_SIZE) {
+    size_t block = size > alignment ?
+                   (size_t)1 << (64 - __builtin_clzll(size - 1)) : alignment;
+    if (block <= MAX_SMALL_SIZE) {
+      return AllocSmall(block);
+    }
+  }
+  return AllocLarge(size, alignment);
+}
+
+void* malloc(size_t size) {
+  return Allocate(size);
+}
+
+void free(void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  span_header* span = SpanOf(ptr);
+  if (__builtin_expect(span->magic == SPAN_MAGIC, 1)) {
+    unsigned size_class = span->size_class;
+    tcache_bin* cache = &tcache[size_class];
+    if (__atomic_load_n(&span->aligned, __ATOMIC_RELAXED)) {
+      ptr = ObjectStart(span, ptr);
+    }
+    *(void**)ptr = cache->head;
+    cache->head = ptr;
+    if (++cache->count > 2 * class_batch[size_class] || tcache_disabled) {
+      Flush(size_class, tcache_disabled ? 0 : class_batch[size_class]);
+    }
+    return;
+  }
+  FreeLarge(span, ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+  size_t total;
+
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void* ptr = Allocate(total);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  // A mapping of its own is fresh from the kernel and already zeroed.
+  span_header* span = SpanOf(ptr);
+  if (span->magic != LARGE_MAGIC || span->mapping == NULL) {
+    memset(ptr, 0, total);
+  }
+  return ptr;
+}
+
+size_t malloc_usable_size(void* ptr) {
+  if (ptr == NULL) {
+    return 0;
+  }
+  span_header* span = SpanOf(ptr);
+  if (span->magic == SPAN_MAGIC) {
+    if (__atomic_load_n(&span->aligned, __ATOMIC_RELAXED)) {
+      return ObjectStart(span, ptr) + span->object_size - (char*)ptr;
+    }
+    return span->object_size;
+  }
+  if (span->magic != LARGE_MAGIC || span->objects != ptr) {
+    Corrupted("malloc_usable_size");
+  }
+  return span->usable;
+}
+
+void* realloc(void* ptr, size_t size) {
+  if (ptr == NULL) {
+    return Allocate(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  // Keep the block unless it would shrink to less than half.
+  size_t usable = malloc_usable_size(ptr);
+  if (size <= usable && size >= usable / 2) {
+    return ptr;
+  }
+  void* result = Allocate(size);
+  if (result == NULL) {
+    return NULL;
+  }
+  memcpy(result, ptr, size < usable ? size : usable);
+  free(ptr);
+  return result;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void* ptr = AllocAligned(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return AllocAligned(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size) {
+  return AllocAligned(iodlr_get_default_page_size(), size);
+}
+
+void* pvalloc(size_t size) {
+  size_t page_size = iodlr_get_default_page_size();
+  return AllocAligned(page_size, align_up(size, page_size));
+}
+
+// Hold every lock across fork() so the child does not inherit one taken by a
+// thread that no longer exists.
+static void ForkPrepare(void) {
+  SpinLock(&init_lock);
+  for (unsigned i = 0; i < NUM_CLASSES; i++) {
+    SpinLock(&central[i].lock);
+  }
+  SpinLock(&span_lock);
+}
+
+static void ForkDone(void) {
+  SpinUnlock(&span_lock);
+  for (unsigned i = NUM_CLASSES; i-- > 0;) {
+    SpinUnlock(&central[i].lock);
+  }
+  SpinUnlock(&init_lock);
+}
+
+static void __attribute__((constructor)) Setup(void) {
+  EnsureInitialized();
+  pthread_atfork(ForkPrepare, ForkDone, ForkDone);
+}
+
+static void __attribute__((destructor)) PrintStats(void) {
+  char line[256];
+
+  if (getenv("LPMALLOC_STATS") == NULL) {
+    return;
+  }
+  for (int kind = 0; kind <= iodlr_page_small; kind++) {
+    if (arena_bytes[kind] == 0) {
+      continue;
+    }
+    snprintf(line, sizeof(line), "lpmalloc: arenas on %s pages: %llu MB\n",
+             iodlr_page_kind_str(kind),
+             (unsigned long long)(arena_bytes[kind] >> 20));
+    Say(line);
+  }
+  snprintf(line, sizeof(line), "lpmalloc: large mappings in use: %llu MB\n",
+           (unsigned long long)(large_mapped_bytes >> 20));
+  Say(line);
+}
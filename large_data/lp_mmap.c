@@ -0,0 +1,304 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Put large anonymous mmap() calls on huge pages. Preload it with
+// LD_PRELOAD=liblpmmap.so.
+//
+// Private anonymous mappings of at least LPMMAP_THRESHOLD bytes that leave the
+// placement to the kernel are promoted; file mappings, small mappings and
+// mappings at a given address are passed through. In the default "thp" mode a
+// promoted mapping is placed on a 2 MB boundary and advised with
+// MADV_HUGEPAGE; its length is kept, since the caller may own the address
+// space right after it. In "hugetlb" mode read-write mappings are allocated
+// with iodlr_allocate_ex() instead, so they get explicit huge pages while the
+// pool has room. Their length is rounded up to the page size, and munmap()
+// rounds it again when the caller unmaps the size it asked for.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define ALIGNMENT            IODLR_PAGE_SIZE_2M
+#define DEFAULT_THRESHOLD    IODLR_PAGE_SIZE_2M
+#define MAX_HUGETLB_MAPPINGS 1024
+
+#define SKIPPED_FLAGS (MAP_FIXED | MAP_FIXED_NOREPLACE | MAP_HUGETLB | \
+                       MAP_GROWSDOWN | MAP_STACK | MAP_SHARED)
+
+#define TLS_IE __attribute__((tls_model("initial-exec")))
+
+typedef enum {
+  mode_thp,
+  mode_hugetlb,
+  mode_off
+} promote_mode;
+
+// A hugetlb mapping whose length was rounded up past what the caller asked.
+typedef struct {
+  char* requested_end;
+  char* mapped_end;
+} hugetlb_mapping;
+
+static bool configured;
+static promote_mode mode = mode_thp;
+static size_t threshold = DEFAULT_THRESHOLD;
+static size_t max_page_size = IODLR_PAGE_SIZE_1G;
+static size_t small_page_size;
+
+static spinlock table_lock;
+static hugetlb_mapping table[MAX_HUGETLB_MAPPINGS];
+static unsigned table_count;
+
+static uint64_t promoted_mappings;
+static uint64_t promoted_bytes[iodlr_page_small + 1];
+static uint64_t passed_bytes;
+
+static __thread bool busy TLS_IE;
+
+static inline void* RealMmap(void* addr, size_t length, int prot, int flags,
+                             int fd, off_t offset) {
+  return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+static inline int RealMunmap(void* addr, size_t length) {
+  return (int)syscall(SYS_munmap, addr, length);
+}
+
+// Write a message without stdio, which may allocate; this can run inside a
+// malloc() that is growing its heap.
+static void Say(const char* text) {
+  ssize_t ignored = write(STDERR_FILENO, text, strlen(text));
+  (void)ignored;
+}
+
+static void Configure(void) {
+  const char* env;
+
+  small_page_size = iodlr_get_default_page_size();
+  env = getenv("LPMMAP_MODE");
+  if (env != NULL) {
+    if (strcmp(env, "hugetlb") == 0) {
+      mode = mode_hugetlb;
+    } else if (strcmp(env, "off") == 0) {
+      mode = mode_off;
+    } else if (strcmp(env, "thp") != 0) {
+      Say("lpmmap: unknown LPMMAP_MODE, using thp\n");
+    }
+  }
+  env = getenv("LPMMAP_THRESHOLD");
+  if (env != NULL) {
+    threshold = ParseSizeOr(env, threshold);
+  }
+  env = getenv("LPMMAP_PAGE_SIZE");
+  if (env != NULL) {
+    max_page_size = ParseSizeOr(env, max_page_size);
+  }
+  __atomic_store_n(&configured, true, __ATOMIC_RELEASE);
+}
+
+static void Count(iodlr_page_kind kind, size_t length) {
+  __atomic_add_fetch(&promoted_mappings, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&promoted_bytes[kind], length, __ATOMIC_RELAXED);
+}
+
+static void Populate(void* addr, size_t length, int prot) {
+  madvise(addr, length,
+          prot & PROT_WRITE ? MADV_POPULATE_WRITE : MADV_POPULATE_READ);
+}
+
+// Map `length` bytes on a 2 MB boundary by mapping 2 MB more and trimming the
+// ends, then advise transparent huge pages.
+static void* MapThp(size_t length, int prot, int flags) {
+  char* addr = RealMmap(NULL, length + ALIGNMENT, prot,
+                        flags & ~MAP_POPULATE, -1, 0);
+
+  if (addr == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  char* aligned = (char*)align_up((uintptr_t)addr, ALIGNMENT);
+  if (aligned > addr) {
+    RealMunmap(addr, aligned - addr);
+  }
+  RealMunmap(aligned + length, addr + ALIGNMENT - aligned);
+  if (madvise(aligned, length, MADV_HUGEPAGE) == 0) {
+    Count(iodlr_page_thp, length);
+  }
+  if (flags & MAP_POPULATE) {
+    Populate(aligned, length, prot);
+  }
+  return aligned;
+}
+
+static bool Remember(char* start, size_t length, size_t mapped) {
+  bool stored = false;
+
+  SpinLock(&table_lock);
+  if (table_count < MAX_HUGETLB_MAPPINGS) {
+    table[table_count].requested_end = start + length;
+    table[table_count].mapped_end = start + mapped;
+    table_count++;
+    stored = true;
+  }
+  SpinUnlock(&table_lock);
+  return stored;
+}
+
+// Allocate with iodlr_allocate_ex(). Explicit huge page mappings are
+// remembered so munmap() can round their length; anything else it fell back to
+// is trimmed to `length`.
+static void* MapHugetlb(size_t length, int prot, int flags) {
+  iodlr_allocation allocation;
+
+  if (!iodlr_allocate_ex(length, max_page_size, &allocation)) {
+    return MAP_FAILED;
+  }
+  char* addr = allocation.addr;
+  if (allocation.kind == iodlr_page_hugetlb_1g ||
+      allocation.kind == iodlr_page_hugetlb_2m) {
+    if (allocation.size > length &&
+        !Remember(addr, length, allocation.size)) {
+      iodlr_deallocate(addr, allocation.size);
+      return MapThp(length, prot, flags);
+    }
+  } else if (allocation.size > length) {
+    RealMunmap(addr + length, allocation.size - length);
+  }
+  if (allocation.kind != iodlr_page_small) {
+    Count(allocation.kind, length);
+  }
+  if (flags & MAP_POPULATE) {
+    Populate(addr, length, prot);
+  }
+  return addr;
+}
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  if (busy || addr != NULL || fd != -1 || !(flags & MAP_ANONYMOUS) ||
+      (flags & SKIPPED_FLAGS) || !(flags & MAP_PRIVATE)) {
+    return RealMmap(addr, length, prot, flags, fd, offset);
+  }
+  if (!__atomic_load_n(&configured, __ATOMIC_ACQUIRE)) {
+    Configure();
+  }
+  if (mode == mode_off || length < threshold) {
+    return RealMmap(addr, length, prot, flags, fd, offset);
+  }
+
+  void* result;
+  size_t rounded = align_up(length, small_page_size);
+  busy = true;
+  if (mode == mode_hugetlb && prot == (PROT_READ | PROT_WRITE) &&
+      !(flags & MAP_NORESERVE)) {
+    result = MapHugetlb(rounded, prot, flags);
+  } else {
+    result = MapThp(rounded, prot, flags);
+  }
+  busy = false;
+  if (result == MAP_FAILED) {
+    __atomic_add_fetch(&passed_bytes, length, __ATOMIC_RELAXED);
+    return RealMmap(addr, length, prot, flags, fd, offset);
+  }
+  return result;
+}
+
+void* mmap64(void* addr, size_t length, int prot, int flags, int fd,
+             off_t offset) __attribute__((alias("mmap")));
+
+// Explicit huge page mappings only unmap in whole pages. If the caller unmaps
+// through the end it asked for, unmap through the end that was mapped.
+int munmap(void* addr, size_t length) {
+  if (__atomic_load_n(&table_count, __ATOMIC_RELAXED) == 0) {
+    return RealMunmap(addr, length);
+  }
+
+  char* start = addr;
+  char* end = start + align_up(length, small_page_size);
+  SpinLock(&table_lock);
+  for (unsigned i = 0; i < table_count; i++) {
+    if (start < table[i].requested_end && end >= table[i].requested_end &&
+        end < table[i].mapped_end) {
+      end = table[i].mapped_end;
+    }
+  }
+  int result = RealMunmap(start, end - start);
+  if (result == 0) {
+    for (unsigned i = 0; i < table_count;) {
+      if (start < table[i].requested_end && end >= table[i].mapped_end) {
+        table[i] = table[--table_count];
+      } else {
+        i++;
+      }
+    }
+  }
+  SpinUnlock(&table_lock);
+  return result;
+}
+
+static void __attribute__((constructor)) Setup(void) {
+  if (!__atomic_load_n(&configured, __ATOMIC_ACQUIRE)) {
+    Configure();
+  }
+}
+
+static void __attribute__((destructor)) PrintStats(void) {
+  uint64_t total = 0;
+
+  if (getenv("LPMMAP_STATS") == NULL) {
+    return;
+  }
+  for (int kind = 0; kind <= iodlr_page_small; kind++) {
+    total += promoted_bytes[kind];
+  }
+  fprintf(stderr, "lpmmap: promoted %llu mappings, %llu MB",
+          (unsigned long long)promoted_mappings,
+          (unsigned long long)(total >> 20));
+  for (int kind = 0; kind < iodlr_page_small; kind++) {
+    if (promoted_bytes[kind] != 0) {
+      fprintf(stderr, ", %s %llu MB", iodlr_page_kind_str(kind),
+              (unsigned long long)(promoted_bytes[kind] >> 20));
+    }
+  }
+  fprintf(stderr, "; %llu MB failed and were mapped as asked\n",
+          (unsigned long long)(passed_bytes >> 20));
+}
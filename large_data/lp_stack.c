@@ -0,0 +1,506 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Give threads stacks on huge pages. Preload it with LD_PRELOAD=liblpstack.so.
+//
+// pthread_create() is interposed to create threads on a stack from the
+// large_data allocation functions instead of one from glibc. A stack grows
+// down from its top, where glibc also keeps the thread descriptor and TLS, so
+// an idle thread only ever touches the top. In the default "thp" mode the top
+// LPSTACK_SMALL_TOP bytes are kept on small pages and the rest is advised for
+// transparent huge pages: only threads that recurse deeper fault in 2 MB
+// pages. In "hugetlb" mode the whole stack takes explicit huge pages, which
+// are reserved up front. A guard region below the stack is kept inaccessible
+// as glibc does.
+//
+// glibc does not free stacks it was given, so threads are always created
+// joinable and their stacks are recycled when they are joined. Threads
+// created detached, or detached later, are joined here once they have exited.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define DEFAULT_SMALL_TOP  IODLR_PAGE_SIZE_2M
+#define DEFAULT_CACHE      16
+
+typedef enum {
+  mode_thp,
+  mode_hugetlb,
+  mode_off
+} stack_mode;
+
+typedef struct stack_entry {
+  struct stack_entry* next;
+  pthread_t           thread;
+  char*               mapping;
+  size_t              mapping_size;
+  char*               guard;          // if mapped separately below the mapping
+  size_t              guard_size;
+  char*               stack;
+  size_t              stack_size;
+  iodlr_page_kind     kind;
+  bool                detached;
+} stack_entry;
+
+typedef struct {
+  void*        (*start)(void*);
+  void*        arg;
+  stack_entry* entry;
+} start_args;
+
+typedef int (*create_function)(pthread_t*, const pthread_attr_t*,
+                               void* (*)(void*), void*);
+typedef int (*join_function)(pthread_t, void**);
+typedef int (*timedjoin_function)(pthread_t, void**, const struct timespec*);
+typedef int (*detach_function)(pthread_t);
+typedef int (*setstack_function)(pthread_attr_t*, void*, size_t);
+
+static create_function real_create;
+static join_function real_join;
+static join_function real_tryjoin;
+static timedjoin_function real_timedjoin;
+static detach_function real_detach;
+static setstack_function real_setstack;
+
+static pthread_mutex_t stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+static stack_entry* running;
+static stack_entry* cached;
+static unsigned cached_count;
+
+static stack_mode mode = mode_thp;
+static size_t small_top = DEFAULT_SMALL_TOP;
+static unsigned cache_limit = DEFAULT_CACHE;
+static size_t page_size;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+static uint64_t stacks_mapped[iodlr_page_small + 1];
+static uint64_t stacks_reused;
+static uint64_t threads_passed;
+
+static inline size_t AlignDown(size_t value, size_t alignment) {
+  return value & ~(alignment - 1);
+}
+
+static void Setup(void) {
+  const char* env;
+
+  real_create = (create_function)dlsym(RTLD_NEXT, "pthread_create");
+  real_join = (join_function)dlsym(RTLD_NEXT, "pthread_join");
+  real_tryjoin = (join_function)dlsym(RTLD_NEXT, "pthread_tryjoin_np");
+  real_timedjoin =
+      (timedjoin_function)dlsym(RTLD_NEXT, "pthread_timedjoin_np");
+  real_detach = (detach_function)dlsym(RTLD_NEXT, "pthread_detach");
+  real_setstack = (setstack_function)dlsym(RTLD_NEXT, "pthread_attr_setstack");
+  page_size = iodlr_get_default_page_size();
+
+  env = getenv("LPSTACK_MODE");
+  if (env != NULL) {
+    if (strcmp(env, "hugetlb") == 0) {
+      mode = mode_hugetlb;
+    } else if (strcmp(env, "off") == 0) {
+      mode = mode_off;
+    } else if (strcmp(env, "thp") != 0) {
+      fprintf(stderr, "lpstack: unknown LPSTACK_MODE %s, using thp\n", env);
+    }
+  }
+  env = getenv("LPSTACK_SMALL_TOP");
+  if (env != NULL) {
+    small_top = align_up(ParseSizeOr(env, small_top), IODLR_PAGE_SIZE_2M);
+  }
+  env = getenv("LPSTACK_CACHE");
+  if (env != NULL) {
+    cache_limit = atoi(env);
+  }
+}
+
+static inline void EnsureSetup(void) {
+  pthread_once(&setup_once, Setup);
+}
+
+// Put an inaccessible guard of `size` bytes right below `addr`. Returns false
+// if the address space there is taken.
+static bool MapGuardBelow(char* addr, size_t size) {
+  char* guard = mmap(addr - size, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                     MAP_FIXED_NOREPLACE, -1, 0);
+
+  if (guard == MAP_FAILED) {
+    return false;
+  }
+  if (guard != addr - size) {
+    // Kernels before 4.17 take the address as a hint only.
+    munmap(guard, size);
+    return false;
+  }
+  return true;
+}
+
+// Map a stack of at least `size` usable bytes with a guard of `guard_size`.
+static stack_entry* MapStack(size_t size, size_t guard_size) {
+  iodlr_allocation allocation;
+  stack_entry* entry = calloc(1, sizeof(stack_entry));
+
+  if (entry == NULL) {
+    return NULL;
+  }
+  guard_size = align_up(guard_size, page_size);
+  allocation.addr = NULL;
+  if (mode == mode_hugetlb &&
+      iodlr_allocate_ex(align_up(size, IODLR_PAGE_SIZE_2M), IODLR_PAGE_SIZE_2M,
+                        &allocation) &&
+      allocation.kind != iodlr_page_hugetlb_2m) {
+    // Out of explicit huge pages: use the transparent huge page layout.
+    iodlr_deallocate(allocation.addr, allocation.size);
+    allocation.addr = NULL;
+  }
+
+  if (allocation.addr != NULL) {
+    entry->mapping = allocation.addr;
+    entry->mapping_size = allocation.size;
+    entry->stack = allocation.addr;
+    entry->stack_size = allocation.size;
+    if (guard_size > 0) {
+      if (MapGuardBelow(allocation.addr, guard_size)) {
+        entry->guard = (char*)allocation.addr - guard_size;
+        entry->guard_size = guard_size;
+      } else {
+        // Give up the lowest huge page instead.
+        mprotect(allocation.addr, IODLR_PAGE_SIZE_2M, PROT_NONE);
+        entry->stack += IODLR_PAGE_SIZE_2M;
+        entry->stack_size -= IODLR_PAGE_SIZE_2M;
+        entry->guard_size = IODLR_PAGE_SIZE_2M;
+      }
+    }
+  } else {
+    size_t mapped = align_up(size + guard_size, IODLR_PAGE_SIZE_2M);
+    if (!iodlr_allocate_thp(mapped, &allocation)) {
+      free(entry);
+      return NULL;
+    }
+    entry->mapping = allocation.addr;
+    entry->mapping_size = allocation.size;
+    entry->stack = (char*)allocation.addr + guard_size;
+    entry->stack_size = allocation.size - guard_size;
+    entry->guard_size = guard_size;
+    if (guard_size > 0) {
+      mprotect(allocation.addr, guard_size, PROT_NONE);
+    }
+    if (small_top > 0) {
+      size_t top = small_top < allocation.size ? small_top : allocation.size;
+      madvise((char*)allocation.addr + allocation.size - top, top,
+              MADV_NOHUGEPAGE);
+    }
+  }
+  entry->kind = allocation.kind;
+  __atomic_add_fetch(&stacks_mapped[allocation.kind], 1, __ATOMIC_RELAXED);
+  return entry;
+}
+
+static void UnmapStack(stack_entry* entry) {
+  if (entry->guard != NULL) {
+    munmap(entry->guard, entry->guard_size);
+  }
+  iodlr_deallocate(entry->mapping, entry->mapping_size);
+  free(entry);
+}
+
+// Take a cached stack that fits, or map a new one. Called with stacks_lock
+// held.
+static stack_entry* GetStack(size_t size, size_t guard_size) {
+  for (stack_entry** link = &cached; *link != NULL; link = &(*link)->next) {
+    stack_entry* entry = *link;
+    if (entry->stack_size >= size && entry->stack_size < 2 * size &&
+        entry->guard_size >= guard_size) {
+      *link = entry->next;
+      cached_count--;
+      __atomic_add_fetch(&stacks_reused, 1, __ATOMIC_RELAXED);
+      return entry;
+    }
+  }
+  return MapStack(size, guard_size);
+}
+
+// Called with stacks_lock held.
+static void PutStack(stack_entry* entry) {
+  if (cached_count < cache_limit) {
+    entry->detached = false;
+    entry->next = cached;
+    cached = entry;
+    cached_count++;
+  } else {
+    UnmapStack(entry);
+  }
+}
+
+// Remove the entry of `thread` from the running list. Called with stacks_lock
+// held.
+static stack_entry* TakeRunning(pthread_t thread) {
+  for (stack_entry** link = &running; *link != NULL; link = &(*link)->next) {
+    if (pthread_equal((*link)->thread, thread)) {
+      stack_entry* entry = *link;
+      *link = entry->next;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Join the detached threads that have exited and recycle their stacks.
+// Called with stacks_lock held.
+static void ReapDetached(void) {
+  stack_entry** link = &running;
+
+  while (*link != NULL) {
+    stack_entry* entry = *link;
+    if (entry->detached && real_tryjoin(entry->thread, NULL) == 0) {
+      *link = entry->next;
+      PutStack(entry);
+    } else {
+      link = &entry->next;
+    }
+  }
+}
+
+static void* StartThread(void* arg) {
+  start_args args = *(start_args*)arg;
+
+  free(arg);
+  // The new thread can hand its id out before pthread_create() returns.
+  args.entry->thread = pthread_self();
+  return args.start(args.arg);
+}
+
+// Copy the attributes of `from` that apply with a stack of our own.
+static int CopyAttributes(const pthread_attr_t* from, pthread_attr_t* to,
+                          size_t* stack_size, size_t* guard_size,
+                          bool* detached) {
+  int state = PTHREAD_CREATE_JOINABLE;
+  int result = pthread_getattr_default_np(to);
+
+  if (result != 0) {
+    return result;
+  }
+  if (from != NULL) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    sigset_t mask;
+    int value;
+
+    pthread_attr_getdetachstate(from, &state);
+    if (pthread_attr_getinheritsched(from, &value) == 0) {
+      pthread_attr_setinheritsched(to, value);
+    }
+    if (pthread_attr_getschedpolicy(from, &value) == 0) {
+      pthread_attr_setschedpolicy(to, value);
+    }
+    if (pthread_attr_getschedparam(from, &param) == 0) {
+      pthread_attr_setschedparam(to, &param);
+    }
+    if (pthread_attr_getscope(from, &value) == 0) {
+      pthread_attr_setscope(to, value);
+    }
+    if (pthread_attr_getaffinity_np(from, sizeof(cpus), &cpus) == 0) {
+      pthread_attr_setaffinity_np(to, sizeof(cpus), &cpus);
+    }
+    if (pthread_attr_getsigmask_np(from, &mask) == 0) {
+      pthread_attr_setsigmask_np(to, &mask);
+    }
+  }
+  pthread_attr_getstacksize(from != NULL ? from : to, stack_size);
+  pthread_attr_getguardsize(from != NULL ? from : to, guard_size);
+  *detached = state == PTHREAD_CREATE_DETACHED;
+  return 0;
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                   void* (*start)(void*), void* arg) {
+  pthread_attr_t ours;
+  size_t stack_size;
+  size_t guard_size;
+  bool detached;
+
+  EnsureSetup();
+  if (mode == mode_off) {
+    return real_create(thread, attr, start, arg);
+  }
+  if (attr != NULL) {
+    void* user_stack;
+    size_t user_size;
+    pthread_attr_getstack(attr, &user_stack, &user_size);
+    // glibc reports the top of the stack as NULL if none was set.
+    if ((uintptr_t)user_stack + user_size != 0) {
+      return real_create(thread, attr, start, arg);
+    }
+  }
+  if (CopyAttributes(attr, &ours, &stack_size, &guard_size, &detached) != 0) {
+    return real_create(thread, attr, start, arg);
+  }
+  // Stacks that would sit entirely in the small page top gain nothing.
+  if (mode == mode_thp &&
+      align_up(stack_size, IODLR_PAGE_SIZE_2M) <= small_top) {
+    pthread_attr_destroy(&ours);
+    __atomic_add_fetch(&threads_passed, 1, __ATOMIC_RELAXED);
+    return real_create(thread, attr, start, arg);
+  }
+
+  start_args* args = malloc(sizeof(start_args));
+  if (args == NULL) {
+    pthread_attr_destroy(&ours);
+    return EAGAIN;
+  }
+  pthread_mutex_lock(&stacks_lock);
+  ReapDetached();
+  stack_entry* entry = GetStack(stack_size, guard_size);
+  pthread_mutex_unlock(&stacks_lock);
+  if (entry == NULL) {
+    free(args);
+    pthread_attr_destroy(&ours);
+    __atomic_add_fetch(&threads_passed, 1, __ATOMIC_RELAXED);
+    return real_create(thread, attr, start, arg);
+  }
+
+  args->start = start;
+  args->arg = arg;
+  args->entry = entry;
+  entry->detached = detached;
+  real_setstack(&ours, entry->stack, entry->stack_size);
+  pthread_mutex_lock(&stacks_lock);
+  int result = real_create(thread, &ours, StartThread, args);
+  if (result == 0) {
+    entry->thread = *thread;
+    entry->next = running;
+    running = entry;
+  } else {
+    free(args);
+    PutStack(entry);
+  }
+  pthread_mutex_unlock(&stacks_lock);
+  pthread_attr_destroy(&ours);
+  return result;
+}
+
+static void ReleaseJoined(pthread_t thread) {
+  pthread_mutex_lock(&stacks_lock);
+  stack_entry* entry = TakeRunning(thread);
+  if (entry != NULL) {
+    PutStack(entry);
+  }
+  pthread_mutex_unlock(&stacks_lock);
+}
+
+int pthread_join(pthread_t thread, void** retval) {
+  EnsureSetup();
+  int result = real_join(thread, retval);
+  if (result == 0) {
+    ReleaseJoined(thread);
+  }
+  return result;
+}
+
+int pthread_tryjoin_np(pthread_t thread, void** retval) {
+  EnsureSetup();
+  int result = real_tryjoin(thread, retval);
+  if (result == 0) {
+    ReleaseJoined(thread);
+  }
+  return result;
+}
+
+int pthread_timedjoin_np(pthread_t thread, void** retval,
+                         const struct timespec* abstime) {
+  EnsureSetup();
+  int result = real_timedjoin(thread, retval, abstime);
+  if (result == 0) {
+    ReleaseJoined(thread);
+  }
+  return result;
+}
+
+// Threads on our stacks stay joinable, to be joined once they exit.
+int pthread_detach(pthread_t thread) {
+  bool ours = false;
+
+  EnsureSetup();
+  pthread_mutex_lock(&stacks_lock);
+  for (stack_entry* entry = running; entry != NULL; entry = entry->next) {
+    if (pthread_equal(entry->thread, thread)) {
+      entry->detached = true;
+      ours = true;
+      break;
+    }
+  }
+  ReapDetached();
+  pthread_mutex_unlock(&stacks_lock);
+  return ours ? 0 : real_detach(thread);
+}
+
+// Stacks the program brings are its own to map, but the part below the small
+// page top can still be advised for transparent huge pages.
+int pthread_attr_setstack(pthread_attr_t* attr, void* stackaddr,
+                          size_t stacksize) {
+  EnsureSetup();
+  int result = real_setstack(attr, stackaddr, stacksize);
+  if (result == 0 && mode == mode_thp && stacksize > small_top) {
+    uintptr_t start = align_up((uintptr_t)stackaddr, IODLR_PAGE_SIZE_2M);
+    uintptr_t end = AlignDown((uintptr_t)stackaddr + stacksize - small_top,
+                              IODLR_PAGE_SIZE_2M);
+    if (end > start) {
+      madvise((void*)start, end - start, MADV_HUGEPAGE);
+    }
+  }
+  return result;
+}
+
+static void __attribute__((constructor)) Initialize(void) {
+  EnsureSetup();
+}
+
+static void __attribute__((destructor)) PrintStats(void) {
+  if (getenv("LPSTACK_STATS") == NULL) {
+    return;
+  }
+  fprintf(stderr, "lpstack: stacks mapped:");
+  for (int kind = 0; kind <= iodlr_page_small; kind++) {
+    if (stacks_mapped[kind] != 0) {
+      fprintf(stderr, " %s %llu", iodlr_page_kind_str(kind),
+              (unsigned long long)stacks_mapped[kind]);
+    }
+  }
+  fprintf(stderr, "; reused %llu; left to glibc %llu\n",
+          (unsigned long long)stacks_reused,
+          (unsigned long long)threads_passed);
+}
@@ -0,0 +1,153 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Compare malloc() implementations. Run it once as is and once with
+// LD_PRELOAD=./liblpmalloc.so; `make bench-malloc` does both.
+//
+// usage: malloc-bench [threads] [nodes in millions]
+//
+// churn: each thread replaces random blocks of 16 to 1024 bytes in a table
+//        of live blocks, measuring malloc()/free() throughput.
+// chase: builds a linked list of 64 byte nodes in shuffled order and walks
+//        it, measuring the time per node. Scattered heap objects are where
+//        huge pages cut TLB misses.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHURN_SLOTS      4096
+#define CHURN_OPS        (4 << 20)
+
+typedef struct node {
+  struct node* next;
+  uint64_t     payload[7];
+} node;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t Next(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void* Churn(void* arg) {
+  uint64_t state = 0x9e3779b97f4a7c15ull ^ (uintptr_t)arg;
+  void** slots = calloc(CHURN_SLOTS, sizeof(void*));
+
+  for (int i = 0; i < CHURN_OPS; i++) {
+    uint64_t r = Next(&state);
+    size_t slot = r % CHURN_SLOTS;
+    // Mostly small blocks, as heaps tend to be.
+    size_t size = (r >> 40) % 8 == 0 ? 16 + (r >> 32) % 1009
+                                     : 16 + (r >> 32) % 241;
+    free(slots[slot]);
+    slots[slot] = malloc(size);
+    *(char*)slots[slot] = (char)i;
+  }
+  for (int i = 0; i < CHURN_SLOTS; i++) {
+    free(slots[i]);
+  }
+  free(slots);
+  return NULL;
+}
+
+static void RunChurn(int threads) {
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  double start = Now();
+
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&ids[i], NULL, Churn, (void*)(uintptr_t)(i + 1));
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  double elapsed = Now() - start;
+  printf("churn: %d threads, %.1f M malloc+free/s\n", threads,
+         (double)threads * CHURN_OPS / elapsed / 1e6);
+  free(ids);
+}
+
+static void RunChase(size_t count) {
+  node** nodes = malloc(count * sizeof(node*));
+  uint64_t state = 0x2545f4914f6cdd1dull;
+
+  double start = Now();
+  for (size_t i = 0; i < count; i++) {
+    nodes[i] = malloc(sizeof(node));
+  }
+  double allocated = Now() - start;
+
+  for (size_t i = count - 1; i > 0; i--) {
+    size_t j = Next(&state) % (i + 1);
+    node* tmp = nodes[i];
+    nodes[i] = nodes[j];
+    nodes[j] = tmp;
+  }
+  for (size_t i = 0; i < count; i++) {
+    nodes[i]->next = nodes[(i + 1) % count];
+  }
+
+  node* cursor = nodes[0];
+  start = Now();
+  for (size_t i = 0; i < count; i++) {
+    cursor = cursor->next;
+  }
+  double walked = Now() - start;
+  printf("chase: %zu nodes, allocated in %.0f ms, %.1f ns per node%s\n", count,
+         allocated * 1e3, walked * 1e9 / count, cursor == NULL ? "!" : "");
+
+  for (size_t i = 0; i < count; i++) {
+    free(nodes[i]);
+  }
+  free(nodes);
+}
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  double millions = argc > 2 ? atof(argv[2]) : 4;
+  const char* preload = getenv("LD_PRELOAD");
+
+  if (threads < 1 || millions <= 0) {
+    fprintf(stderr, "usage: %s [threads] [nodes in millions]\n", argv[0]);
+    return 1;
+  }
+  printf("allocator: %s\n",
+         preload != NULL && strstr(preload, "lpmalloc") != NULL ?
+         "lpmalloc" : "default");
+  RunChurn(1);
+  if (threads > 1) {
+    RunChurn(threads);
+  }
+  RunChase((size_t)(millions * 1e6));
+  return 0;
+}
@@ -0,0 +1,477 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// A cache of freed mappings from iodlr_allocate_ex(). Freed mappings are kept
+// in size classes, four per power of two, newest first, and are also linked
+// by age so the retention limits unmap the oldest first. A request is served
+// by a cached mapping at least as large, with pages no larger than it allows,
+// that wastes at most a quarter of the request beyond its page rounding.
+//
+// The lock is held only to update the lists. Mapping, unmapping and clearing
+// happen outside it.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define MIN_SHIFT      12
+#define NUM_CLASSES    ((64 - MIN_SHIFT) * 4)
+#define MAX_ENTRIES    256
+#define FAULT_SAMPLES  16
+#define SAMPLE_BYTES   ((size_t)4 << 20)
+
+#define DEFAULT_MAX_BYTES     IODLR_PAGE_SIZE_1G
+#define DEFAULT_MAX_PER_CLASS 4
+
+typedef struct cache_entry {
+  iodlr_allocation    allocation;
+  uint64_t            freed_ns;
+  uint64_t            clear_ns;   // time spent clearing it when freed
+  bool                resident;   // not given back with MADV_DONTNEED
+  unsigned            size_class;
+  struct cache_entry* prev;       // in its size class, newest first
+  struct cache_entry* next;       // also links unused and released entries
+  struct cache_entry* older;      // in all classes, by age
+  struct cache_entry* newer;
+} cache_entry;
+
+static const iodlr_cache_config default_config = {
+  DEFAULT_MAX_BYTES, DEFAULT_MAX_PER_CLASS, 0, iodlr_cache_keep
+};
+
+static spinlock lock;
+static iodlr_cache_config config = {
+  DEFAULT_MAX_BYTES, DEFAULT_MAX_PER_CLASS, 0, iodlr_cache_keep
+};
+static bool initialized;
+static cache_entry entries[MAX_ENTRIES];
+static cache_entry* unused;
+static cache_entry* classes[NUM_CLASSES];
+static unsigned class_count[NUM_CLASSES];
+static cache_entry* oldest;
+static cache_entry* newest;
+static iodlr_cache_stats stats;
+
+// Measured costs the saving estimates are based on.
+static uint64_t map_ns;
+static uint64_t map_count;
+static uint64_t unmap_ns;
+static uint64_t unmap_count;
+static uint64_t fault_ns_per_mb[iodlr_page_small + 1][FAULT_SAMPLES];
+static unsigned fault_samples[iodlr_page_small + 1];
+
+static uint64_t Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called with the lock held.
+static void Initialize(void) {
+  if (initialized) {
+    return;
+  }
+  for (int i = 0; i < MAX_ENTRIES; i++) {
+    entries[i].next = unused;
+    unused = &entries[i];
+  }
+  initialized = true;
+}
+
+static unsigned ClassOf(size_t size) {
+  if (size < ((size_t)1 << MIN_SHIFT)) {
+    return 0;
+  }
+  unsigned shift = 63 - __builtin_clzll(size);
+  unsigned index = (shift - MIN_SHIFT) * 4 + ((size >> (shift - 2)) & 3);
+  return index < NUM_CLASSES ? index : NUM_CLASSES - 1;
+}
+
+static void Link(cache_entry* entry) {
+  unsigned size_class = entry->size_class;
+
+  entry->prev = NULL;
+  entry->next = classes[size_class];
+  if (entry->next != NULL) {
+    entry->next->prev = entry;
+  }
+  classes[size_class] = entry;
+  class_count[size_class]++;
+
+  entry->older = newest;
+  entry->newer = NULL;
+  if (newest != NULL) {
+    newest->newer = entry;
+  } else {
+    oldest = entry;
+  }
+  newest = entry;
+
+  stats.cached_bytes += entry->allocation.size;
+  stats.cached_mappings++;
+}
+
+static void Unlink(cache_entry* entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    classes[entry->size_class] = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  }
+  class_count[entry->size_class]--;
+
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    oldest = entry->newer;
+  }
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    newest = entry->older;
+  }
+
+  stats.cached_bytes -= entry->allocation.size;
+  stats.cached_mappings--;
+}
+
+// Move an entry from the cache to the list of entries to unmap.
+static void Evict(cache_entry* entry, cache_entry** released) {
+  Unlink(entry);
+  entry->next = *released;
+  *released = entry;
+}
+
+// Evict the oldest entries until at most `max_bytes` are cached, and those
+// idle longer than the configured age. Called with the lock held.
+static void Enforce(size_t max_bytes, uint64_t now, cache_entry** released) {
+  uint64_t max_age_ns = (uint64_t)config.max_age_ms * 1000000;
+
+  while (oldest != NULL &&
+         (stats.cached_bytes > max_bytes ||
+          (max_age_ns != 0 && now - oldest->freed_ns > max_age_ns))) {
+    Evict(oldest, released);
+  }
+}
+
+static uint64_t Unmap(const iodlr_allocation* allocation) {
+  uint64_t start = Now();
+
+  iodlr_deallocate(allocation->addr, allocation->size);
+  return Now() - start;
+}
+
+// Unmap evicted entries, without the lock, then return them to the unused
+// list. Returns the bytes unmapped.
+static size_t Release(cache_entry* released) {
+  cache_entry* last = NULL;
+  size_t bytes = 0;
+  uint64_t ns = 0;
+  unsigned count = 0;
+
+  for (cache_entry* entry = released; entry != NULL; entry = entry->next) {
+    ns += Unmap(&entry->allocation);
+    bytes += entry->allocation.size;
+    count++;
+    last = entry;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  SpinLock(&lock);
+  unmap_ns += ns;
+  unmap_count += count;
+  stats.released += count;
+  last->next = unused;
+  unused = released;
+  SpinUnlock(&lock);
+  return bytes;
+}
+
+// The newest cached mapping that can serve `size` bytes. Called with the lock
+// held.
+static cache_entry* Find(size_t size, size_t max_page_size) {
+  size_t largest_page = max_page_size < IODLR_PAGE_SIZE_1G ?
+                        max_page_size : IODLR_PAGE_SIZE_1G;
+  unsigned last = ClassOf(align_up(size, largest_page) + size / 4);
+
+  for (unsigned size_class = ClassOf(size); size_class <= last; size_class++) {
+    for (cache_entry* entry = classes[size_class]; entry != NULL;
+         entry = entry->next) {
+      const iodlr_allocation* allocation = &entry->allocation;
+      if (allocation->size >= size &&
+          allocation->page_size <= max_page_size &&
+          allocation->size <=
+              align_up(size, allocation->page_size) + size / 4) {
+        return entry;
+      }
+    }
+  }
+  return NULL;
+}
+
+// The median of the recent times to fault in a MB of a page kind. The mean
+// would be thrown off by the odd mapping that has to compact memory.
+static uint64_t FaultNsPerMb(iodlr_page_kind kind) {
+  uint64_t sorted[FAULT_SAMPLES];
+  unsigned count = fault_samples[kind] < FAULT_SAMPLES ?
+                   fault_samples[kind] : FAULT_SAMPLES;
+
+  for (unsigned i = 0; i < count; i++) {
+    unsigned j = i;
+    for (; j > 0 && sorted[j - 1] > fault_ns_per_mb[kind][i]; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = fault_ns_per_mb[kind][i];
+  }
+  return count != 0 ? sorted[count / 2] : 0;
+}
+
+// Estimate what a hit saved from the measured costs. Called with the lock
+// held.
+static void CountHit(const cache_entry* entry) {
+  const iodlr_allocation* allocation = &entry->allocation;
+
+  stats.hits++;
+  if (map_count != 0) {
+    stats.saved_syscall_ns += map_ns / map_count;
+  }
+  if (unmap_count != 0) {
+    stats.saved_syscall_ns += unmap_ns / unmap_count;
+  }
+  if (entry->resident) {
+    uint64_t faults =
+        (allocation->size * FaultNsPerMb(allocation->kind)) >> 20;
+    if (faults > entry->clear_ns) {
+      stats.saved_fault_ns += faults - entry->clear_ns;
+    }
+  }
+}
+
+// Fault in the first pages of a new mapping, as the caller would by using
+// it, and return the time it took per MB, or 0 if they could not be
+// populated. This is what reusing a resident mapping of the same kind saves.
+// Only a prefix of whole pages is touched, so a caller that maps a large
+// buffer and uses little of it does not pay for the rest up front.
+static uint64_t SampleFaults(const iodlr_allocation* allocation) {
+  iodlr_allocation prefix = *allocation;
+  size_t bytes = align_up(SAMPLE_BYTES, allocation->page_size);
+
+  if (prefix.size > bytes) {
+    prefix.size = bytes;
+  }
+  uint64_t start = Now();
+  if (!iodlr_populate(&prefix, 1)) {
+    return 0;
+  }
+  return ((Now() - start) << 20) / prefix.size;
+}
+
+// Set the retention limits and how freed mappings are cleared. NULL restores
+// the defaults: 1 GB, 4 mappings per size class, no age limit, no clearing.
+// Mappings beyond new, lower limits are unmapped.
+void iodlr_cache_configure(const iodlr_cache_config* new_config) {
+  cache_entry* released = NULL;
+
+  SpinLock(&lock);
+  Initialize();
+  config = new_config != NULL ? *new_config : default_config;
+  for (unsigned size_class = 0; size_class < NUM_CLASSES; size_class++) {
+    while (class_count[size_class] > config.max_per_class) {
+      cache_entry* entry = classes[size_class];
+      while (entry->next != NULL) {
+        entry = entry->next;
+      }
+      Evict(entry, &released);
+    }
+  }
+  Enforce(config.max_bytes, Now(), &released);
+  SpinUnlock(&lock);
+  Release(released);
+}
+
+// Like iodlr_allocate_ex(), but reuse a cached mapping if one fits. The
+// allocation may be larger than a fresh one would be, by up to a quarter of
+// `size`. Its contents depend on the configured clearing. Unless freed
+// mappings are given back with MADV_DONTNEED, the first 4 MB of the first
+// fresh mappings of each page kind are populated, which times the faults a
+// later hit saves. Free it with iodlr_cache_deallocate().
+bool iodlr_cache_allocate(size_t size, size_t max_page_size,
+                          iodlr_allocation* allocation) {
+  cache_entry* released = NULL;
+
+  if (size == 0) {
+    errno = EINVAL;
+    return false;
+  }
+
+  SpinLock(&lock);
+  Initialize();
+  bool resident = config.clear != iodlr_cache_dontneed;
+  Enforce(config.max_bytes, Now(), &released);
+  cache_entry* entry = Find(size, max_page_size);
+  if (entry != NULL) {
+    Unlink(entry);
+    CountHit(entry);
+    *allocation = entry->allocation;
+    entry->next = unused;
+    unused = entry;
+    IODLR_PROBE2(cache_hit, allocation->addr, allocation->size);
+  } else {
+    stats.misses++;
+    IODLR_PROBE1(cache_miss, size);
+  }
+  SpinUnlock(&lock);
+  Release(released);
+  if (entry != NULL) {
+    return true;
+  }
+
+  uint64_t start = Now();
+  if (!iodlr_allocate_ex(size, max_page_size, allocation)) {
+    return false;
+  }
+  uint64_t ns = Now() - start;
+  SpinLock(&lock);
+  bool sample = resident && fault_samples[allocation->kind] < FAULT_SAMPLES;
+  SpinUnlock(&lock);
+  uint64_t fault = sample ? SampleFaults(allocation) : 0;
+
+  SpinLock(&lock);
+  map_ns += ns;
+  map_count++;
+  if (fault != 0) {
+    fault_ns_per_mb[allocation->kind][fault_samples[allocation->kind]++ %
+                                      FAULT_SAMPLES] = fault;
+  }
+  SpinUnlock(&lock);
+  return true;
+}
+
+// Put a mapping from iodlr_cache_allocate() or iodlr_allocate_ex() in the
+// cache, evicting the oldest ones as the limits require. It is unmapped at
+// once if it is larger than the whole cache may hold.
+void iodlr_cache_deallocate(const iodlr_allocation* allocation) {
+  cache_entry* released = NULL;
+  iodlr_allocation spilled = {NULL, 0, 0, iodlr_page_small};
+
+  if (allocation->addr == NULL) {
+    return;
+  }
+
+  SpinLock(&lock);
+  iodlr_cache_config current = config;
+  SpinUnlock(&lock);
+  if (allocation->size > current.max_bytes || current.max_per_class == 0) {
+    uint64_t ns = Unmap(allocation);
+    SpinLock(&lock);
+    unmap_ns += ns;
+    unmap_count++;
+    SpinUnlock(&lock);
+    return;
+  }
+
+  uint64_t start = Now();
+  bool resident = true;
+  if (current.clear == iodlr_cache_dontneed &&
+      madvise(allocation->addr, allocation->size, MADV_DONTNEED) == 0) {
+    resident = false;
+  } else if (current.clear != iodlr_cache_keep) {
+    memset(allocation->addr, 0, allocation->size);
+  }
+  uint64_t now = Now();
+
+  SpinLock(&lock);
+  Initialize();
+  cache_entry* entry = unused;
+  if (entry != NULL) {
+    unused = entry->next;
+  } else if (oldest != NULL) {
+    // Every entry is cached: take over the oldest.
+    entry = oldest;
+    Unlink(entry);
+    spilled = entry->allocation;
+  } else {
+    // Every entry is being unmapped by another thread, outside the lock:
+    // unmap this mapping too rather than wait for one.
+    SpinUnlock(&lock);
+    uint64_t ns = Unmap(allocation);
+    SpinLock(&lock);
+    unmap_ns += ns;
+    unmap_count++;
+    SpinUnlock(&lock);
+    return;
+  }
+  entry->allocation = *allocation;
+  entry->freed_ns = now;
+  entry->clear_ns = now - start;
+  entry->resident = resident;
+  entry->size_class = ClassOf(allocation->size);
+  while (class_count[entry->size_class] >= config.max_per_class &&
+         classes[entry->size_class] != NULL) {
+    cache_entry* last = classes[entry->size_class];
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    Evict(last, &released);
+  }
+  Link(entry);
+  Enforce(config.max_bytes, now, &released);
+  SpinUnlock(&lock);
+
+  if (spilled.addr != NULL) {
+    uint64_t ns = Unmap(&spilled);
+    SpinLock(&lock);
+    unmap_ns += ns;
+    unmap_count++;
+    stats.released++;
+    SpinUnlock(&lock);
+  }
+  Release(released);
+}
+
+// Unmap the oldest cached mappings until at most `keep_bytes` remain, for
+// instance when the system is short of memory or huge pages. Returns the
+// bytes unmapped.
+size_t iodlr_cache_trim(size_t keep_bytes) {
+  cache_entry* released = NULL;
+
+  SpinLock(&lock);
+  Initialize();
+  Enforce(keep_bytes, Now(), &released);
+  SpinUnlock(&lock);
+  return Release(released);
+}
+
+void iodlr_cache_get_stats(iodlr_cache_stats* out) {
+  SpinLock(&lock);
+  *out = stats;
+  SpinUnlock(&lock);
+}
@@ -0,0 +1,110 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Compare iodlr_allocate_mixed() with iodlr_allocate_ex() for a size that is
+// not a multiple of the largest page: the memory mapped beyond the request,
+// and the time per random read. `make bench-mixed` runs it.
+//
+// usage: mixed-bench [size in MB]
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define READS (16 << 20)
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t Next(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double RandomReads(const uint64_t* data, size_t size) {
+  uint64_t state = 88172645463325252ull;
+  uint64_t sum = 0;
+  size_t words = size / sizeof(uint64_t);
+  double start = Now();
+
+  for (int i = 0; i < READS; i++) {
+    sum += data[Next(&state) % words];
+  }
+  double elapsed = Now() - start;
+  __asm__ volatile("" : : "r"(sum));
+  return elapsed * 1e9 / READS;
+}
+
+static void Report(const char* name, void* addr, size_t size, size_t mapped,
+                   const char* pages) {
+  memset(addr, 1, size);
+  printf("%-18s %6zu MB mapped, %4zu MB unused, %5.1f ns per read: %s\n", name,
+         mapped >> 20, (mapped - size) >> 20, RandomReads(addr, size), pages);
+}
+
+int main(int argc, char** argv) {
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 1100) << 20;
+  const size_t max_page_sizes[] = {IODLR_PAGE_SIZE_1G, IODLR_PAGE_SIZE_2M};
+  iodlr_allocation allocation;
+  iodlr_layout layout;
+  char pages[256];
+
+  if (size == 0) {
+    fprintf(stderr, "usage: %s [size in MB]\n", argv[0]);
+    return 1;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (!iodlr_allocate_ex(size, max_page_sizes[i], &allocation)) {
+      perror("iodlr_allocate_ex");
+      return 1;
+    }
+    snprintf(pages, sizeof(pages), "%s", iodlr_page_kind_str(allocation.kind));
+    Report(i == 0 ? "allocate_ex 1G" : "allocate_ex 2M", allocation.addr, size,
+           allocation.size, pages);
+    iodlr_deallocate(allocation.addr, allocation.size);
+  }
+
+  if (!iodlr_allocate_mixed(size, IODLR_PAGE_SIZE_1G, &layout)) {
+    perror("iodlr_allocate_mixed");
+    return 1;
+  }
+  size_t length = 0;
+  for (unsigned i = 0; i < layout.count; i++) {
+    length += snprintf(pages + length, sizeof(pages) - length, "%s%s %zu MB",
+                       i > 0 ? ", " : "",
+                       iodlr_page_kind_str(layout.segments[i].kind),
+                       layout.segments[i].size >> 20);
+  }
+  Report("allocate_mixed 1G", layout.addr, size, layout.size, pages);
+  iodlr_deallocate_mixed(&layout);
+  return 0;
+}
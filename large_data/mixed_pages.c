@@ -0,0 +1,230 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Cover an allocation with a mix of page sizes. iodlr_allocate_ex() uses one
+// page size, so a 5.5 GB buffer either takes six 1 GB pages, wasting half of
+// one, or 2816 pages of 2 MB. Here it takes five 1 GB pages, 256 pages of 2 MB
+// and no tail, in one contiguous range:
+//
+//   [ 1 GB pages | 2 MB pages | 2 MB transparent huge pages | small pages ]
+//
+// Each part is as large as the pools allow, and anything a pool cannot cover
+// moves on to the next part, so less than a small page is wasted. The range
+// is reserved first, aligned for its largest pages, and the parts are mapped
+// over it.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+#define FLAGS_4K   (MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED)
+#define FLAGS_1G   (FLAGS_4K | MAP_HUGETLB | MAP_HUGE_1GB)
+#define FLAGS_2M   (FLAGS_4K | MAP_HUGETLB | MAP_HUGE_2MB)
+
+#define POOL_DIR "/sys/kernel/mm/hugepages"
+
+#define MAX_ATTEMPTS 3
+
+static uint64_t ReadPoolValue(size_t page_size, const char* name) {
+  char path[128];
+  unsigned long long value = 0;
+
+  snprintf(path, sizeof(path), POOL_DIR "/hugepages-%zukB/%s",
+           page_size >> 10, name);
+  FILE* ifs = fopen(path, "r");
+  if (ifs == NULL) {
+    return 0;
+  }
+  if (fscanf(ifs, "%llu", &value) != 1) {
+    value = 0;
+  }
+  fclose(ifs);
+  return value;
+}
+
+// Pages of `page_size` in the pool that no one has reserved.
+static uint64_t AvailablePages(size_t page_size) {
+  uint64_t free_pages = ReadPoolValue(page_size, "free_hugepages");
+  uint64_t reserved = ReadPoolValue(page_size, "resv_hugepages");
+
+  return free_pages > reserved ? free_pages - reserved : 0;
+}
+
+// Add a part to the layout, merged with the one before if the same kind.
+static void AddSegment(iodlr_layout* layout, char* addr, size_t size,
+                       size_t page_size, iodlr_page_kind kind) {
+  iodlr_allocation* segment;
+
+  if (layout->count > 0 &&
+      layout->segments[layout->count - 1].kind == kind) {
+    layout->segments[layout->count - 1].size += size;
+    return;
+  }
+  segment = &layout->segments[layout->count++];
+  segment->addr = addr;
+  segment->size = size;
+  segment->page_size = page_size;
+  segment->kind = kind;
+}
+
+static bool MapPart(iodlr_layout* layout, char* addr, size_t size,
+                    iodlr_page_kind kind) {
+  int flags = kind == iodlr_page_hugetlb_1g ? FLAGS_1G :
+              kind == iodlr_page_hugetlb_2m ? FLAGS_2M : FLAGS_4K;
+
+  if (mmap(addr, size, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) {
+    IODLR_PROBE2(allocate_fallback, size, kind);
+    return false;
+  }
+  if (kind == iodlr_page_thp && madvise(addr, size, MADV_HUGEPAGE) != 0) {
+    kind = iodlr_page_small;
+  }
+  AddSegment(layout, addr, size,
+             kind == iodlr_page_small ? iodlr_get_default_page_size() :
+             kind == iodlr_page_hugetlb_1g ? IODLR_PAGE_SIZE_1G :
+             IODLR_PAGE_SIZE_2M,
+             kind);
+  IODLR_PROBE3(mixed_part, addr, size, kind);
+  return true;
+}
+
+// Plan the parts from the pools, reserve the range and map the parts over it.
+// Explicit huge pages are left out unless `hugetlb`. Returns 1 on success, 0
+// if out of memory and -1 if a pool ran out after it was checked.
+static int TryAllocate(size_t size, size_t max_page_size, bool hugetlb,
+                       iodlr_layout* layout) {
+  size_t small_page = iodlr_get_default_page_size();
+  size_t total = align_up(size, small_page);
+  size_t parts[iodlr_page_small + 1] = {0};
+  size_t left = total;
+
+  if (hugetlb && max_page_size >= IODLR_PAGE_SIZE_1G) {
+    uint64_t pages = left / IODLR_PAGE_SIZE_1G;
+    uint64_t available = AvailablePages(IODLR_PAGE_SIZE_1G);
+    parts[iodlr_page_hugetlb_1g] =
+        (pages < available ? pages : available) * IODLR_PAGE_SIZE_1G;
+    left -= parts[iodlr_page_hugetlb_1g];
+  }
+  if (hugetlb && max_page_size >= IODLR_PAGE_SIZE_2M) {
+    uint64_t pages = left / IODLR_PAGE_SIZE_2M;
+    uint64_t available = AvailablePages(IODLR_PAGE_SIZE_2M);
+    parts[iodlr_page_hugetlb_2m] =
+        (pages < available ? pages : available) * IODLR_PAGE_SIZE_2M;
+    left -= parts[iodlr_page_hugetlb_2m];
+  }
+  if (max_page_size >= IODLR_PAGE_SIZE_2M) {
+    parts[iodlr_page_thp] = left & ~(IODLR_PAGE_SIZE_2M - 1);
+    left -= parts[iodlr_page_thp];
+  }
+  parts[iodlr_page_small] = left;
+
+  size_t alignment = parts[iodlr_page_hugetlb_1g] ? IODLR_PAGE_SIZE_1G :
+                     left < total ? IODLR_PAGE_SIZE_2M : small_page;
+  size_t slack = alignment - small_page;
+  char* reserved = mmap(NULL, total + slack, PROT_NONE,
+                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return 0;
+  }
+  char* start = (char*)align_up((uintptr_t)reserved, alignment);
+  if (start > reserved) {
+    munmap(reserved, start - reserved);
+  }
+  if (reserved + slack > start) {
+    munmap(start + total, reserved + slack - start);
+  }
+
+  memset(layout, 0, sizeof(*layout));
+  layout->addr = start;
+  layout->size = total;
+  char* addr = start;
+  for (int kind = 0; kind <= iodlr_page_small; kind++) {
+    if (parts[kind] == 0) {
+      continue;
+    }
+    if (!MapPart(layout, addr, parts[kind], kind)) {
+      // Depending on the kernel, a failed MAP_FIXED mmap() may have unmapped
+      // the reservation under it, and another thread may have mapped the hole
+      // since. So that part is left alone: at worst it leaks address space.
+      if (addr > start) {
+        munmap(start, addr - start);
+      }
+      if (start + total > addr + parts[kind]) {
+        munmap(addr + parts[kind], start + total - addr - parts[kind]);
+      }
+      return kind < iodlr_page_thp ? -1 : 0;
+    }
+    addr += parts[kind];
+  }
+  return 1;
+}
+
+// Allocate `size` bytes as one contiguous range covered with as many 1 GB
+// pages as fit and the pool has, then 2 MB pages, then 2 MB transparent huge
+// pages, then small pages for the tail, with no pages larger than
+// `max_page_size`. `layout` describes the parts in address order. If another
+// process empties a pool in between, the pools are read again; after a few
+// tries only transparent huge pages are used. Free the memory with
+// iodlr_deallocate_mixed().
+bool iodlr_allocate_mixed(size_t size, size_t max_page_size,
+                          iodlr_layout* layout) {
+  IODLR_PROBE2(mixed_entry, size, max_page_size);
+  if (size == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+    int result = TryAllocate(size, max_page_size, attempt < MAX_ATTEMPTS - 1,
+                             layout);
+    if (result >= 0) {
+      return result == 1;
+    }
+  }
+  return false;
+}
+
+// Unmap memory from iodlr_allocate_mixed(), part by part, since explicit huge
+// page mappings can only be unmapped whole.
+void iodlr_deallocate_mixed(const iodlr_layout* layout) {
+  for (unsigned i = 0; i < layout->count; i++) {
+    IODLR_PROBE2(deallocate, layout->segments[i].addr,
+                 layout->segments[i].size);
+    munmap(layout->segments[i].addr, layout->segments[i].size);
+  }
+}
@@ -0,0 +1,283 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// NUMA placement for allocations. Explicit huge pages come from per-node pools,
+// and an unbound mapping takes them from whichever node the kernel consults
+// first. These variants bind the mapping to a node, or interleave it across
+// nodes, before it is touched.
+//
+// For explicit huge pages the per-node pools are checked first. The mapping
+// is bound strictly and populated at once, so a node that runs out turns into a
+// fallback to the next page size here rather than a SIGBUS on a later fault.
+// Transparent huge pages and small pages come from the buddy allocator, which
+// can always fall back, so they only prefer the node.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#define MPOL_BIND       2
+#define MPOL_INTERLEAVE 3
+#endif
+
+#define MAX_NODES 64
+
+#define NODE_DIR "/sys/devices/system/node"
+
+// Parse a list of ranges such as "0-1,3" into a node mask.
+static unsigned long ParseNodeList(const char* list) {
+  unsigned long mask = 0;
+
+  while (*list != 0) {
+    char* end;
+    unsigned long from = strtoul(list, &end, 10);
+    unsigned long to = from;
+    if (end == list) {
+      break;
+    }
+    if (*end == '-') {
+      list = end + 1;
+      to = strtoul(list, &end, 10);
+    }
+    for (unsigned long node = from; node <= to && node < MAX_NODES; node++) {
+      mask |= 1UL << node;
+    }
+    list = (*end == ',' ? end + 1 : end);
+    if (*list == '\n') {
+      break;
+    }
+  }
+  return mask;
+}
+
+// The nodes with memory. Without NUMA support there is a single node 0.
+static unsigned long MemoryNodes(void) {
+  char list[4096];
+  unsigned long mask = 0;
+  FILE* ifs = fopen(NODE_DIR "/has_memory", "r");
+
+  if (ifs != NULL) {
+    if (fgets(list, sizeof(list), ifs) != NULL) {
+      mask = ParseNodeList(list);
+    }
+    fclose(ifs);
+  }
+  return mask != 0 ? mask : 1;
+}
+
+// Free explicit huge pages of `page_size` in the pool of `node`.
+static uint64_t FreeHugePages(int node, size_t page_size) {
+  char path[128];
+  unsigned long long count = 0;
+
+  snprintf(path, sizeof(path),
+           NODE_DIR "/node%d/hugepages/hugepages-%zukB/free_hugepages", node,
+           page_size >> 10);
+  FILE* ifs = fopen(path, "r");
+  if (ifs == NULL) {
+    return 0;
+  }
+  if (fscanf(ifs, "%llu", &count) != 1) {
+    count = 0;
+  }
+  fclose(ifs);
+  return count;
+}
+
+// Whether the pools of the nodes in `mask` have room for `pages` huge pages,
+// spread evenly over them if interleaving.
+static bool HavePages(unsigned long mask, size_t page_size, uint64_t pages,
+                      bool interleave) {
+  uint64_t share = (pages + __builtin_popcountl(mask) - 1) /
+                   __builtin_popcountl(mask);
+  uint64_t total = 0;
+
+  for (int node = 0; node < MAX_NODES; node++) {
+    if (!(mask & (1UL << node))) {
+      continue;
+    }
+    uint64_t free_pages = FreeHugePages(node, page_size);
+    if (interleave && free_pages < share) {
+      return false;
+    }
+    total += free_pages;
+  }
+  return total >= pages;
+}
+
+static bool Bind(void* addr, size_t size, int mode, unsigned long mask) {
+  return syscall(__NR_mbind, addr, size, mode, &mask, sizeof(mask) * 8 + 1,
+                 0) == 0;
+}
+
+// Fault in a bound explicit huge page mapping, so a node without the pages
+// shows up as an error now. Kernels before 5.14 cannot populate without the
+// risk of SIGBUS; there the pool check has to do.
+static bool Commit(const iodlr_allocation* allocation) {
+  if (madvise(allocation->addr, 0, MADV_POPULATE_WRITE) != 0) {
+    return true;
+  }
+  return iodlr_populate(allocation, 0);
+}
+
+static bool MapHugetlb(size_t size, size_t page_size, int mode,
+                       unsigned long mask, iodlr_allocation* allocation) {
+  int shift = __builtin_ctzl(page_size);
+  int flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB |
+              (shift << MAP_HUGE_SHIFT);
+  size_t mapped = align_up(size, page_size);
+
+  if (!HavePages(mask, page_size, mapped / page_size,
+                 mode == MPOL_INTERLEAVE)) {
+    return false;
+  }
+  void* addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  allocation->addr = addr;
+  allocation->size = mapped;
+  allocation->page_size = page_size;
+  allocation->kind = page_size == IODLR_PAGE_SIZE_1G ? iodlr_page_hugetlb_1g :
+                     iodlr_page_hugetlb_2m;
+  if (Bind(addr, mapped, mode, mask) && Commit(allocation)) {
+    IODLR_PROBE3(allocate_return, addr, mapped, allocation->kind);
+    return true;
+  }
+  munmap(addr, mapped);
+  return false;
+}
+
+// iodlr_allocate_ex() with the memory placed by `mode` on the nodes in `mask`.
+static bool AllocateOnNodes(size_t size, size_t max_page_size, int mode,
+                            unsigned long mask,
+                            iodlr_allocation* allocation) {
+  IODLR_PROBE3(numa_entry, size, max_page_size, mask);
+  if (size == 0 || mask == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  if (max_page_size >= IODLR_PAGE_SIZE_1G && size >= IODLR_PAGE_SIZE_1G) {
+    if (MapHugetlb(size, IODLR_PAGE_SIZE_1G, mode, mask, allocation)) {
+      return true;
+    }
+    IODLR_PROBE2(allocate_fallback, size, iodlr_page_hugetlb_1g);
+  }
+  if (max_page_size >= IODLR_PAGE_SIZE_2M && size >= IODLR_PAGE_SIZE_2M) {
+    if (MapHugetlb(size, IODLR_PAGE_SIZE_2M, mode, mask, allocation)) {
+      return true;
+    }
+    IODLR_PROBE2(allocate_fallback, size, iodlr_page_hugetlb_2m);
+  }
+  if (!(max_page_size >= IODLR_PAGE_SIZE_2M && size >= IODLR_PAGE_SIZE_2M &&
+        iodlr_allocate_thp(size, allocation)) &&
+      !iodlr_allocate_ex(size, IODLR_PAGE_SIZE_4K, allocation)) {
+    return false;
+  }
+  // Best effort: the pages land wherever the kernel puts them if this fails.
+  Bind(allocation->addr, allocation->size,
+       mode == MPOL_BIND ? MPOL_PREFERRED : mode, mask);
+  return true;
+}
+
+// The number of the highest node with memory plus one; 1 without NUMA.
+int iodlr_numa_node_count(void) {
+  return 64 - __builtin_clzl(MemoryNodes());
+}
+
+// The node of the CPU the calling thread runs on, or -1 if unknown.
+int iodlr_numa_current_node(void) {
+  unsigned cpu, node;
+
+  if (syscall(__NR_getcpu, &cpu, &node, NULL) != 0) {
+    return -1;
+  }
+  return (int)node;
+}
+
+// The node the page at `addr` is on, or -1 if it is not faulted in or unknown.
+int iodlr_numa_node_of(const void* addr) {
+  void* page = (void*)addr;
+  int status = -1;
+
+  if (syscall(__NR_move_pages, 0, 1UL, &page, NULL, &status, 0) != 0) {
+    return -1;
+  }
+  return status >= 0 ? status : -1;
+}
+
+// Allocate as iodlr_allocate_ex() does, on NUMA node `node`, which must have
+// memory. Explicit huge pages are used only if that node's pool has them; they
+// are then faulted in before returning. Transparent huge pages and small pages
+// only prefer the node. Free the memory with iodlr_deallocate().
+bool iodlr_allocate_onnode(size_t size, size_t max_page_size, int node,
+                           iodlr_allocation* allocation) {
+  if (node < 0 || node >= MAX_NODES || !(MemoryNodes() & (1UL << node))) {
+    errno = EINVAL;
+    return false;
+  }
+  return AllocateOnNodes(size, max_page_size, MPOL_BIND, 1UL << node,
+                         allocation);
+}
+
+// Allocate on the node of the CPU the calling thread runs on, as
+// iodlr_allocate_onnode() does. For threads pinned to one node.
+bool iodlr_allocate_local(size_t size, size_t max_page_size,
+                          iodlr_allocation* allocation) {
+  int node = iodlr_numa_current_node();
+
+  if (node < 0) {
+    return iodlr_allocate_ex(size, max_page_size, allocation);
+  }
+  return iodlr_allocate_onnode(size, max_page_size, node, allocation);
+}
+
+// Allocate with the pages interleaved round robin over all nodes with memory,
+// one huge page at a time, for data shared by threads on every node. Explicit
+// huge pages are used only if every node's pool has its share.
+bool iodlr_allocate_interleaved(size_t size, size_t max_page_size,
+                                iodlr_allocation* allocation) {
+  return AllocateOnNodes(size, max_page_size, MPOL_INTERLEAVE, MemoryNodes(),
+                         allocation);
+}
@@ -0,0 +1,144 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Compare local and remote placement. The thread stays on the CPU it starts
+// on; a buffer is allocated on every node in turn with iodlr_allocate_onnode(),
+// then interleaved over all nodes. Run it under numactl or taskset to pick the
+// CPU. `make bench-numa` runs it.
+//
+// usage: numa-bench [size in MB] [max page size in KB]
+//
+// bandwidth: sums the buffer sequentially.
+// latency:   follows a random cycle through its cache lines, so every load
+//            waits for the one before.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LINE_SIZE   64
+#define HOPS        (8 << 20)
+#define PASSES      4
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t Next(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double Bandwidth(const uint64_t* data, size_t size) {
+  uint64_t sum = 0;
+  double start = Now();
+
+  for (int pass = 0; pass < PASSES; pass++) {
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+      sum += data[i];
+    }
+  }
+  double elapsed = Now() - start;
+  __asm__ volatile("" : : "r"(sum));
+  return (double)size * PASSES / elapsed / (1 << 30);
+}
+
+// Link the cache lines into one random cycle with Sattolo's algorithm, then
+// walk it.
+static double Latency(char* data, size_t size) {
+  size_t lines = size / LINE_SIZE;
+  uint64_t state = 88172645463325252ull;
+
+  for (size_t i = 0; i < lines; i++) {
+    *(char**)(data + i * LINE_SIZE) = data + i * LINE_SIZE;
+  }
+  for (size_t i = lines - 1; i > 0; i--) {
+    size_t j = Next(&state) % i;
+    char** a = (char**)(data + i * LINE_SIZE);
+    char** b = (char**)(data + j * LINE_SIZE);
+    char* swap = *a;
+    *a = *b;
+    *b = swap;
+  }
+
+  char* p = data;
+  double start = Now();
+  for (int i = 0; i < HOPS; i++) {
+    p = *(char**)p;
+  }
+  double elapsed = Now() - start;
+  __asm__ volatile("" : : "r"(p));
+  return elapsed * 1e9 / HOPS;
+}
+
+static void Run(const char* name, const iodlr_allocation* allocation,
+                size_t size) {
+  iodlr_populate(allocation, 1);
+  printf("%-12s %-10s first page on node %2d: %6.2f GB/s, %6.1f ns latency\n",
+         name, iodlr_page_kind_str(allocation->kind),
+         iodlr_numa_node_of(allocation->addr),
+         Bandwidth(allocation->addr, size), Latency(allocation->addr, size));
+  iodlr_deallocate(allocation->addr, allocation->size);
+}
+
+int main(int argc, char** argv) {
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 512) << 20;
+  size_t page_size = argc > 2 ? (size_t)atoi(argv[2]) << 10 :
+                     IODLR_PAGE_SIZE_1G;
+  iodlr_allocation allocation;
+  cpu_set_t cpu;
+
+  if (size < IODLR_PAGE_SIZE_2M || page_size == 0) {
+    fprintf(stderr, "usage: %s [size in MB, at least 2] [max page size in KB]\n",
+            argv[0]);
+    return 1;
+  }
+  CPU_ZERO(&cpu);
+  CPU_SET(sched_getcpu(), &cpu);
+  sched_setaffinity(0, sizeof(cpu), &cpu);
+  int local = iodlr_numa_current_node();
+  printf("cpu %d, node %d of %d\n", sched_getcpu(), local,
+         iodlr_numa_node_count());
+
+  for (int node = 0; node < iodlr_numa_node_count(); node++) {
+    char name[32];
+    if (!iodlr_allocate_onnode(size, page_size, node, &allocation)) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s %d", node == local ? "local" : "remote",
+             node);
+    Run(name, &allocation, size);
+  }
+  if (iodlr_allocate_interleaved(size, page_size, &allocation)) {
+    Run("interleaved", &allocation, size);
+  }
+  return 0;
+}
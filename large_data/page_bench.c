@@ -0,0 +1,655 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Measure how page sizes affect memory access patterns. For every page kind,
+// working set size, pattern and thread count it reports throughput, page
+// faults and, where the PMU is available, dTLB misses, as CSV or JSON for
+// comparing hosts.
+//
+// usage: page-bench [-p patterns] [-k page kinds] [-s min-max] [-f factor]
+//                   [-t threads] [-d seconds] [-j]
+//
+// seq:     each thread streams through its slice of the buffer.
+// chase:   each thread follows a pointer cycle through all cache lines, so
+//          every load waits for the one before.
+// gather:  independent random 8 byte reads from the whole buffer.
+// scatter: random 8 byte increments within each thread's slice.
+// hash:    probes of an open addressing table filling the buffer, three
+//          quarters full of random keys, half of them hits.
+//
+// The chase cycle is set up with sequential writes, so multi-GB sizes are
+// quick to prepare: it comes from a full period linear congruential
+// generator. The hash table is filled by inserting its keys one by one, so
+// the probe sequences are as long as linear probing makes them.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include "large_data_internal.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_SIZE   64
+#define BATCH       4096
+#define MAX_SIZES   64
+
+// The constants of Knuth's MMIX generator: a % 4 == 1 and c odd give a full
+// period modulo any power of two.
+#define LCG_A 6364136223846793005ull
+#define LCG_C 1442695040888963407ull
+
+// Share of the hash table slots that hold a key, in percent.
+#define HASH_LOAD 75
+
+typedef enum {
+  pattern_seq,
+  pattern_chase,
+  pattern_gather,
+  pattern_scatter,
+  pattern_hash,
+  pattern_count
+} pattern;
+
+static const char* const pattern_names[pattern_count] = {
+  "seq", "chase", "gather", "scatter", "hash"
+};
+
+typedef struct {
+  uint64_t key;
+  uint64_t value;
+} hash_slot;
+
+typedef struct {
+  pattern            kind;
+  char*              data;
+  size_t             size;
+  unsigned           threads;
+  uint64_t           mask;        // lines or slots minus one, chase and hash
+  uint64_t           keys;        // keys in the table, hash
+  pthread_barrier_t  barrier;
+  int                stop;
+  const int*         cpus;
+  int                ncpus;
+} bench_run;
+
+typedef struct {
+  bench_run* run;
+  unsigned   index;
+  pthread_t  thread;
+  uint64_t   ops;
+  double     seconds;
+  long       faults;
+  int64_t    dtlb_load_misses;    // -1 if not available
+  int64_t    dtlb_store_misses;
+  uint64_t   sink;
+} worker;
+
+typedef struct {
+  bool      patterns[pattern_count];
+  bool      kinds[iodlr_page_small + 1];
+  size_t    min_size;
+  size_t    max_size;
+  unsigned  factor;
+  unsigned  max_threads;
+  double    seconds;
+  bool      json;
+  int       cpus[CPU_SETSIZE];
+  int       ncpus;
+  char      host[128];
+  bool      first_row;
+} options;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t Next(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// A value in [0, range) from a random 64 bit value, without a division.
+static inline uint64_t Reduce(uint64_t random, uint64_t range) {
+  return (uint64_t)(((unsigned __int128)random * range) >> 64);
+}
+
+static inline uint64_t FloorPowerOfTwo(uint64_t value) {
+  return value != 0 ? 1ull << (63 - __builtin_clzll(value)) : 0;
+}
+
+// The i-th key of the hash table: the finalizer of splitmix64, a bijection
+// that keeps 0 for empty slots, so keys 1, 2, ... are distinct, nonzero and
+// spread over all slots. The key is its own hash.
+static inline uint64_t HashKey(uint64_t i) {
+  i = (i ^ (i >> 30)) * 0xbf58476d1ce4e5b9ull;
+  i = (i ^ (i >> 27)) * 0x94d049bb133111ebull;
+  return i ^ (i >> 31);
+}
+
+static long MinorFaults(int who) {
+  struct rusage usage;
+
+  return getrusage(who, &usage) == 0 ? usage.ru_minflt : 0;
+}
+
+// A dTLB miss counter for the calling thread, or -1 if the PMU or the
+// permissions do not allow it, as on most virtual machines.
+static int OpenDtlbCounter(int op) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t ReadCounter(int fd) {
+  uint64_t value;
+
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+    return -1;
+  }
+  return (int64_t)value;
+}
+
+static void SetCounters(const int* fds, unsigned long request) {
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] >= 0) {
+      ioctl(fds[i], request, 0);
+    }
+  }
+}
+
+// Run the pattern in batches until the main thread says stop. Returns the
+// operations done.
+static uint64_t Work(worker* self) {
+  bench_run* run = self->run;
+  uint64_t state = 0x9e3779b97f4a7c15ull * (self->index + 1);
+  uint64_t ops = 0;
+  uint64_t sum = 0;
+  size_t words = run->size / sizeof(uint64_t);
+  size_t slice = words / run->threads;
+  uint64_t* data = (uint64_t*)run->data;
+  uint64_t* mine = data + slice * self->index;
+  size_t position = 0;
+  char* p = run->data +
+            ((run->mask + 1) / run->threads * self->index) * LINE_SIZE;
+
+  while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+    switch (run->kind) {
+      case pattern_seq:
+        for (int i = 0; i < BATCH; i++) {
+          sum += mine[position];
+          position = position + 1 < slice ? position + 1 : 0;
+        }
+        break;
+      case pattern_chase:
+        for (int i = 0; i < BATCH; i++) {
+          p = *(char**)p;
+        }
+        break;
+      case pattern_gather:
+        for (int i = 0; i < BATCH; i++) {
+          sum += data[Reduce(Next(&state), words)];
+        }
+        break;
+      case pattern_scatter:
+        for (int i = 0; i < BATCH; i++) {
+          mine[Reduce(Next(&state), slice)]++;
+        }
+        break;
+      case pattern_hash: {
+        hash_slot* table = (hash_slot*)run->data;
+        for (int i = 0; i < BATCH; i++) {
+          // The first run->keys keys are in the table, the next as many
+          // are not.
+          uint64_t key = HashKey(Reduce(Next(&state), 2 * run->keys) + 1);
+          uint64_t slot = key & run->mask;
+          while (table[slot].key != 0 && table[slot].key != key) {
+            slot = (slot + 1) & run->mask;
+          }
+          sum += table[slot].key == key ? table[slot].value : 1;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    ops += BATCH;
+  }
+  self->sink = sum + (uintptr_t)p;
+  return ops;
+}
+
+static void* RunWorker(void* arg) {
+  worker* self = arg;
+  int fds[2] = {OpenDtlbCounter(PERF_COUNT_HW_CACHE_OP_READ),
+                OpenDtlbCounter(PERF_COUNT_HW_CACHE_OP_WRITE)};
+
+  pthread_barrier_wait(&self->run->barrier);
+  long faults = MinorFaults(RUSAGE_THREAD);
+  SetCounters(fds, PERF_EVENT_IOC_RESET);
+  SetCounters(fds, PERF_EVENT_IOC_ENABLE);
+  double start = Now();
+  self->ops = Work(self);
+  self->seconds = Now() - start;
+  SetCounters(fds, PERF_EVENT_IOC_DISABLE);
+  self->faults = MinorFaults(RUSAGE_THREAD) - faults;
+  self->dtlb_load_misses = ReadCounter(fds[0]);
+  self->dtlb_store_misses = ReadCounter(fds[1]);
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  return NULL;
+}
+
+// Lay out the working set for a pattern: a pointer cycle through the cache
+// lines for chase, a hash table three quarters full for hash.
+static void Prepare(bench_run* run) {
+  if (run->kind == pattern_chase) {
+    uint64_t lines = FloorPowerOfTwo(run->size / LINE_SIZE);
+    run->mask = lines - 1;
+    for (uint64_t line = 0; line < lines; line++) {
+      uint64_t next = (LCG_A * line + LCG_C) & run->mask;
+      *(char**)(run->data + line * LINE_SIZE) = run->data + next * LINE_SIZE;
+    }
+  } else if (run->kind == pattern_hash) {
+    hash_slot* table = (hash_slot*)run->data;
+    uint64_t slots = FloorPowerOfTwo(run->size / sizeof(hash_slot));
+    run->mask = slots - 1;
+    run->keys = slots / 100 * HASH_LOAD + slots % 100 * HASH_LOAD / 100;
+    memset(table, 0, slots * sizeof(hash_slot));
+    for (uint64_t i = 1; i <= run->keys; i++) {
+      uint64_t key = HashKey(i);
+      uint64_t slot = key & run->mask;
+      while (table[slot].key != 0) {
+        slot = (slot + 1) & run->mask;
+      }
+      table[slot].key = key;
+      table[slot].value = i;
+    }
+  } else {
+    run->mask = 0;
+  }
+}
+
+typedef struct {
+  double  ops_per_second;
+  double  ns_per_op;
+  long    faults;
+  int64_t dtlb_load_misses;
+  int64_t dtlb_store_misses;
+} result;
+
+static result Measure(bench_run* run, double seconds) {
+  worker* workers = calloc(run->threads, sizeof(worker));
+  result total = {0, 0, 0, 0, 0};
+
+  pthread_barrier_init(&run->barrier, NULL, run->threads + 1);
+  run->stop = 0;
+  for (unsigned i = 0; i < run->threads; i++) {
+    pthread_attr_t attr;
+    cpu_set_t cpu;
+    pthread_attr_init(&attr);
+    if (run->ncpus > 0) {
+      CPU_ZERO(&cpu);
+      CPU_SET(run->cpus[i % run->ncpus], &cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
+    workers[i].run = run;
+    workers[i].index = i;
+    if (pthread_create(&workers[i].thread, &attr, RunWorker,
+                       &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_attr_destroy(&attr);
+  }
+  pthread_barrier_wait(&run->barrier);
+  struct timespec wait = {(time_t)seconds,
+                          (long)((seconds - (time_t)seconds) * 1e9)};
+  nanosleep(&wait, NULL);
+  __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+
+  for (unsigned i = 0; i < run->threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    total.ops_per_second += workers[i].ops / workers[i].seconds;
+    total.ns_per_op += workers[i].seconds * 1e9 / workers[i].ops /
+                       run->threads;
+    total.faults += workers[i].faults;
+    if (total.dtlb_load_misses >= 0) {
+      total.dtlb_load_misses = workers[i].dtlb_load_misses < 0 ? -1 :
+          total.dtlb_load_misses + workers[i].dtlb_load_misses;
+    }
+    if (total.dtlb_store_misses >= 0) {
+      total.dtlb_store_misses = workers[i].dtlb_store_misses < 0 ? -1 :
+          total.dtlb_store_misses + workers[i].dtlb_store_misses;
+    }
+  }
+  pthread_barrier_destroy(&run->barrier);
+  free(workers);
+  return total;
+}
+
+// Map a buffer with exactly the page kind asked for; explicit huge pages are
+// rounded up to whole pages, and small pages are kept from being collapsed
+// into transparent huge pages. Returns false if that kind is not available.
+static bool Allocate(iodlr_page_kind kind, size_t size,
+                     iodlr_allocation* allocation) {
+  switch (kind) {
+    case iodlr_page_small:
+      if (!iodlr_allocate_ex(size, IODLR_PAGE_SIZE_4K, allocation)) {
+        return false;
+      }
+      // With transparent huge pages enabled=always the kernel would back
+      // the baseline with huge pages too. Without THP support madvise()
+      // fails, and the mapping is small pages anyway.
+      madvise(allocation->addr, allocation->size, MADV_NOHUGEPAGE);
+      return true;
+    case iodlr_page_thp:
+      return iodlr_allocate_thp(size, allocation);
+    case iodlr_page_hugetlb_2m:
+    case iodlr_page_hugetlb_1g: {
+      size_t page_size = kind == iodlr_page_hugetlb_2m ? IODLR_PAGE_SIZE_2M :
+                         IODLR_PAGE_SIZE_1G;
+      if (!iodlr_allocate_ex(align_up(size, page_size), page_size,
+                             allocation)) {
+        return false;
+      }
+      if (allocation->kind != kind) {
+        iodlr_deallocate(allocation->addr, allocation->size);
+        return false;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static void PrintCount(int64_t value, const char* missing) {
+  if (value >= 0) {
+    printf("%lld", (long long)value);
+  } else {
+    printf("%s", missing);
+  }
+}
+
+static void PrintRow(options* opts, const bench_run* run, iodlr_page_kind kind,
+                     double setup_ms, long setup_faults, const result* r) {
+  size_t op_bytes = run->kind == pattern_hash ? sizeof(hash_slot) :
+                    sizeof(uint64_t);
+
+  if (opts->json) {
+    printf("%s\n    {\"pattern\": \"%s\", \"pages\": \"%s\", \"size\": %zu, "
+           "\"threads\": %u, \"ops_per_s\": %.0f, \"ns_per_op\": %.3f, "
+           "\"gb_per_s\": %.3f, \"setup_ms\": %.1f, \"setup_faults\": %ld, "
+           "\"run_faults\": %ld, \"dtlb_load_misses\": ",
+           opts->first_row ? "" : ",", pattern_names[run->kind],
+           iodlr_page_kind_str(kind), run->size, run->threads,
+           r->ops_per_second, r->ns_per_op,
+           r->ops_per_second * op_bytes / (1 << 30), setup_ms, setup_faults,
+           r->faults);
+    PrintCount(r->dtlb_load_misses, "null");
+    printf(", \"dtlb_store_misses\": ");
+    PrintCount(r->dtlb_store_misses, "null");
+    printf("}");
+  } else {
+    printf("%s,%s,%s,%zu,%u,%.0f,%.3f,%.3f,%.1f,%ld,%ld", opts->host,
+           pattern_names[run->kind], iodlr_page_kind_str(kind), run->size,
+           run->threads, r->ops_per_second, r->ns_per_op,
+           r->ops_per_second * op_bytes / (1 << 30), setup_ms, setup_faults,
+           r->faults);
+    printf(",");
+    PrintCount(r->dtlb_load_misses, "");
+    printf(",");
+    PrintCount(r->dtlb_store_misses, "");
+    printf("\n");
+  }
+  opts->first_row = false;
+  fflush(stdout);
+}
+
+static void BenchBuffer(options* opts, iodlr_page_kind kind, size_t size) {
+  iodlr_allocation allocation;
+
+  long faults = MinorFaults(RUSAGE_SELF);
+  double start = Now();
+  if (!Allocate(kind, size, &allocation)) {
+    fprintf(stderr, "page-bench: no %s pages for %zu bytes, skipped\n",
+            iodlr_page_kind_str(kind), size);
+    return;
+  }
+  iodlr_populate(&allocation, opts->max_threads);
+  double setup_ms = (Now() - start) * 1e3;
+  long setup_faults = MinorFaults(RUSAGE_SELF) - faults;
+
+  for (int p = 0; p < pattern_count; p++) {
+    if (!opts->patterns[p]) {
+      continue;
+    }
+    bench_run run;
+    memset(&run, 0, sizeof(run));
+    run.kind = p;
+    run.data = allocation.addr;
+    run.size = size;
+    run.cpus = opts->cpus;
+    run.ncpus = opts->ncpus;
+    Prepare(&run);
+    // 1, 2, 4, ... threads, and the most asked for.
+    for (unsigned threads = 1;; threads *= 2) {
+      run.threads = threads < opts->max_threads ? threads : opts->max_threads;
+      result r = Measure(&run, opts->seconds);
+      PrintRow(opts, &run, kind, setup_ms, setup_faults, &r);
+      if (run.threads == opts->max_threads) {
+        break;
+      }
+    }
+  }
+  iodlr_deallocate(allocation.addr, allocation.size);
+}
+
+// Enable the names in a comma separated list. Returns false on an unknown
+// name.
+static bool ParseList(char* list, const char* const* names, int count,
+                      bool* enabled) {
+  memset(enabled, 0, sizeof(bool) * count);
+  for (char* name = strtok(list, ","); name != NULL;
+       name = strtok(NULL, ",")) {
+    int i = 0;
+    while (i < count && strcmp(name, names[i]) != 0) {
+      i++;
+    }
+    if (i == count) {
+      return false;
+    }
+    enabled[i] = true;
+  }
+  return true;
+}
+
+// Half the memory available, so the largest working set does not push the
+// system into reclaim.
+static size_t DefaultMaxSize(void) {
+  char line[256];
+  unsigned long long kb = 0;
+  FILE* meminfo = fopen("/proc/meminfo", "r");
+
+  if (meminfo != NULL) {
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+      if (sscanf(line, "MemAvailable: %llu", &kb) == 1) {
+        break;
+      }
+    }
+    fclose(meminfo);
+  }
+  size_t half = (size_t)kb << 9;
+  size_t limit = (size_t)64 << 30;
+  return half != 0 && half < limit ? half : limit;
+}
+
+static void Usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s [-p patterns] [-k page kinds] [-s min-max] [-f factor]\n"
+          "       [-t threads] [-d seconds] [-j]\n"
+          "  -p  any of seq,chase,gather,scatter,hash (default all)\n"
+          "  -k  any of small,thp,hugetlb-2M,hugetlb-1G (default all)\n"
+          "  -s  working set sizes, e.g. 256K-16G, in MB without a suffix\n"
+          "      (default 256K to half of the available memory, at most 64G)\n"
+          "  -f  factor between sizes (default 4)\n"
+          "  -t  most threads; 1, 2, 4, ... up to it are run (default the\n"
+          "      CPUs this process may use)\n"
+          "  -d  seconds per measurement (default 0.2)\n"
+          "  -j  write JSON instead of CSV\n",
+          program);
+}
+
+int main(int argc, char** argv) {
+  static options opts;
+  const char* kind_names[iodlr_page_small + 1];
+  cpu_set_t allowed;
+  char* end;
+  int option;
+
+  for (int kind = 0; kind <= iodlr_page_small; kind++) {
+    kind_names[kind] = iodlr_page_kind_str(kind);
+    opts.kinds[kind] = true;
+  }
+  for (int p = 0; p < pattern_count; p++) {
+    opts.patterns[p] = true;
+  }
+  opts.min_size = (size_t)256 << 10;
+  opts.max_size = DefaultMaxSize();
+  opts.factor = 4;
+  opts.seconds = 0.2;
+  opts.first_row = true;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        opts.cpus[opts.ncpus++] = cpu;
+      }
+    }
+  }
+  opts.max_threads = opts.ncpus > 0 ? opts.ncpus : 1;
+
+  while ((option = getopt(argc, argv, "p:k:s:f:t:d:jh")) != -1) {
+    switch (option) {
+      case 'p':
+        if (!ParseList(optarg, pattern_names, pattern_count, opts.patterns)) {
+          Usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'k':
+        if (!ParseList(optarg, kind_names, iodlr_page_small + 1,
+                       opts.kinds)) {
+          Usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 's':
+        opts.min_size = ParseSize(optarg, &end);
+        opts.max_size = *end == '-' ? ParseSize(end + 1, &end) :
+                        opts.min_size;
+        if (*end != 0 || opts.min_size < LINE_SIZE * 2 ||
+            opts.max_size < opts.min_size) {
+          Usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'f':
+        opts.factor = (unsigned)atoi(optarg);
+        break;
+      case 't':
+        opts.max_threads = (unsigned)atoi(optarg);
+        break;
+      case 'd':
+        opts.seconds = atof(optarg);
+        break;
+      case 'j':
+        opts.json = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (opts.factor < 2 || opts.max_threads < 1 || opts.seconds <= 0) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  struct utsname uts;
+  if (gethostname(opts.host, sizeof(opts.host) - 1) != 0) {
+    strcpy(opts.host, "unknown");
+  }
+  if (opts.json) {
+    uname(&uts);
+    printf("{\n  \"host\": {\"name\": \"%s\", \"kernel\": \"%s\", "
+           "\"cpus\": %d},\n  \"results\": [", opts.host, uts.release,
+           opts.ncpus);
+  } else {
+    printf("host,pattern,pages,size,threads,ops_per_s,ns_per_op,gb_per_s,"
+           "setup_ms,setup_faults,run_faults,dtlb_load_misses,"
+           "dtlb_store_misses\n");
+  }
+
+  for (int kind = iodlr_page_small; kind >= 0; kind--) {
+    if (!opts.kinds[kind]) {
+      continue;
+    }
+    for (size_t size = opts.min_size; size <= opts.max_size;
+         size *= opts.factor) {
+      BenchBuffer(&opts, kind, size);
+      if (size > opts.max_size / opts.factor) {
+        break;
+      }
+    }
+  }
+  if (opts.json) {
+    printf("\n  ]\n}\n");
+  }
+  return 0;
+}
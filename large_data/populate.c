@@ -0,0 +1,192 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Fault in new mappings ahead of use, in parallel. The kernel zeroes every page
+// it faults in, so a fresh mapping needs no memset(); populating it instead
+// takes the faults up front, spread over threads and the memory bandwidth of
+// every node they run on.
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Below this much per thread, starting threads costs more than it saves.
+#define MIN_SLICE ((size_t)64 << 20)
+
+typedef struct {
+  char*     start;
+  size_t    length;
+  size_t    page_size;
+  bool      populated;
+  bool      started;
+  pthread_t thread;
+} populate_slice;
+
+// Fault in writable pages. Before Linux 5.14 there is no MADV_POPULATE_WRITE,
+// so write a zero to every page, which leaves fresh memory as it was.
+static bool PopulateRange(char* start, size_t length, size_t page_size) {
+  if (madvise(start, length, MADV_POPULATE_WRITE) == 0) {
+    return true;
+  }
+  if (errno != EINVAL) {
+    return false;
+  }
+  for (size_t offset = 0; offset < length; offset += page_size) {
+    *(volatile char*)(start + offset) = 0;
+  }
+  return true;
+}
+
+// The stride of the fallback. A transparent huge page mapping ends at a small
+// page and may not be backed by huge pages at all, so step through it by the
+// small page size.
+static size_t FaultStride(const iodlr_allocation* allocation) {
+  if (allocation->kind == iodlr_page_thp) {
+    return iodlr_get_default_page_size();
+  }
+  return allocation->page_size;
+}
+
+static void* PopulateSlice(void* arg) {
+  populate_slice* slice = arg;
+
+  slice->populated = PopulateRange(slice->start, slice->length,
+                                   slice->page_size);
+  return NULL;
+}
+
+// Fault in all pages of a fresh allocation with `nthreads` threads, or with
+// one per CPU the calling thread may run on if `nthreads` is 0, but no more
+// than one per 64 MB. Thread i is pinned to the i-th of those CPUs, so under
+// the default first touch policy each slice lands on the node of the CPU that
+// touched it. Only call it before the memory is written: the fallback for old
+// kernels writes zeroes. Returns false if not every page could be populated.
+bool iodlr_populate(const iodlr_allocation* allocation, unsigned nthreads) {
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int ncpus = 0;
+
+  if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus[ncpus++] = cpu;
+      }
+    }
+  }
+  if (nthreads == 0) {
+    nthreads = ncpus > 0 ? ncpus : 1;
+  }
+  if (nthreads > CPU_SETSIZE) {
+    nthreads = CPU_SETSIZE;
+  }
+  size_t pages = allocation->size / allocation->page_size;
+  size_t most = allocation->size / MIN_SLICE;
+  if (nthreads > most) {
+    nthreads = most > 0 ? most : 1;
+  }
+  if (nthreads > pages) {
+    nthreads = pages > 0 ? pages : 1;
+  }
+  if (nthreads == 1) {
+    return PopulateRange(allocation->addr, allocation->size,
+                         FaultStride(allocation));
+  }
+
+  // Slices are whole pages; the last one also takes whatever is left over
+  // past the last whole page, such as the small page tail of a transparent
+  // huge page mapping.
+  populate_slice slices[nthreads];
+  char* start = allocation->addr;
+  char* end = start + allocation->size;
+  for (unsigned i = 0; i < nthreads; i++) {
+    size_t slice_pages = pages / nthreads + (i < pages % nthreads);
+    slices[i].start = start;
+    slices[i].length = i + 1 < nthreads
+                           ? slice_pages * allocation->page_size
+                           : (size_t)(end - start);
+    slices[i].page_size = FaultStride(allocation);
+    slices[i].populated = false;
+    slices[i].started = false;
+    start += slices[i].length;
+  }
+
+  // The calling thread takes the first slice itself.
+  for (unsigned i = 1; i < nthreads; i++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (ncpus > 0) {
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(cpus[i % ncpus], &cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
+    slices[i].started = pthread_create(&slices[i].thread, &attr,
+                                       PopulateSlice, &slices[i]) == 0;
+    pthread_attr_destroy(&attr);
+  }
+  PopulateSlice(&slices[0]);
+
+  bool populated = true;
+  for (unsigned i = 0; i < nthreads; i++) {
+    if (i > 0 && slices[i].started) {
+      pthread_join(slices[i].thread, NULL);
+    } else if (i > 0) {
+      PopulateSlice(&slices[i]);
+    }
+    populated = populated && slices[i].populated;
+  }
+  return populated;
+}
+
+// iodlr_allocate_ex() followed by iodlr_populate(), for buffers that will be
+// written throughout, such as the 8 GB one data-large-reference zero fills.
+// The memory reads as zero, so there is no need to clear it. Failing to
+// populate is not an error; the pages left are faulted in on first use.
+bool iodlr_allocate_populated_ex(size_t size, size_t max_page_size,
+                                 unsigned nthreads,
+                                 iodlr_allocation* allocation) {
+  if (!iodlr_allocate_ex(size, max_page_size, allocation)) {
+    return false;
+  }
+  iodlr_populate(allocation, nthreads);
+  return true;
+}
+
+// As iodlr_allocate(), but with the pages faulted in by `nthreads` threads as
+// iodlr_populate() does. Returns NULL on failure.
+void* iodlr_allocate_populated(size_t s, size_t pgsz, unsigned nthreads) {
+  iodlr_allocation allocation;
+
+  if (!iodlr_allocate_populated_ex(s, pgsz, nthreads, &allocation)) {
+    return NULL;
+  }
+  return allocation.addr;
+}
@@ -0,0 +1,85 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+// Time getting a large buffer ready to use: faulting it in with memset(), as
+// data-large-reference used to, against iodlr_populate() on one thread and on
+// every CPU. `make bench-populate` runs it.
+//
+// usage: populate-bench [size in MB] [max page size in KB]
+
+#define _GNU_SOURCE
+#include "large_data.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void Report(const char* name, const iodlr_allocation* allocation,
+                   double seconds) {
+  printf("%-20s %-10s %8.1f ms, %5.2f GB/s\n", name,
+         iodlr_page_kind_str(allocation->kind), seconds * 1e3,
+         allocation->size / seconds / (1 << 30));
+}
+
+int main(int argc, char** argv) {
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 1024) << 20;
+  size_t page_size = argc > 2 ? (size_t)atoi(argv[2]) << 10 :
+                     IODLR_PAGE_SIZE_1G;
+  iodlr_allocation allocation;
+  const struct {
+    const char* name;
+    unsigned    nthreads;
+  } runs[] = {{"populate 1 thread", 1}, {"populate all CPUs", 0}};
+
+  if (size == 0 || page_size == 0) {
+    fprintf(stderr, "usage: %s [size in MB] [max page size in KB]\n", argv[0]);
+    return 1;
+  }
+
+  double start = Now();
+  if (!iodlr_allocate_ex(size, page_size, &allocation)) {
+    perror("iodlr_allocate_ex");
+    return 1;
+  }
+  memset(allocation.addr, 0, size);
+  Report("memset", &allocation, Now() - start);
+  iodlr_deallocate(allocation.addr, allocation.size);
+
+  for (int i = 0; i < 2; i++) {
+    start = Now();
+    if (!iodlr_allocate_populated_ex(size, page_size, runs[i].nthreads,
+                                     &allocation)) {
+      perror("iodlr_allocate_populated_ex");
+      return 1;
+    }
+    Report(runs[i].name, &allocation, Now() - start);
+    iodlr_deallocate(allocation.addr, allocation.size);
+  }
+  return 0;
+}
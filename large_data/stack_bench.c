@@ -0,0 +1,176 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Measure deep recursion on thread stacks. Run it once as is and once with
+// LD_PRELOAD=./liblpstack.so; `make bench-stack` does both.
+//
+// usage: stack-bench [threads] [depth] [idle threads]
+//
+// recursion: each thread recurses `depth` frames of 1 KB, 7 MB at the
+//            default depth, and at the bottom reads and writes random frames
+//            up the stack, as an interpreter does with outer scopes.
+// idle:      starts threads that wait without recursing and reports the
+//            resident memory each one adds.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FRAME_SIZE   1024
+#define ROUNDS       8
+#define ACCESSES     (1 << 20)
+
+typedef struct {
+  char**   frames;
+  int      depth;
+  uint64_t state;
+  uint64_t sum;
+} walker;
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int idle_release;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t Next(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void __attribute__((noinline)) Descend(walker* w, int level) {
+  char frame[FRAME_SIZE];
+
+  memset(frame, level, sizeof(frame));
+  w->frames[level] = frame;
+  if (level + 1 < w->depth) {
+    Descend(w, level + 1);
+  } else {
+    for (int i = 0; i < ACCESSES; i++) {
+      uint64_t r = Next(&w->state);
+      char* target = w->frames[r % w->depth];
+      w->sum += target[(r >> 32) % FRAME_SIZE]++;
+    }
+  }
+  // Keep the frame live across the call so it is not a tail call.
+  w->sum += frame[level % FRAME_SIZE];
+}
+
+static void* Recurse(void* arg) {
+  walker* w = arg;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    Descend(w, 0);
+  }
+  return NULL;
+}
+
+static void* Idle(void* arg) {
+  pthread_mutex_lock(&idle_lock);
+  while (!idle_release) {
+    pthread_cond_wait(&idle_cond, &idle_lock);
+  }
+  pthread_mutex_unlock(&idle_lock);
+  return arg;
+}
+
+static long ResidentKb(void) {
+  char line[256];
+  long kb = -1;
+  FILE* status = fopen("/proc/self/status", "r");
+
+  if (status == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(status);
+  return kb;
+}
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 16;
+  int depth = argc > 2 ? atoi(argv[2]) : 7000;
+  int idle = argc > 3 ? atoi(argv[3]) : 200;
+  const char* preload = getenv("LD_PRELOAD");
+
+  if (threads < 1 || depth < 1 || idle < 0) {
+    fprintf(stderr, "usage: %s [threads] [depth] [idle threads]\n", argv[0]);
+    return 1;
+  }
+  printf("stacks: %s\n", preload != NULL && strstr(preload, "lpstack") != NULL ?
+         "lpstack" : "glibc");
+
+  pthread_t* ids = malloc(sizeof(pthread_t) * (threads > idle ? threads : idle));
+  walker* walkers = calloc(threads, sizeof(walker));
+  uint64_t sum = 0;
+  double start = Now();
+  for (int i = 0; i < threads; i++) {
+    walkers[i].frames = malloc(sizeof(char*) * depth);
+    walkers[i].depth = depth;
+    walkers[i].state = 0x9e3779b97f4a7c15ull * (i + 1);
+    pthread_create(&ids[i], NULL, Recurse, &walkers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    sum += walkers[i].sum;
+    free(walkers[i].frames);
+  }
+  double elapsed = Now() - start;
+  printf("recursion: %d threads, depth %d, %.1f ns per frame access%s\n",
+         threads, depth,
+         elapsed * 1e9 / ((double)threads * ROUNDS * ACCESSES),
+         sum == 0 ? "!" : "");
+
+  if (idle > 0) {
+    long before = ResidentKb();
+    for (int i = 0; i < idle; i++) {
+      pthread_create(&ids[i], NULL, Idle, NULL);
+    }
+    long after = ResidentKb();
+    pthread_mutex_lock(&idle_lock);
+    idle_release = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    for (int i = 0; i < idle; i++) {
+      pthread_join(ids[i], NULL);
+    }
+    printf("idle: %d threads, %ld KB resident each\n", idle,
+           (after - before) / idle);
+  }
+  free(walkers);
+  free(ids);
+  return 0;
+}
@@ -0,0 +1,871 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// iodlr-remap moves the code of an already running process to large pages.
+//
+// Where the kernel supports it, the text of the executable and the selected
+// DSOs is collapsed into huge pages from outside with
+// process_madvise(MADV_COLLAPSE). Otherwise, or where that fails, the tool
+// attaches to the process with ptrace and makes its main thread call
+// MapStaticCodeRangeToLargePages() of the large page runtime for each text
+// range, after switching the runtime to thread-safe remapping. The runtime
+// must be in the process already, or is loaded into it with dlopen().
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <link.h>
+#include <linux/limits.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "large_page.h"
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#ifndef __NR_process_madvise
+#define __NR_process_madvise 440
+#endif
+
+#ifndef NT_ARM_SYSTEM_CALL
+#define NT_ARM_SYSTEM_CALL 0x404
+#endif
+
+#define MAX_OBJECTS 256
+#define MAX_RANGES 1024
+#define MAX_DSO_PATTERNS 32
+#define MAX_UNSAFE_SPANS 256
+#define MAX_STOP_ATTEMPTS 100
+#define DEFAULT_LARGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// Room on the stack of the stopped thread for the data passed to injected
+// calls. The stack below its stack pointer is used, beyond the red zone.
+#define SCRATCH_SIZE (PATH_MAX + 64)
+#define RED_ZONE 128
+
+typedef enum {
+  method_auto,
+  method_collapse,
+  method_inject
+} remap_method;
+
+typedef struct {
+  char     path[PATH_MAX];
+  uint64_t text_bytes;
+  uint64_t large_page_bytes;
+} text_object;
+
+// An executable mapping of a selected object, as found before remapping.
+typedef struct {
+  uintptr_t from;
+  uintptr_t to;
+  uint64_t  offset;
+  size_t    object;
+  bool      done;
+} text_range;
+
+// Code that may hold a lock the injected calls take: the allocator, which
+// malloc() and strdup() lock, and the dynamic loader, which dlopen() and
+// dl_iterate_phdr() lock.
+typedef struct {
+  uintptr_t from;
+  uintptr_t to;
+} code_span;
+
+static const char* const allocator_functions[] = {
+  "malloc", "free", "calloc", "realloc", "memalign", "posix_memalign",
+  "aligned_alloc", "valloc", "pvalloc", "malloc_trim", "__libc_malloc",
+  "__libc_free", "__libc_calloc", "__libc_realloc", "__libc_memalign",
+  "_int_malloc", "_int_free", "_int_realloc", "_int_memalign",
+  "malloc_consolidate", "sysmalloc"
+};
+#define ALLOCATOR_FUNCTIONS \
+  (sizeof(allocator_functions) / sizeof(allocator_functions[0]))
+
+static text_object objects[MAX_OBJECTS];
+static size_t object_count = 0;
+static text_range ranges[MAX_RANGES];
+static size_t range_count = 0;
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s --pid PID [--dso REGEX]... [--no-exe]\n"
+          "       [--method auto|collapse|inject] [--library PATH]\n"
+          "\n"
+          "Move the code of a running process to large pages.\n"
+          "\n"
+          "  --pid PID        the process to remap\n"
+          "  --dso REGEX      also remap DSOs whose path matches REGEX\n"
+          "  --no-exe         do not remap the executable\n"
+          "  --method METHOD  collapse: process_madvise(MADV_COLLAPSE)\n"
+          "                   inject: call the large page runtime in the\n"
+          "                   process with ptrace\n"
+          "                   auto: collapse, inject where that fails\n"
+          "                   (default)\n"
+          "  --library PATH   load this large page runtime into the process\n"
+          "                   if it has none, e.g. liblppreload.so\n",
+          name);
+}
+
+static size_t findObject(const char* path) {
+  for (size_t idx = 0; idx < object_count; idx++) {
+    if (strcmp(objects[idx].path, path) == 0) return idx;
+  }
+  if (object_count == MAX_OBJECTS) return MAX_OBJECTS;
+  snprintf(objects[object_count].path, PATH_MAX, "%s", path);
+  return object_count++;
+}
+
+// Parse a line of /proc/<pid>/maps. `path` is left empty for anonymous
+// mappings.
+static bool parseMapsLine(const char* line, uintptr_t* from, uintptr_t* to,
+                          char* perms, uint64_t* offset, char* path) {
+  int path_start = 0;
+
+  if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s %" SCNx64 " %*s %*s %n",
+             from, to, perms, offset, &path_start) < 4) {
+    return false;
+  }
+  path[0] = 0;
+  if (path_start > 0) {
+    snprintf(path, PATH_MAX, "%s", line + path_start);
+    path[strcspn(path, "\n")] = 0;
+  }
+  return true;
+}
+
+// Find the executable file mappings of the executable and of the DSOs that
+// match any of `patterns`.
+static bool findTextRanges(pid_t pid, bool with_exe, regex_t* patterns,
+                           size_t pattern_count) {
+  char file[64];
+  char exe[PATH_MAX] = { 0 };
+  char line[PATH_MAX + 128];
+  char path[PATH_MAX];
+  char perms[8];
+  uintptr_t from, to;
+  uint64_t offset;
+
+  snprintf(file, sizeof(file), "/proc/%d/exe", pid);
+  if (readlink(file, exe, sizeof(exe) - 1) < 0) {
+    fprintf(stderr, "iodlr-remap: %s: %s\n", file, strerror(errno));
+    return false;
+  }
+
+  snprintf(file, sizeof(file), "/proc/%d/maps", pid);
+  FILE* ifs = fopen(file, "r");
+  if (!ifs) {
+    fprintf(stderr, "iodlr-remap: %s: %s\n", file, strerror(errno));
+    return false;
+  }
+  while (fgets(line, sizeof(line), ifs) != NULL) {
+    if (!parseMapsLine(line, &from, &to, perms, &offset, path) ||
+        perms[2] != 'x' || path[0] != '/') {
+      continue;
+    }
+    bool selected = (with_exe && strcmp(path, exe) == 0);
+    for (size_t idx = 0; !selected && idx < pattern_count; idx++) {
+      selected = (regexec(&patterns[idx], path, 0, NULL, 0) == 0);
+    }
+    if (!selected || range_count == MAX_RANGES) continue;
+
+    size_t object = findObject(path);
+    if (object == MAX_OBJECTS) continue;
+    ranges[range_count++] = (text_range){ from, to, offset, object, false };
+  }
+  fclose(ifs);
+  return true;
+}
+
+// Sum up how much of each object's text is backed by large pages, counting the
+// mappings that now lie within its original text ranges. Moved code is in
+// anonymous mappings, collapsed code in file mappings.
+static bool measureCoverage(pid_t pid) {
+  char file[64];
+  char line[PATH_MAX + 128];
+  char path[PATH_MAX];
+  char perms[8];
+  uintptr_t from, to;
+  uint64_t offset, kb;
+  size_t object = MAX_OBJECTS;
+
+  for (size_t idx = 0; idx < object_count; idx++) {
+    objects[idx].text_bytes = 0;
+    objects[idx].large_page_bytes = 0;
+  }
+  for (size_t idx = 0; idx < range_count; idx++) {
+    objects[ranges[idx].object].text_bytes += ranges[idx].to - ranges[idx].from;
+  }
+
+  snprintf(file, sizeof(file), "/proc/%d/smaps", pid);
+  FILE* ifs = fopen(file, "r");
+  if (!ifs) {
+    fprintf(stderr, "iodlr-remap: %s: %s\n", file, strerror(errno));
+    return false;
+  }
+  while (fgets(line, sizeof(line), ifs) != NULL) {
+    if (parseMapsLine(line, &from, &to, perms, &offset, path)) {
+      object = MAX_OBJECTS;
+      for (size_t idx = 0; idx < range_count; idx++) {
+        if (from >= ranges[idx].from && to <= ranges[idx].to) {
+          object = ranges[idx].object;
+          break;
+        }
+      }
+    } else if (object != MAX_OBJECTS &&
+               (sscanf(line, "AnonHugePages: %" SCNu64 " kB", &kb) == 1 ||
+                sscanf(line, "FilePmdMapped: %" SCNu64 " kB", &kb) == 1)) {
+      objects[object].large_page_bytes += kb * 1024;
+    }
+  }
+  fclose(ifs);
+  return true;
+}
+
+static void printCoverage(const char* when) {
+  printf("%s:\n", when);
+  for (size_t idx = 0; idx < object_count; idx++) {
+    const text_object* object = &objects[idx];
+    printf("  %s: %" PRIu64 " kB of %" PRIu64 " kB text on large pages"
+           " (%.1f%%)\n",
+           object->path, object->large_page_bytes / 1024,
+           object->text_bytes / 1024,
+           object->text_bytes > 0
+               ? 100.0 * object->large_page_bytes / object->text_bytes
+               : 0.0);
+  }
+}
+
+// Collapse the large page aligned part of each text range into huge pages.
+// The page cache of a file can only be mapped with huge pages where file
+// offsets and addresses are congruent modulo the huge page size, which is
+// what tools/align-load-segments.py arranges.
+static void collapseTextRanges(pid_t pid, uint64_t page_size) {
+  int pidfd = syscall(__NR_pidfd_open, pid, 0);
+  if (pidfd < 0) {
+    fprintf(stderr, "iodlr-remap: pidfd_open: %s\n", strerror(errno));
+    return;
+  }
+
+  for (size_t idx = 0; idx < range_count; idx++) {
+    text_range* range = &ranges[idx];
+    uintptr_t from = (range->from + page_size - 1) & ~(page_size - 1);
+    uintptr_t to = range->to & ~(page_size - 1);
+    const char* path = objects[range->object].path;
+
+    if (from >= to) {
+      printf("%s: %" PRIxPTR "-%" PRIxPTR ": smaller than a large page\n",
+             path, range->from, range->to);
+      range->done = true;
+      continue;
+    }
+    if ((range->offset + (from - range->from)) % page_size != 0) {
+      printf("%s: %" PRIxPTR "-%" PRIxPTR ": file offsets are not large page "
+             "aligned\n", path, range->from, range->to);
+      continue;
+    }
+
+    struct iovec iov = { (void*)from, to - from };
+    if (syscall(__NR_process_madvise, pidfd, &iov, 1, MADV_COLLAPSE, 0) < 0) {
+      int error = errno;
+      printf("%s: %" PRIxPTR "-%" PRIxPTR ": collapse failed: %s\n", path,
+             from, to, strerror(error));
+      // Nothing else will succeed without the system call or the privilege.
+      if (error == ENOSYS || error == EPERM) break;
+      continue;
+    }
+    printf("%s: %" PRIxPTR "-%" PRIxPTR ": collapsed\n", path, from, to);
+    range->done = true;
+  }
+
+  close(pidfd);
+}
+
+// Look up functions in the symbol tables of an ELF file, and return their
+// addresses relative to the load base and their sizes, along with the lowest
+// PT_LOAD address, which is needed to find the load base in the process. The
+// value of a function not found is 0. Returns the number found.
+static size_t findElfSymbols(const char* file, const char* const* names,
+                             size_t count, uint64_t* values, uint64_t* sizes,
+                             uint64_t* first_vaddr) {
+  struct stat st;
+  size_t found = 0;
+
+  memset(values, 0, count * sizeof(*values));
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+    close(fd);
+    return 0;
+  }
+  const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+
+  size_t size = st.st_size;
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)data;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_phoff + ehdr->e_phnum * sizeof(ElfW(Phdr)) > size ||
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > size) {
+    munmap((void*)data, size);
+    return 0;
+  }
+
+  const ElfW(Phdr)* phdrs = (const ElfW(Phdr)*)(data + ehdr->e_phoff);
+  *first_vaddr = UINT64_MAX;
+  for (ElfW(Half) idx = 0; idx < ehdr->e_phnum; idx++) {
+    if (phdrs[idx].p_type == PT_LOAD && phdrs[idx].p_vaddr < *first_vaddr) {
+      *first_vaddr = phdrs[idx].p_vaddr & ~(uint64_t)(getpagesize() - 1);
+    }
+  }
+
+  const ElfW(Shdr)* shdrs = (const ElfW(Shdr)*)(data + ehdr->e_shoff);
+  for (ElfW(Half) idx = 0; idx < ehdr->e_shnum && found < count; idx++) {
+    const ElfW(Shdr)* symtab = &shdrs[idx];
+    if ((symtab->sh_type != SHT_DYNSYM && symtab->sh_type != SHT_SYMTAB) ||
+        symtab->sh_link >= ehdr->e_shnum ||
+        symtab->sh_offset + symtab->sh_size > size) {
+      continue;
+    }
+    const ElfW(Shdr)* strtab = &shdrs[symtab->sh_link];
+    if (strtab->sh_offset + strtab->sh_size > size) continue;
+
+    const ElfW(Sym)* syms = (const ElfW(Sym)*)(data + symtab->sh_offset);
+    for (size_t sym = 0;
+         sym < symtab->sh_size / sizeof(ElfW(Sym)) && found < count; sym++) {
+      if (ELF64_ST_TYPE(syms[sym].st_info) != STT_FUNC ||
+          syms[sym].st_shndx == SHN_UNDEF ||
+          syms[sym].st_name >= strtab->sh_size) {
+        continue;
+      }
+      for (size_t name = 0; name < count; name++) {
+        if (values[name] == 0 &&
+            strncmp(data + strtab->sh_offset + syms[sym].st_name, names[name],
+                    strtab->sh_size - syms[sym].st_name) == 0) {
+          values[name] = syms[sym].st_value;
+          sizes[name] = syms[sym].st_size;
+          found++;
+          break;
+        }
+      }
+    }
+  }
+
+  munmap((void*)data, size);
+  return found;
+}
+
+// Find the address of a function in any object loaded into the process.
+static bool findFunction(pid_t pid, const char* name, uintptr_t* addr) {
+  char file[PATH_MAX + 32];
+  char line[PATH_MAX + 128];
+  char path[PATH_MAX];
+  char seen[PATH_MAX] = { 0 };
+  char perms[8];
+  uintptr_t from, to;
+  uint64_t offset, value, value_size, first_vaddr;
+  bool found = false;
+
+  snprintf(file, sizeof(file), "/proc/%d/maps", pid);
+  FILE* ifs = fopen(file, "r");
+  if (!ifs) return false;
+  // The mapping at file offset 0 is the lowest one of an object.
+  while (!found && fgets(line, sizeof(line), ifs) != NULL) {
+    if (!parseMapsLine(line, &from, &to, perms, &offset, path) ||
+        path[0] != '/' || offset != 0 || strcmp(path, seen) == 0) {
+      continue;
+    }
+    snprintf(seen, sizeof(seen), "%s", path);
+    snprintf(file, sizeof(file), "/proc/%d/root%s", pid, path);
+    if (findElfSymbols(file, &name, 1, &value, &value_size, &first_vaddr)) {
+      *addr = from - first_vaddr + value;
+      found = true;
+    }
+  }
+  fclose(ifs);
+  return found;
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+// The load address of the dynamic loader of the process, or 0 if unknown.
+static uintptr_t loaderBase(pid_t pid) {
+  char file[64];
+  ElfW(auxv_t) entry;
+  uintptr_t base = 0;
+
+  snprintf(file, sizeof(file), "/proc/%d/auxv", pid);
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  while (read(fd, &entry, sizeof(entry)) == sizeof(entry) &&
+         entry.a_type != AT_NULL) {
+    if (entry.a_type == AT_BASE) {
+      base = entry.a_un.a_val;
+      break;
+    }
+  }
+  close(fd);
+  return base;
+}
+
+// Find the code in which a thread must not be stopped for calls to be
+// injected: the allocator functions of every object and all of the dynamic
+// loader. Returns the number of spans found.
+static size_t findUnsafeSpans(pid_t pid, code_span* spans, size_t max) {
+  char file[PATH_MAX + 32];
+  char line[PATH_MAX + 128];
+  char path[PATH_MAX];
+  char seen[PATH_MAX] = { 0 };
+  char loader[PATH_MAX] = { 0 };
+  char perms[8];
+  uintptr_t from, to;
+  uintptr_t loader_base = loaderBase(pid);
+  uint64_t offset, first_vaddr;
+  uint64_t values[ALLOCATOR_FUNCTIONS], sizes[ALLOCATOR_FUNCTIONS];
+  size_t count = 0;
+
+  snprintf(file, sizeof(file), "/proc/%d/maps", pid);
+  FILE* ifs = fopen(file, "r");
+  if (!ifs) return 0;
+  while (count < max && fgets(line, sizeof(line), ifs) != NULL) {
+    if (!parseMapsLine(line, &from, &to, perms, &offset, path) ||
+        path[0] != '/') {
+      continue;
+    }
+    if (from == loader_base && offset == 0) {
+      snprintf(loader, sizeof(loader), "%s", path);
+    }
+    if (strcmp(path, loader) == 0) {
+      if (perms[2] == 'x') {
+        spans[count].from = from;
+        spans[count++].to = to;
+      }
+      continue;
+    }
+    // The mapping at file offset 0 is the lowest one of an object.
+    if (offset != 0 || strcmp(path, seen) == 0) continue;
+    snprintf(seen, sizeof(seen), "%s", path);
+    snprintf(file, sizeof(file), "/proc/%d/root%s", pid, path);
+    if (findElfSymbols(file, allocator_functions, ALLOCATOR_FUNCTIONS, values,
+                       sizes, &first_vaddr) == 0) {
+      continue;
+    }
+    for (size_t idx = 0; idx < ALLOCATOR_FUNCTIONS && count < max; idx++) {
+      if (values[idx] != 0) {
+        spans[count].from = from - first_vaddr + values[idx];
+        spans[count].to = spans[count].from + sizes[idx];
+        count++;
+      }
+    }
+  }
+  fclose(ifs);
+  return count;
+}
+
+typedef struct user_regs_struct thread_regs;
+
+// The registers of a stopped thread that decide how it resumes. On aarch64 the
+// system call it was stopped in, which is restarted on resuming, is not part
+// of the general registers.
+typedef struct {
+  thread_regs regs;
+  int         syscall_nr;
+} thread_state;
+
+static bool getRegs(pid_t pid, thread_regs* regs) {
+  struct iovec iov = { regs, sizeof(*regs) };
+  return ptrace(PTRACE_GETREGSET, pid, (void*)NT_PRSTATUS, &iov) == 0;
+}
+
+static bool setRegs(pid_t pid, const thread_regs* regs) {
+  struct iovec iov = { (void*)regs, sizeof(*regs) };
+  return ptrace(PTRACE_SETREGSET, pid, (void*)NT_PRSTATUS, &iov) == 0;
+}
+
+static bool getState(pid_t pid, thread_state* state) {
+  if (!getRegs(pid, &state->regs)) return false;
+#if defined(__x86_64__)
+  state->syscall_nr = (int)state->regs.orig_rax;
+  return true;
+#else
+  struct iovec iov = { &state->syscall_nr, sizeof(state->syscall_nr) };
+  return ptrace(PTRACE_GETREGSET, pid, (void*)NT_ARM_SYSTEM_CALL, &iov) == 0;
+#endif
+}
+
+static bool setState(pid_t pid, const thread_state* state) {
+#if defined(__aarch64__)
+  struct iovec iov = { (void*)&state->syscall_nr, sizeof(state->syscall_nr) };
+  if (ptrace(PTRACE_SETREGSET, pid, (void*)NT_ARM_SYSTEM_CALL, &iov) != 0) {
+    return false;
+  }
+#endif
+  return setRegs(pid, &state->regs);
+}
+
+// Whether calls may be injected into a thread stopped in `state`: it must not
+// be inside the allocator or the dynamic loader, or in a system call the
+// allocator makes to grow or shrink the heap, as it may hold their locks.
+static bool isSafeStop(const thread_state* state, const code_span* spans,
+                       size_t span_count) {
+#if defined(__x86_64__)
+  uintptr_t pc = state->regs.rip;
+#else
+  uintptr_t pc = state->regs.pc;
+#endif
+  switch (state->syscall_nr) {
+#ifdef __NR_brk
+    case __NR_brk:
+#endif
+    case __NR_mmap:
+    case __NR_munmap:
+    case __NR_mremap:
+    case __NR_mprotect:
+    case __NR_madvise:
+      return false;
+  }
+  for (size_t idx = 0; idx < span_count; idx++) {
+    if (pc >= spans[idx].from && pc < spans[idx].to) return false;
+  }
+  return true;
+}
+
+static uintptr_t scratchAddress(const thread_regs* regs) {
+#if defined(__x86_64__)
+  uintptr_t sp = regs->rsp;
+#else
+  uintptr_t sp = regs->sp;
+#endif
+  return (sp - RED_ZONE - SCRATCH_SIZE) & ~(uintptr_t)15;
+}
+
+static bool writeScratch(pid_t pid, const thread_regs* regs, const void* data,
+                         size_t size) {
+  struct iovec local = { (void*)data, size };
+  struct iovec remote = { (void*)scratchAddress(regs), size };
+  return process_vm_writev(pid, &local, 1, &remote, 1, 0) == (ssize_t)size;
+}
+
+// Make the stopped thread call `func` with up to three integer arguments and
+// wait for it to return. The call returns to address 0, and the resulting
+// fault tells the tool that it is done. If the thread was stopped in a system
+// call, the kernel must not restart it before the call; setState() with the
+// saved state restores the restart afterwards.
+static bool injectCall(pid_t pid, const thread_regs* saved, uintptr_t func,
+                       uintptr_t arg0, uintptr_t arg1, uintptr_t arg2,
+                       uintptr_t* result) {
+  thread_regs regs = *saved;
+  uintptr_t sp = scratchAddress(saved);
+  int status;
+
+#if defined(__x86_64__)
+  static const uintptr_t return_address = 0;
+  struct iovec local = { (void*)&return_address, sizeof(return_address) };
+  struct iovec remote = { (void*)(sp - sizeof(return_address)),
+                          sizeof(return_address) };
+  if (process_vm_writev(pid, &local, 1, &remote, 1, 0) < 0) return false;
+  regs.rsp = sp - sizeof(return_address);
+  regs.rip = func;
+  regs.rdi = arg0;
+  regs.rsi = arg1;
+  regs.rdx = arg2;
+  regs.rax = 0;
+  regs.orig_rax = -1;
+#else
+  int syscall_nr = -1;
+  struct iovec iov = { &syscall_nr, sizeof(syscall_nr) };
+  if (ptrace(PTRACE_SETREGSET, pid, (void*)NT_ARM_SYSTEM_CALL, &iov) != 0) {
+    return false;
+  }
+  regs.sp = sp;
+  regs.pc = func;
+  regs.regs[0] = arg0;
+  regs.regs[1] = arg1;
+  regs.regs[2] = arg2;
+  regs.regs[30] = 0;
+#endif
+  if (!setRegs(pid, &regs) || ptrace(PTRACE_CONT, pid, NULL, 0) < 0) {
+    return false;
+  }
+
+  for (;;) {
+    if (waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status)) {
+      fprintf(stderr, "iodlr-remap: process %d exited\n", pid);
+      exit(1);
+    }
+    int sig = WSTOPSIG(status);
+    if (sig == SIGSEGV) {
+      if (!getRegs(pid, &regs)) return false;
+#if defined(__x86_64__)
+      if (regs.rip == 0) {
+        *result = regs.rax;
+        return true;
+      }
+#else
+      if (regs.pc == 0) {
+        *result = regs.regs[0];
+        return true;
+      }
+#endif
+      fprintf(stderr, "iodlr-remap: the injected call crashed\n");
+      return false;
+    }
+    // Let group stops end and signals reach their handlers meanwhile.
+    if ((status >> 16) == PTRACE_EVENT_STOP) sig = 0;
+    if (ptrace(PTRACE_CONT, pid, NULL, (void*)(uintptr_t)sig) < 0) {
+      return false;
+    }
+  }
+}
+
+// Move the text ranges not collapsed yet by calling the large page runtime in
+// the main thread of the process.
+static void injectTextRanges(pid_t pid, const char* library) {
+  uintptr_t enabled_fn, thread_safe_fn, map_range_fn, dlopen_fn, result;
+  code_span spans[MAX_UNSAFE_SPANS];
+  size_t span_count = findUnsafeSpans(pid, spans, MAX_UNSAFE_SPANS);
+  thread_state state;
+  int status;
+
+  if (ptrace(PTRACE_SEIZE, pid, NULL, 0) < 0) {
+    fprintf(stderr, "iodlr-remap: ptrace: %s\n", strerror(errno));
+    return;
+  }
+  // Stop the thread where it holds none of the locks the injected calls take,
+  // letting it run on for a while each time it is not.
+  for (int attempt = 0;; attempt++) {
+    if (ptrace(PTRACE_INTERRUPT, pid, NULL, 0) < 0 ||
+        waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status) ||
+        !getState(pid, &state)) {
+      fprintf(stderr, "iodlr-remap: cannot stop process %d\n", pid);
+      ptrace(PTRACE_DETACH, pid, NULL, 0);
+      return;
+    }
+    if (isSafeStop(&state, spans, span_count)) break;
+    int sig = (status >> 16) == PTRACE_EVENT_STOP ? 0 : WSTOPSIG(status);
+    if (attempt == MAX_STOP_ATTEMPTS ||
+        ptrace(PTRACE_CONT, pid, NULL, (void*)(uintptr_t)sig) < 0) {
+      fprintf(stderr, "iodlr-remap: process %d stays inside the allocator or "
+              "the dynamic loader\n", pid);
+      ptrace(PTRACE_DETACH, pid, NULL, 0);
+      return;
+    }
+    usleep(10000);
+  }
+  thread_regs* saved = &state.regs;
+
+  if (!findFunction(pid, "MapStaticCodeRangeToLargePages", &map_range_fn)) {
+    if (library == NULL) {
+      fprintf(stderr, "iodlr-remap: process %d has no large page runtime; "
+              "use --library\n", pid);
+      goto detach;
+    }
+    // glibc before 2.34 only has dlopen() in libdl, but always an internal
+    // equivalent in libc.
+    if (!findFunction(pid, "dlopen", &dlopen_fn) &&
+        !findFunction(pid, "__libc_dlopen_mode", &dlopen_fn)) {
+      fprintf(stderr, "iodlr-remap: process %d cannot load libraries\n", pid);
+      goto detach;
+    }
+    if (!writeScratch(pid, saved, library, strlen(library) + 1) ||
+        !injectCall(pid, saved, dlopen_fn, scratchAddress(saved), RTLD_NOW,
+                    0, &result) ||
+        result == 0 ||
+        !findFunction(pid, "MapStaticCodeRangeToLargePages", &map_range_fn)) {
+      fprintf(stderr, "iodlr-remap: cannot load %s into process %d\n",
+              library, pid);
+      goto detach;
+    }
+  }
+  if (!findFunction(pid, "IsLargePagesEnabled", &enabled_fn) ||
+      !findFunction(pid, "SetThreadSafeRemap", &thread_safe_fn)) {
+    fprintf(stderr, "iodlr-remap: the large page runtime in process %d is "
+            "too old\n", pid);
+    goto detach;
+  }
+
+  // IsLargePagesEnabled() also chooses between transparent and explicit huge
+  // pages. Its result is written to the scratch area.
+  uint64_t enabled = 0;
+  struct iovec local = { &enabled, sizeof(enabled) };
+  struct iovec remote = { (void*)scratchAddress(saved), sizeof(enabled) };
+  if (!writeScratch(pid, saved, &enabled, sizeof(enabled)) ||
+      !injectCall(pid, saved, enabled_fn, scratchAddress(saved), 0, 0,
+                  &result) ||
+      process_vm_readv(pid, &local, 1, &remote, 1, 0) < 0) {
+    goto detach;
+  }
+  if ((map_status)result != map_ok || (enabled & 0xff) == 0) {
+    fprintf(stderr, "iodlr-remap: large pages are not enabled: %s\n",
+            MapStatusStr((map_status)result, true));
+    goto detach;
+  }
+  if (!injectCall(pid, saved, thread_safe_fn, true, 0, 0, &result)) {
+    goto detach;
+  }
+
+  for (size_t idx = 0; idx < range_count; idx++) {
+    text_range* range = &ranges[idx];
+    if (range->done) continue;
+    if (!injectCall(pid, saved, map_range_fn, range->from, range->to, 0,
+                    &result)) {
+      break;
+    }
+    printf("%s: %" PRIxPTR "-%" PRIxPTR ": moved: %s\n",
+           objects[range->object].path, range->from, range->to,
+           MapStatusStr((map_status)result, true));
+    range->done = ((map_status)result == map_ok ||
+                   (map_status)result == map_region_too_small);
+  }
+
+detach:
+  setState(pid, &state);
+  ptrace(PTRACE_DETACH, pid, NULL, 0);
+}
+
+#else
+
+static void injectTextRanges(pid_t pid, const char* library) {
+  fprintf(stderr, "iodlr-remap: injecting calls is not supported on this "
+          "platform\n");
+}
+
+#endif
+
+static size_t countPendingRanges() {
+  size_t pending = 0;
+  for (size_t idx = 0; idx < range_count; idx++) {
+    pending += !ranges[idx].done;
+  }
+  return pending;
+}
+
+int main(int argc, char** argv) {
+  static const struct option options[] = {
+    { "pid", required_argument, NULL, 'p' },
+    { "dso", required_argument, NULL, 'd' },
+    { "no-exe", no_argument, NULL, 'n' },
+    { "method", required_argument, NULL, 'm' },
+    { "library", required_argument, NULL, 'l' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  regex_t patterns[MAX_DSO_PATTERNS];
+  size_t pattern_count = 0;
+  remap_method method = method_auto;
+  const char* library = NULL;
+  bool with_exe = true;
+  pid_t pid = 0;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "p:d:nm:l:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'p':
+        pid = atoi(optarg);
+        break;
+      case 'd':
+        if (pattern_count == MAX_DSO_PATTERNS ||
+            regcomp(&patterns[pattern_count], optarg,
+                    REG_EXTENDED | REG_NOSUB) != 0) {
+          fprintf(stderr, "iodlr-remap: invalid --dso %s\n", optarg);
+          return 2;
+        }
+        pattern_count++;
+        break;
+      case 'n':
+        with_exe = false;
+        break;
+      case 'm':
+        if (strcmp(optarg, "auto") == 0) {
+          method = method_auto;
+        } else if (strcmp(optarg, "collapse") == 0) {
+          method = method_collapse;
+        } else if (strcmp(optarg, "inject") == 0) {
+          method = method_inject;
+        } else {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      case 'l':
+        library = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (pid <= 0 || optind != argc) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (!findTextRanges(pid, with_exe, patterns, pattern_count)) return 1;
+  if (range_count == 0) {
+    fprintf(stderr, "iodlr-remap: no text found to remap\n");
+    return 1;
+  }
+  if (!measureCoverage(pid)) return 1;
+  printCoverage("before");
+
+  large_page_capabilities caps;
+  GetLargePageCapabilities(&caps, false);
+  uint64_t page_size =
+      caps.hpage_pmd_size != 0 ? caps.hpage_pmd_size : DEFAULT_LARGE_PAGE_SIZE;
+
+  if (method != method_inject) {
+    if (caps.process_madvise && caps.madv_collapse) {
+      collapseTextRanges(pid, page_size);
+    } else {
+      fprintf(stderr, "iodlr-remap: the kernel cannot collapse memory of "
+              "other processes\n");
+    }
+  }
+  if (method != method_collapse && countPendingRanges() > 0) {
+    injectTextRanges(pid, library);
+  }
+
+  if (!measureCoverage(pid)) return 1;
+  printCoverage("after");
+  return countPendingRanges() == 0 ? 0 : 1;
+}
@@ -22,6 +22,7 @@
 
 #define _GNU_SOURCE
 #include "large_page.h"
+#include "lp_probes.h"
 #include <link.h>
 #include <sys/mman.h>
 #include <stdlib.h>
@@ -32,28 +33,121 @@
 #include <inttypes.h>
 #include <linux/limits.h>
 #include <regex.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/auxv.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #ifndef MAP_HUGETLB
 #define MAP_HUGETLB 0x40000 /* arch specific */
 #endif
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+#ifndef __NR_process_madvise
+#define __NR_process_madvise 440
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#endif
+
+#ifndef PR_SET_VMA
+#define PR_SET_VMA 0x53564d41
+#define PR_SET_VMA_ANON_NAME 0
+#endif
+
+// A remap plan found in the `.note.iodlr` note of a loaded object. The ranges
+// point into the note itself and are not necessarily 8-byte aligned.
 typedef struct {
-  void*     from;
-  void*     to;
-} mem_range;
+  ElfW(Addr)        base;
+  const ElfW(Phdr)* phdr;
+  ElfW(Half)        phnum;
+  const char*       ranges;
+  uint32_t          range_count;
+  uint32_t          min_coverage;
+} remap_plan;
 
 typedef struct {
   uintptr_t start;
   uintptr_t end;
   regex_t regex;
   bool have_regex;
+  remap_plan plan;
   map_status status;
 } FindParams;
 
+#define MAX_REMAPPED_REGIONS 128
+
+// A region moved to large pages, together with what is needed to map it back to
+// the file it was originally loaded from.
+typedef struct {
+  mem_range range;
+  char*     path;
+  char*     name;
+  off_t     offset;
+  uintptr_t base;
+  dev_t     dev;
+  ino_t     ino;
+  bool      demoted;
+  // The GDB JIT registration of the region while it is on large pages.
+  struct jit_code_entry* jit_entry;
+} region_entry;
+
+typedef struct {
+  uintptr_t   addr;
+  const char* path;
+  off_t       offset;
+  uintptr_t   base;
+} FindObjectParams;
+
+static region_entry remapped_regions[MAX_REMAPPED_REGIONS];
+static size_t remapped_region_count = 0;
+static remap_counters counters = { 0, 0 };
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool thread_safe_remap = false;
+static bool perf_map_enabled = false;
+static bool debugger_registration_enabled = false;
+static bool text_section_lookup = false;
+
+#define MAX_REMAP_REPORTS 256
+
+static remap_report remap_reports[MAX_REMAP_REPORTS];
+static size_t remap_report_count = 0;
+
+static large_page_capabilities capabilities;
+static bool capabilities_valid = false;
+static pthread_mutex_t capabilities_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether freshly copied code is collapsed into huge pages with MADV_COLLAPSE,
+// because the page fault handler would not allocate them directly.
+static bool collapse_after_copy = false;
+
 int iodlr_number_of_ehp_avail = 0;
 char *iodlr_use_ehp = NULL;
 #define HPS (2L * 1024 * 1024)
 
+#if __WORDSIZE == 64
+#define ELFCLASSW ELFCLASS64
+#else
+#define ELFCLASSW ELFCLASS32
+#endif
+
 static inline uintptr_t largepage_align_down(uintptr_t addr) {
   return (addr & ~(HPS - 1));
 }
@@ -62,57 +156,739 @@ static inline uintptr_t largepage_align_up(uintptr_t addr) {
   return largepage_align_down(addr + HPS - 1);
 }
 
+// Always inlined, because it is also used by `MoveRegionToLargePages`, which
+// must not call code that might be moved.
+static inline __attribute__((__always_inline__)) uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// On NUMA systems, the large pages that moved code lands on should be on the
+// node the process runs on, or page walks after iTLB misses cross the
+// interconnect. Pages are allocated where they are first touched, by the copy,
+// or for explicit huge pages from any node with free pages left. So the node
+// is chosen up front, and the destination of every move is bound to it with a
+// preferred policy, which still falls back to other nodes rather than fail.
+static int numa_node_setting = LARGE_PAGE_NUMA_AUTO;
+static unsigned long numa_target_mask = 0;
+
+// Parse a list of ranges such as "0-3,8-11" into a CPU set.
+static void ParseCpuList(const char* list, cpu_set_t* cpus) {
+  CPU_ZERO(cpus);
+  while (*list != 0) {
+    char* end;
+    unsigned long from = strtoul(list, &end, 10);
+    unsigned long to = from;
+    if (end == list) {
+      break;
+    }
+    if (*end == '-') {
+      list = end + 1;
+      to = strtoul(list, &end, 10);
+    }
+    for (unsigned long cpu = from; cpu <= to && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+    list = (*end == ',' ? end + 1 : end);
+    if (*list == '\n') {
+      break;
+    }
+  }
+}
+
+static bool ReadCpuList(const char* path, cpu_set_t* cpus) {
+  char list[4096];
+  FILE* ifs = fopen(path, "r");
+  if (!ifs) {
+    return false;
+  }
+  bool ok = (fgets(list, sizeof(list), ifs) != NULL);
+  fclose(ifs);
+  if (ok) {
+    ParseCpuList(list, cpus);
+  }
+  return ok;
+}
+
+// The node to place moved code on: the one named by SetNumaNode(), or else the
+// only node the process may allocate memory from, or the only node whose CPUs
+// the process may run on. -1 if there is no such node, or just one node.
+static int FindNumaNode() {
+  cpu_set_t online, allowed, node_cpus;
+  unsigned long nodemask = 0;
+  int mode = 0;
+  int found = -1;
+
+  if (numa_node_setting != LARGE_PAGE_NUMA_AUTO) {
+    return numa_node_setting;
+  }
+  // CPU sets are abused as node sets here, both are lists of ranges.
+  if (!ReadCpuList("/sys/devices/system/node/online", &online) ||
+      CPU_COUNT(&online) < 2) {
+    return -1;
+  }
+
+  if (syscall(__NR_get_mempolicy, &mode, &nodemask, sizeof(nodemask) * 8,
+              NULL, 0) == 0 &&
+      (mode == MPOL_BIND || mode == MPOL_PREFERRED) &&
+      __builtin_popcountl(nodemask) == 1) {
+    return __builtin_ctzl(nodemask);
+  }
+
+  // The main thread is the one a worker pins, also when moving code from
+  // another thread.
+  if (sched_getaffinity(getpid(), sizeof(allowed), &allowed) != 0) {
+    return -1;
+  }
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    char path[64];
+    if (!CPU_ISSET(node, &online)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    if (!ReadCpuList(path, &node_cpus)) {
+      continue;
+    }
+    CPU_AND(&node_cpus, &node_cpus, &allowed);
+    if (CPU_COUNT(&node_cpus) == 0) {
+      continue;
+    }
+    if (CPU_COUNT(&node_cpus) != CPU_COUNT(&allowed) || found >= 0) {
+      return -1;
+    }
+    found = node;
+  }
+  return found;
+}
+
+// Choose the node for the moves that follow. Returns the node, or -1.
+static int SelectNumaNode() {
+  int node = FindNumaNode();
+  numa_target_mask = (node >= 0 && node < 64 ? 1UL << node : 0);
+  return node;
+}
+
+// Prefer the chosen node for the pages of a mapping not touched yet. Always
+// inlined, because it is also used by `MoveRegionToLargePages`, which must not
+// call code that might be moved.
+static inline __attribute__((__always_inline__)) void
+BindToNumaNode(void* addr, size_t size) {
+  if (numa_target_mask != 0) {
+    // Best effort: the pages land wherever the kernel puts them if this fails.
+    syscall(__NR_mbind, addr, size, MPOL_PREFERRED, &numa_target_mask,
+            sizeof(numa_target_mask) * 8 + 1, 0);
+  }
+}
+
+// Find out which nodes the large pages of a moved region are on.
+static void FindNumaPlacement(remap_report* report) {
+  uint32_t pages_per_node[64] = { 0 };
+  uintptr_t from = (uintptr_t)report->aligned.from;
+  uintptr_t to = (uintptr_t)report->aligned.to;
+  uint32_t pages = 0;
+
+  report->numa_node = -1;
+  while (from < to) {
+    void* addrs[64];
+    int nodes[64];
+    unsigned long count = 0;
+    for (; from < to && count < 64; from += HPS) {
+      addrs[count++] = (void*)from;
+    }
+    if (syscall(__NR_move_pages, 0, count, addrs, NULL, nodes, 0) != 0) {
+      return;
+    }
+    for (unsigned long idx = 0; idx < count; idx++) {
+      if (nodes[idx] >= 0 && nodes[idx] < 64) {
+        pages_per_node[nodes[idx]]++;
+        pages++;
+      }
+    }
+  }
+
+  for (int node = 0; node < 64; node++) {
+    if (report->numa_node < 0 ||
+        pages_per_node[node] > pages_per_node[report->numa_node]) {
+      report->numa_node = (pages_per_node[node] > 0 ? node : -1);
+    }
+  }
+  int local = (report->numa_target_node >= 0 ? report->numa_target_node
+                                             : report->numa_node);
+  report->numa_remote_pages =
+      pages - (local >= 0 && local < 64 ? pages_per_node[local] : 0);
+}
+
+typedef struct {
+  const char* data;
+  size_t      size;
+} elf_image;
+
+// Map an ELF file read-only in its entirety. This is only needed when
+// section-level detail is required, because the program headers of every
+// loaded object are already available in memory via `dl_iterate_phdr`.
+static map_status MapElfImage(const char* fname, elf_image* image) {
+  struct stat st;
+  int fd = open(fname, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return map_open_exe_failed;
+
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ElfW(Ehdr))) {
+    close(fd);
+    return map_read_exe_header_failed;
+  }
+
+  image->size = st.st_size;
+  image->data = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (close(fd) != 0 && image->data != MAP_FAILED) {
+    munmap((void*)image->data, image->size);
+    return map_see_errno_close_exe_failed;
+  }
+  if (image->data == MAP_FAILED) return map_see_errno_mmap_exe_failed;
+
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)image->data;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASSW) {
+    munmap((void*)image->data, image->size);
+    return map_read_exe_header_failed;
+  }
+
+  return map_ok;
+}
+
+static void UnmapElfImage(elf_image* image) {
+  munmap((void*)image->data, image->size);
+}
+
+// Locate the section named `name` in a mapped ELF image, validating that the
+// section header table and the section name string table lie within the file.
+static map_status FindElfSection(const elf_image* image,
+                                 const char* name,
+                                 ElfW(Shdr)* section) {
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)image->data;
+
+  if (ehdr->e_shoff == 0 || ehdr->e_shoff > image->size ||
+      ehdr->e_shnum > (image->size - ehdr->e_shoff) / sizeof(ElfW(Shdr)) ||
+      ehdr->e_shstrndx >= ehdr->e_shnum) {
+    return map_read_exe_sheaders_failed;
+  }
+  const ElfW(Shdr)* shdrs = (const ElfW(Shdr)*)(image->data + ehdr->e_shoff);
+
+  const ElfW(Shdr)* sh_strtab = &shdrs[ehdr->e_shstrndx];
+  if (sh_strtab->sh_offset > image->size ||
+      sh_strtab->sh_size > image->size - sh_strtab->sh_offset) {
+    return map_read_exe_string_table_failed;
+  }
+  const char* section_names = image->data + sh_strtab->sh_offset;
+
+  for (uint32_t idx = 0; idx < ehdr->e_shnum; idx++) {
+    const ElfW(Shdr)* sh = &shdrs[idx];
+    if (sh->sh_name < sh_strtab->sh_size &&
+        strncmp(&section_names[sh->sh_name], name,
+                sh_strtab->sh_size - sh->sh_name) == 0) {
+      *section = *sh;
+      return map_ok;
+    }
+  }
+
+  return map_region_not_found;
+}
+
 static map_status FindTextSection(const char* fname, ElfW(Shdr)* text_section) {
-  FILE* bin = fopen(fname, "r");
-  if (bin == NULL) return map_open_exe_failed;
-
-#define CLEAN_EXIT(code)                        \
-  do {                                          \
-    int status = 0;                             \
-    if (errno == 0) {                           \
-      status = fclose(bin);                     \
-    }                                           \
-    return ((((code) == map_ok) && status != 0) \
-      ? map_see_errno_close_exe_failed          \
-      : (code));                                \
-  } while (0)
-
-  // Read the header.
-  ElfW(Ehdr) ehdr;
-  if (fread(&ehdr, sizeof(ehdr), 1, bin) != 1)
-    CLEAN_EXIT(map_read_exe_header_failed);
-
-  // Read the section headers.
-  ElfW(Shdr) shdrs[ehdr.e_shnum];
-  if (fseek(bin, ehdr.e_shoff, SEEK_SET) != 0)
-    CLEAN_EXIT(map_see_errno_seek_exe_sheaders_failed);
-  if (fread(shdrs, sizeof(shdrs[0]), ehdr.e_shnum, bin) != ehdr.e_shnum)
-    CLEAN_EXIT(map_read_exe_sheaders_failed);
-
-  // Read the string table.
-  ElfW(Shdr)* sh_strab = &shdrs[ehdr.e_shstrndx];
-  char section_names[sh_strab->sh_size];
-  if (fseek(bin, sh_strab->sh_offset, SEEK_SET) != 0)
-    CLEAN_EXIT(map_see_errno_seek_exe_string_table_failed);
-  if (fread(section_names, sh_strab->sh_size, 1, bin) != 1)
-    CLEAN_EXIT(map_read_exe_string_table_failed);
-
-  // Find the ".text" section.
-  for (uint32_t idx = 0; idx < ehdr.e_shnum; idx++) {
-    ElfW(Shdr)* sh = &shdrs[idx];
-    if (!memcmp(&section_names[sh->sh_name], ".text", 5)) {
-      *text_section = *sh;
-      CLEAN_EXIT(map_ok);
-    }
-  }
-
-  CLEAN_EXIT(map_region_not_found);
-#undef CLEAN_EXIT
+  elf_image image;
+  map_status status = MapElfImage(fname, &image);
+  if (status != map_ok) return status;
+
+  status = FindElfSection(&image, ".text", text_section);
+  UnmapElfImage(&image);
+  return status;
+}
+
+// Find the executable PT_LOAD segment of a loaded object that contains `addr`.
+// The program headers are already mapped, so no file I/O is needed.
+static bool FindTextSegment(struct dl_phdr_info* hdr,
+                            uintptr_t addr,
+                            mem_range* range) {
+  if (hdr->dlpi_phdr == NULL) return false;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    uintptr_t from = hdr->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) &&
+        addr >= from && addr - from < phdr->p_memsz) {
+      range->from = (void*)from;
+      range->to = (void*)(from + phdr->p_memsz);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Find the executable PT_LOAD segment of a loaded object that holds its code:
+// the one containing the entry point for the executable, the largest one for
+// other objects. The executable may have a second one, holding the mover and,
+// with `-z noseparate-code`, .rodata. The linker puts .init and the PLT,
+// through which the mover calls, at the start of the code segment, so the
+// large page holding the start is left out of the range.
+static bool FindCodeSegment(struct dl_phdr_info* hdr, mem_range* range) {
+  const ElfW(Phdr)* code = NULL;
+  uintptr_t entry = hdr->dlpi_name[0] == 0 ? getauxval(AT_ENTRY) : 0;
+
+  if (hdr->dlpi_phdr == NULL) return false;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    uintptr_t from = hdr->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+    if (entry >= from && entry - from < phdr->p_memsz) {
+      code = phdr;
+      break;
+    }
+    if (code == NULL || phdr->p_memsz > code->p_memsz) {
+      code = phdr;
+    }
+  }
+  if (code == NULL) return false;
+
+  uintptr_t from = hdr->dlpi_addr + code->p_vaddr;
+  uintptr_t to = from + code->p_memsz;
+  from = largepage_align_down(from) + HPS;
+  range->from = (void*)from;
+  range->to = (void*)(from < to ? to : from);
+  return true;
+}
+
+// Look for the first ELF note with the given name and type among the PT_NOTE
+// segments of a loaded object. The notes are part of the loaded image, so no
+// file I/O is needed. On success, `desc` points to the note descriptor.
+static const ElfW(Nhdr)* FindNote(struct dl_phdr_info* hdr,
+                                  const char* note_name,
+                                  ElfW(Word) note_type,
+                                  const char** desc) {
+  size_t name_size = strlen(note_name) + 1;
+
+  if (hdr->dlpi_phdr == NULL) return NULL;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    if (phdr->p_type != PT_NOTE) continue;
+
+    size_t align = (phdr->p_align == 8 ? 8 : 4);
+    const char* note = (const char*)(hdr->dlpi_addr + phdr->p_vaddr);
+    const char* end = note + phdr->p_memsz;
+
+    while ((size_t)(end - note) >= sizeof(ElfW(Nhdr))) {
+      const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*)note;
+      const char* name = note + sizeof(*nhdr);
+      const char* next_desc =
+          name + ((nhdr->n_namesz + align - 1) & ~(align - 1));
+      const char* next =
+          next_desc + ((nhdr->n_descsz + align - 1) & ~(align - 1));
+      if (next > end || next <= note) break;
+
+      if (nhdr->n_type == note_type && nhdr->n_namesz == name_size &&
+          memcmp(name, note_name, name_size) == 0) {
+        *desc = next_desc;
+        return nhdr;
+      }
+      note = next;
+    }
+  }
+
+  return NULL;
+}
+
+// Look for an iodlr remap plan among the notes of a loaded object.
+static bool FindRemapPlan(struct dl_phdr_info* hdr, remap_plan* plan) {
+  const char* desc;
+  const ElfW(Nhdr)* nhdr =
+      FindNote(hdr, IODLR_NOTE_NAME, NT_IODLR_REMAP_PLAN, &desc);
+  remap_plan_header header;
+
+  if (nhdr == NULL || nhdr->n_descsz < sizeof(header)) return false;
+
+  memcpy(&header, desc, sizeof(header));
+  if (header.version != IODLR_REMAP_PLAN_VERSION ||
+      header.range_count > (nhdr->n_descsz - sizeof(header)) /
+                           sizeof(remap_plan_range)) {
+    return false;
+  }
+  plan->base = hdr->dlpi_addr;
+  plan->phdr = hdr->dlpi_phdr;
+  plan->phnum = hdr->dlpi_phnum;
+  plan->ranges = desc + sizeof(header);
+  plan->range_count = header.range_count;
+  plan->min_coverage = header.min_coverage;
+  return true;
+}
+
+static inline void GetRemapPlanRange(const remap_plan* plan,
+                                     uint32_t idx,
+                                     remap_plan_range* range) {
+  memcpy(range, plan->ranges + idx * sizeof(*range), sizeof(*range));
+}
+
+// Ranges whose preferred page size is below the large page size are meant to
+// stay on small pages. The remaining ones are clipped to the executable PT_LOAD
+// segment they start in, so that a stale or mistaken plan can never make us
+// copy memory that is not mapped.
+static bool GetLargePageRange(const remap_plan* plan,
+                              uint32_t idx,
+                              remap_plan_range* range) {
+  GetRemapPlanRange(plan, idx, range);
+  if (range->page_size != 0 && range->page_size < HPS) return false;
+
+  for (ElfW(Half) ph = 0; ph < plan->phnum; ph++) {
+    const ElfW(Phdr)* phdr = &plan->phdr[ph];
+    if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) &&
+        range->from >= phdr->p_vaddr &&
+        range->from < phdr->p_vaddr + phdr->p_memsz) {
+      if (range->to > phdr->p_vaddr + phdr->p_memsz) {
+        range->to = phdr->p_vaddr + phdr->p_memsz;
+      }
+      return range->to > range->from;
+    }
+  }
+
+  return false;
+}
+
+// Explicit huge pages are a fixed pool shared by all processes, and many
+// processes started at once would all see the same free pages and race for
+// them. Processes using liblppreload.so or this library therefore reserve
+// their pages in a ledger first: a small file in /dev/shm, mapped by every
+// process and updated under flock(). Each entry holds the pages one process
+// has reserved. Entries of processes that have exited are reclaimed by the
+// next process to take the lock, so pages are returned even after a crash.
+#define EHP_LEDGER_MAGIC        0x726c6469  // "idlr"
+#define EHP_LEDGER_VERSION      1
+#define EHP_LEDGER_MAX_ENTRIES  1024
+#define EHP_LEDGER_DIR          "/dev/shm"
+
+typedef struct {
+  int32_t  pid;
+  uint32_t pages;
+  uint64_t start_time;  // to tell a reused pid from the process itself
+} ehp_ledger_entry;
+
+typedef struct {
+  uint32_t         magic;
+  uint32_t         version;
+  uint64_t         page_size;
+  uint32_t         entry_count;
+  uint32_t         reserved;
+  ehp_ledger_entry entries[EHP_LEDGER_MAX_ENTRIES];
+} ehp_ledger;
+
+// How the pool is shared among the processes using the ledger.
+typedef enum {
+  ehp_share_first_come,  // whoever asks first, as long as pages are left
+  ehp_share_equal,       // at most 1/N of the pool per process
+  ehp_share_max          // at most N pages per process
+} ehp_share_mode;
+
+static ehp_ledger* ehp_ledger_map = NULL;
+static int ehp_ledger_fd = -1;
+static ehp_share_mode ehp_share = ehp_share_first_come;
+static uint64_t ehp_share_arg = 0;
+static pthread_mutex_t ehp_ledger_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool ReadUint64(const char* path, uint64_t* value);
+
+// The start time of a process in clock ticks since boot, field 22 of its
+// /proc/<pid>/stat, or 0 if the process does not exist or has exited, which
+// frees its memory before it is reaped.
+static uint64_t ProcessStartTime(pid_t pid) {
+  char path[64];
+  char stat[1024];
+  uint64_t start_time = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t len = read(fd, stat, sizeof(stat) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  stat[len] = 0;
+  // The command name may contain spaces and parentheses.
+  char* field = strrchr(stat, ')');
+  if (field == NULL || field[1] == 0 || field[2] == 'Z' || field[2] == 'X') {
+    return 0;
+  }
+  for (int idx = 2; field != NULL && idx < 22; idx++) {
+    field = strchr(field + 1, ' ');
+  }
+  if (field != NULL) {
+    sscanf(field + 1, "%" SCNu64, &start_time);
+  }
+  return start_time;
+}
+
+// The pages of the pool, and those not promised to any mapping yet, which
+// bounds what the ledger hands out when other programs use the pool too.
+static bool ReadHugePagePool(uint64_t* total, uint64_t* unreserved) {
+  char path[PATH_MAX];
+  uint64_t free_pages, resv_pages;
+
+  snprintf(path, sizeof(path), "/sys/kernel/mm/hugepages/hugepages-%lukB/",
+           (unsigned long)(HPS / 1024));
+  size_t len = strlen(path);
+  strcpy(path + len, "nr_hugepages");
+  if (!ReadUint64(path, total)) {
+    return false;
+  }
+  strcpy(path + len, "free_hugepages");
+  if (!ReadUint64(path, &free_pages)) {
+    return false;
+  }
+  strcpy(path + len, "resv_hugepages");
+  if (!ReadUint64(path, &resv_pages)) {
+    resv_pages = 0;
+  }
+  *unreserved = (free_pages > resv_pages ? free_pages - resv_pages : 0);
+  return true;
+}
+
+// Parse IODLR_EHP_SHARE: "first-come", "equal:<processes>" or "max:<pages>".
+static bool ParseHugePageShare(const char* str) {
+  char* end;
+
+  if (str == NULL || strcmp(str, "first-come") == 0) {
+    ehp_share = ehp_share_first_come;
+    return true;
+  }
+  if (strncmp(str, "equal:", 6) == 0) {
+    ehp_share = ehp_share_equal;
+    str += 6;
+  } else if (strncmp(str, "max:", 4) == 0) {
+    ehp_share = ehp_share_max;
+    str += 4;
+  } else {
+    return false;
+  }
+  ehp_share_arg = strtoull(str, &end, 10);
+  return end != str && *end == 0 && ehp_share_arg > 0;
+}
+
+// Whether an opened ledger file can be trusted. Any process able to write the
+// ledger can withhold pages from the others, so it must be a regular file that
+// others cannot write. The default ledger must also be our own, whereas one
+// named by IODLR_EHP_LEDGER may be shared through its group.
+static bool IsLedgerTrusted(const struct stat* st, bool shared) {
+  if (!S_ISREG(st->st_mode) || (st->st_mode & S_IWOTH) != 0) return false;
+  if (st->st_uid == geteuid()) return true;
+  return shared && (st->st_mode & S_IWGRP) != 0;
+}
+
+// Open and map the ledger named by IODLR_EHP_LEDGER, by default one per user
+// and huge page size in /dev/shm. "none" disables it, so that the process only
+// counts its own pages.
+static void OpenHugePageLedger() {
+  char default_path[PATH_MAX];
+  const char* path = getenv("IODLR_EHP_LEDGER");
+  bool shared = (path != NULL);
+  struct stat st;
+
+  if (ehp_ledger_map != NULL || (path != NULL && strcmp(path, "none") == 0)) {
+    return;
+  }
+  if (!ParseHugePageShare(getenv("IODLR_EHP_SHARE"))) {
+    fprintf(stderr, "WARNING: Invalid IODLR_EHP_SHARE, using first-come\n");
+    ehp_share = ehp_share_first_come;
+  }
+  if (path == NULL) {
+    snprintf(default_path, sizeof(default_path),
+             EHP_LEDGER_DIR "/iodlr-hugepages-%lukB-%lu",
+             (unsigned long)(HPS / 1024), (unsigned long)geteuid());
+    path = default_path;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                shared ? 0660 : 0600);
+  if (fd < 0) {
+    fprintf(stderr, "WARNING: Cannot open the huge page ledger %s: %s\n",
+            path, strerror(errno));
+    return;
+  }
+  if (fstat(fd, &st) != 0 || !IsLedgerTrusted(&st, shared)) {
+    fprintf(stderr, "WARNING: Ignoring the untrusted huge page ledger %s\n",
+            path);
+    close(fd);
+    return;
+  }
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size < sizeof(ehp_ledger) &&
+       ftruncate(fd, sizeof(ehp_ledger)) != 0)) {
+    flock(fd, LOCK_UN);
+    close(fd);
+    return;
+  }
+  ehp_ledger* ledger = mmap(NULL, sizeof(ehp_ledger), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+  if (ledger != MAP_FAILED && ledger->magic == 0) {
+    ledger->version = EHP_LEDGER_VERSION;
+    ledger->page_size = HPS;
+    ledger->magic = EHP_LEDGER_MAGIC;
+  }
+  if (ledger != MAP_FAILED &&
+      (ledger->magic != EHP_LEDGER_MAGIC ||
+       ledger->version != EHP_LEDGER_VERSION || ledger->page_size != HPS ||
+       ledger->entry_count > EHP_LEDGER_MAX_ENTRIES)) {
+    fprintf(stderr, "WARNING: Ignoring the incompatible huge page ledger %s\n",
+            path);
+    munmap(ledger, sizeof(ehp_ledger));
+    ledger = MAP_FAILED;
+  }
+  flock(fd, LOCK_UN);
+  if (ledger == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  ehp_ledger_fd = fd;
+  ehp_ledger_map = ledger;
+}
+
+// Drop the entries of processes that have exited. Called with the ledger
+// locked.
+static void PruneHugePageLedger(ehp_ledger* ledger) {
+  uint32_t kept = 0;
+
+  for (uint32_t idx = 0; idx < ledger->entry_count; idx++) {
+    ehp_ledger_entry* entry = &ledger->entries[idx];
+    if (entry->pages > 0 &&
+        ProcessStartTime(entry->pid) == entry->start_time) {
+      ledger->entries[kept++] = *entry;
+    }
+  }
+  ledger->entry_count = kept;
+}
+
+static ehp_ledger_entry* FindLedgerEntry(ehp_ledger* ledger, bool create) {
+  pid_t pid = getpid();
+
+  for (uint32_t idx = 0; idx < ledger->entry_count; idx++) {
+    if (ledger->entries[idx].pid == pid) {
+      return &ledger->entries[idx];
+    }
+  }
+  if (!create || ledger->entry_count == EHP_LEDGER_MAX_ENTRIES) {
+    return NULL;
+  }
+  ehp_ledger_entry* entry = &ledger->entries[ledger->entry_count++];
+  entry->pid = pid;
+  entry->pages = 0;
+  entry->start_time = ProcessStartTime(pid);
+  return entry;
+}
+
+// Reserve pages for this process in the ledger, within its fair share.
+static bool ReserveLedgerPages(uint64_t pages) {
+  ehp_ledger* ledger = ehp_ledger_map;
+  uint64_t total = 0, unreserved = 0, reserved = 0;
+  bool ok = false;
+
+  flock(ehp_ledger_fd, LOCK_EX);
+  PruneHugePageLedger(ledger);
+  ehp_ledger_entry* own = FindLedgerEntry(ledger, true);
+  if (own != NULL && ReadHugePagePool(&total, &unreserved)) {
+    for (uint32_t idx = 0; idx < ledger->entry_count; idx++) {
+      reserved += ledger->entries[idx].pages;
+    }
+    uint64_t limit = UINT64_MAX;
+    if (ehp_share == ehp_share_equal) {
+      limit = total / ehp_share_arg;
+    } else if (ehp_share == ehp_share_max) {
+      limit = ehp_share_arg;
+    }
+    // Pages reserved here but not mapped yet still count as unreserved in
+    // the kernel, so both bounds are needed.
+    ok = (reserved + pages <= total && pages <= unreserved &&
+          own->pages + pages <= limit);
+    if (ok) {
+      own->pages += pages;
+    } else if (own->pages == 0) {
+      *own = ledger->entries[--ledger->entry_count];
+    }
+  }
+  flock(ehp_ledger_fd, LOCK_UN);
+  return ok;
+}
+
+static void ReleaseLedgerPages(uint64_t pages) {
+  ehp_ledger* ledger = ehp_ledger_map;
+
+  flock(ehp_ledger_fd, LOCK_EX);
+  ehp_ledger_entry* own = FindLedgerEntry(ledger, false);
+  if (own != NULL) {
+    own->pages = (own->pages > pages ? own->pages - pages : 0);
+    if (own->pages == 0) {
+      *own = ledger->entries[--ledger->entry_count];
+    }
+  }
+  flock(ehp_ledger_fd, LOCK_UN);
+}
+
+// Return all pages of this process to the ledger when it exits. The kernel
+// frees the pages themselves a little later, which ReadHugePagePool() sees.
+static void __attribute__((destructor)) CloseHugePageLedger() {
+  pthread_mutex_lock(&ehp_ledger_lock);
+  if (ehp_ledger_map != NULL) {
+    ReleaseLedgerPages(UINT32_MAX);
+  }
+  pthread_mutex_unlock(&ehp_ledger_lock);
+}
+
+// The explicit huge pages a region of `size` bytes takes, a partial page
+// counting as a whole one. Reserving and releasing must agree on this.
+static int ExplicitHugePagesFor(size_t size) {
+  return (size + HPS - 1) / HPS;
+}
+
+// check if there are enough number of hugepages available
+// i.e. bytes available in HP is more than total_bytes needed
+// if not set the status = not_enough_pages, otherwise okay
+static map_status ReserveExplicitHugePages(size_t size) {
+  int pages_need = ExplicitHugePagesFor(size);
+  bool ok;
+  pthread_mutex_lock(&ehp_ledger_lock);
+  if (ehp_ledger_map != NULL) {
+    ok = ReserveLedgerPages(pages_need);
+  } else {
+    ok = (iodlr_number_of_ehp_avail >= pages_need);
+  }
+  if (ok) {
+    iodlr_number_of_ehp_avail -= pages_need;
+  }
+  pthread_mutex_unlock(&ehp_ledger_lock);
+  if (!ok) {
+    fprintf(stderr, "INFO: Need %d explicit pages.\n", pages_need);
+    fflush(stderr);
+    return map_not_enough_explicit_hugepages_are_allocated;
+  }
+  return map_ok;
+}
+
+// Give back pages reserved with ReserveExplicitHugePages().
+static void ReleaseExplicitHugePages(size_t size) {
+  int pages = ExplicitHugePagesFor(size);
+
+  pthread_mutex_lock(&ehp_ledger_lock);
+  if (ehp_ledger_map != NULL) {
+    ReleaseLedgerPages(pages);
+  }
+  iodlr_number_of_ehp_avail += pages;
+  pthread_mutex_unlock(&ehp_ledger_lock);
 }
 
 static int FindMapping(struct dl_phdr_info* hdr, size_t size, void* data) {
   FindParams* find_params = (FindParams*)data;
-  ElfW(Shdr) text_section;
+  mem_range text = {0};
 
   // We are only interested in the information matching the regex or, if no
   // regex was given, the mapping matching the main executable. This latter
@@ -120,48 +896,72 @@ static int FindMapping(struct dl_phdr_info* hdr, size_t size, void* data) {
   if ((find_params->have_regex &&
         regexec(&find_params->regex, hdr->dlpi_name, 0, NULL, 0) == 0) ||
       (hdr->dlpi_name[0] == 0 && !find_params->have_regex)) {
-    const char* fname = (hdr->dlpi_name[0] == 0 ? "/proc/self/exe" : hdr->dlpi_name);
-
     // Once we have found the info structure for the desired linked-in object,
-    // we open it on disk to find the location of its .text section. We use the
-    // base address given to calculate the .text section offset in memory.
-    text_section.sh_size=0;
-    find_params->status = FindTextSection(fname, &text_section);
-    // check if there are enough number of hugepages available
-    // i.e. bytes available in HP is more than total_bytes needed
-    // if not set the status = not_enough_pages, otherwise okay
-    if (find_params->status == map_ok) {
-      if (iodlr_use_ehp) {
-        int pages_need = text_section.sh_size / HPS;
-        int bytes_remaining = text_section.sh_size % HPS;
-        if (bytes_remaining > 0) {
-          pages_need += 1;
+    // we take its code segment from the program headers the dynamic loader
+    // has already mapped, without touching the file. Only if asked to, we
+    // narrow it down to the .text section, which means reading the section
+    // headers from disk.
+    const char* fname =
+        (hdr->dlpi_name[0] == 0 ? "/proc/self/exe" : hdr->dlpi_name);
+    ElfW(Shdr) text_section;
+    mem_range segment;
+    if (!text_section_lookup) {
+      find_params->status =
+          FindCodeSegment(hdr, &text) ? map_ok : map_region_not_found;
+    } else {
+      find_params->status = FindTextSection(fname, &text_section);
+      if (find_params->status == map_ok) {
+        text.from = (void*)(hdr->dlpi_addr + text_section.sh_addr);
+        text.to = (void*)(hdr->dlpi_addr + text_section.sh_addr +
+                          text_section.sh_size);
+        if (!FindTextSegment(hdr, (uintptr_t)text.from, &segment)) {
+          find_params->status = map_region_not_found;
+        } else if (text.to > segment.to) {
+          text.to = segment.to;
         }
-        if (iodlr_number_of_ehp_avail < pages_need) {
-          fprintf(stderr, "INFO: Need %d explicit pages.\n", pages_need);
-          fflush(stderr);
-          find_params->status = map_not_enough_explicit_hugepages_are_allocated;
-          return 0;
-        } else {
-          iodlr_number_of_ehp_avail -= pages_need;
+      }
+    }
+
+    if (find_params->status == map_ok) {
+      size_t text_size = (uintptr_t)text.to - (uintptr_t)text.from;
+
+      // An embedded remap plan replaces the whole region with the hot ranges
+      // it lists.
+      if (FindRemapPlan(hdr, &find_params->plan)) {
+        text_size = 0;
+        for (uint32_t idx = 0; idx < find_params->plan.range_count; idx++) {
+          remap_plan_range range;
+          if (GetLargePageRange(&find_params->plan, idx, &range)) {
+            text_size += range.to - range.from;
+          }
         }
       }
-      find_params->start = hdr->dlpi_addr + text_section.sh_addr;
-      fprintf(stderr, "Base address: %lx.", hdr->dlpi_addr);
-      find_params->end = find_params->start + text_section.sh_size;
+
+      find_params->start = (uintptr_t)text.from;
+      find_params->end = (uintptr_t)text.to;
+      IODLR_PROBE4(find_mapping, hdr->dlpi_name, text.from, text_size,
+                   find_params->status);
       return 1;
     }
+    IODLR_PROBE4(find_mapping, hdr->dlpi_name, NULL, 0, find_params->status);
   }
 
   return 0;
 }
 
 // Identify and return the text region in the currently mapped memory regions.
-static map_status FindTextRegion(const char* lib_regex, mem_range* region) {
-  FindParams find_params = { 0, 0, { 0 }, false, map_region_not_found };
+static map_status FindTextRegion(const char* lib_regex,
+                                 mem_range* region,
+                                 remap_plan* plan) {
+  FindParams find_params = {
+    0, 0, { 0 }, false, { 0, NULL, 0, NULL, 0, 0 }, map_region_not_found
+  };
 
+  IODLR_PROBE1(find_text_region_entry, lib_regex);
   if (lib_regex != NULL) {
     if (regcomp(&find_params.regex, lib_regex, 0) != 0) {
+      IODLR_PROBE4(find_text_region_return, lib_regex, map_invalid_regex,
+                   NULL, NULL);
       return map_invalid_regex;
     }
     find_params.have_regex = true;
@@ -171,6 +971,8 @@ static map_status FindTextRegion(const char* lib_regex, mem_range* region) {
   // its linked-in dependencies. The return value of `FindMapping` will become
   // the return value of `dl_iterate_phdr`.
   dl_iterate_phdr(FindMapping, &find_params);
+  IODLR_PROBE4(find_text_region_return, lib_regex, find_params.status,
+               find_params.start, find_params.end);
   if (find_params.status != map_ok) {
     regfree(&find_params.regex);
     return find_params.status;
@@ -178,6 +980,7 @@ static map_status FindTextRegion(const char* lib_regex, mem_range* region) {
 
   region->from = (void*)find_params.start;
   region->to = (void*)find_params.end;
+  *plan = find_params.plan;
 
   regfree(&find_params.regex);
   return map_ok;
@@ -203,6 +1006,9 @@ static map_status IsExplicitHugePagesEnabled(bool* result) {
   } else {
     *result = true;
   }
+  pthread_mutex_lock(&ehp_ledger_lock);
+  OpenHugePageLedger();
+  pthread_mutex_unlock(&ehp_ledger_lock);
   return map_ok;
 }
 
@@ -215,30 +1021,327 @@ static map_status IsTransparentHugePagesEnabled(bool* result) {
   char never[16] = {0};
   int matched;
 
-  ifs = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "rt");
-  if (!ifs) {
-    return map_failed_to_open_thp_file;
+  ifs = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "rt");
+  if (!ifs) {
+    return map_failed_to_open_thp_file;
+  }
+
+  matched = fscanf(ifs, "%s %s %s", always, madvise, never);
+  fclose(ifs);
+
+  if (matched != 3) {
+    return map_malformed_thp_file;
+  }
+
+  if (strcmp(always, "[always]") == 0) {
+    *result = true;
+  } else if (strcmp(madvise, "[madvise]") == 0) {
+    *result = true;
+  } else if (strcmp(never, "[never]") == 0) {
+    *result = false;
+  }
+
+  return map_ok;
+#else
+  return map_unsupported_platform;
+#endif  // ENABLE_LARGE_CODE_PAGES
+}
+
+static const struct {
+  const char* name;
+  thp_mode    mode;
+} thp_mode_names[] = {
+  { "always", thp_mode_always },
+  { "madvise", thp_mode_madvise },
+  { "never", thp_mode_never },
+  { "inherit", thp_mode_inherit },
+  { "defer", thp_mode_defer },
+  { "defer+madvise", thp_mode_defer_madvise },
+  { "within_size", thp_mode_within_size },
+  { "advise", thp_mode_advise },
+  { "deny", thp_mode_deny },
+  { "force", thp_mode_force },
+};
+
+// Read a sysfs file listing the available modes with the selected one in
+// brackets, e.g. "always [madvise] never".
+static thp_mode ReadThpMode(const char* path) {
+  char line[256];
+  FILE* ifs = fopen(path, "r");
+  if (!ifs) {
+    return thp_mode_unknown;
+  }
+  char* read = fgets(line, sizeof(line), ifs);
+  fclose(ifs);
+
+  char* open = (read != NULL ? strchr(line, '[') : NULL);
+  char* close = (open != NULL ? strchr(open, ']') : NULL);
+  if (close == NULL) {
+    return thp_mode_unknown;
+  }
+  *close = 0;
+  for (size_t idx = 0; idx < sizeof(thp_mode_names) / sizeof(thp_mode_names[0]);
+       idx++) {
+    if (strcmp(open + 1, thp_mode_names[idx].name) == 0) {
+      return thp_mode_names[idx].mode;
+    }
+  }
+  return thp_mode_unknown;
+}
+
+// Read a file holding a single number, or "max" for no limit.
+static bool ReadUint64(const char* path, uint64_t* value) {
+  char text[32];
+  FILE* ifs = fopen(path, "r");
+  if (!ifs) {
+    return false;
+  }
+  int matched = fscanf(ifs, "%31s", text);
+  fclose(ifs);
+  if (matched != 1) {
+    return false;
+  }
+  if (strcmp(text, "max") == 0) {
+    *value = UINT64_MAX;
+    return true;
+  }
+  return sscanf(text, "%" SCNu64, value) == 1;
+}
+
+// Call `found` for every "hugepages-<size>kB" directory in `dir`.
+static void ForEachPageSizeDir(const char* dir,
+                               void (*found)(const char* path,
+                                             uint64_t page_size, int node,
+                                             large_page_capabilities* caps),
+                               int node, large_page_capabilities* caps) {
+  char path[PATH_MAX];
+  struct dirent* entry;
+  uint64_t size_kb;
+
+  DIR* dirp = opendir(dir);
+  if (dirp == NULL) {
+    return;
+  }
+  while ((entry = readdir(dirp)) != NULL) {
+    if (sscanf(entry->d_name, "hugepages-%" SCNu64 "kB", &size_kb) == 1 &&
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) <
+            (int)sizeof(path)) {
+      found(path, size_kb * 1024, node, caps);
+    }
+  }
+  closedir(dirp);
+}
+
+static void AddMthpSize(const char* path, uint64_t page_size, int node,
+                        large_page_capabilities* caps) {
+  char file[PATH_MAX];
+
+  if (caps->mthp_size_count == LARGE_PAGE_MAX_SIZES) {
+    return;
+  }
+  if (snprintf(file, sizeof(file), "%s/enabled", path) >= (int)sizeof(file)) {
+    return;
+  }
+  // Some sizes are only available for shmem and have no `enabled` file.
+  thp_mode enabled = ReadThpMode(file);
+  if (enabled != thp_mode_unknown) {
+    mthp_size* size = &caps->mthp_sizes[caps->mthp_size_count++];
+    size->page_size = page_size;
+    size->enabled = enabled;
+  }
+}
+
+static int CompareMthpSizes(const void* a, const void* b) {
+  uint64_t size_a = ((const mthp_size*)a)->page_size;
+  uint64_t size_b = ((const mthp_size*)b)->page_size;
+  return (size_a > size_b) - (size_a < size_b);
+}
+
+static void AddHugetlbPool(const char* path, uint64_t page_size, int node,
+                           large_page_capabilities* caps) {
+  char file[PATH_MAX];
+
+  if (caps->hugetlb_pool_count == LARGE_PAGE_MAX_POOLS) {
+    return;
+  }
+  hugetlb_pool* pool = &caps->hugetlb_pools[caps->hugetlb_pool_count];
+  pool->page_size = page_size;
+  pool->node = node;
+  if (snprintf(file, sizeof(file), "%s/nr_hugepages", path) >=
+          (int)sizeof(file) ||
+      !ReadUint64(file, &pool->total_pages)) {
+    return;
+  }
+  if (snprintf(file, sizeof(file), "%s/free_hugepages", path) >=
+          (int)sizeof(file) ||
+      !ReadUint64(file, &pool->free_pages)) {
+    return;
+  }
+  caps->hugetlb_pool_count++;
+}
+
+static int CompareHugetlbPools(const void* a, const void* b) {
+  const hugetlb_pool* pool_a = (const hugetlb_pool*)a;
+  const hugetlb_pool* pool_b = (const hugetlb_pool*)b;
+  if (pool_a->page_size != pool_b->page_size) {
+    return pool_a->page_size > pool_b->page_size ? 1 : -1;
+  }
+  return pool_a->node - pool_b->node;
+}
+
+// Find the hugetlb controller limits of the cgroup of this process. Each limit
+// is the lowest one set on the path from the cgroup to the root, as a cgroup
+// is also bound by the limits of its ancestors.
+static void FindHugetlbLimits(large_page_capabilities* caps) {
+  char line[PATH_MAX];
+  char dir[PATH_MAX] = { 0 };
+  size_t root_len = 0;
+  bool v1 = false;
+
+  FILE* ifs = fopen("/proc/self/cgroup", "r");
+  if (!ifs) {
+    return;
+  }
+  // Lines are "<hierarchy>:<controllers>:<path>". The unified hierarchy has
+  // no controllers listed, a v1 hugetlb hierarchy lists "hugetlb".
+  while (fgets(line, sizeof(line), ifs) != NULL) {
+    char* controllers = strchr(line, ':');
+    char* path = (controllers != NULL ? strchr(controllers + 1, ':') : NULL);
+    if (path == NULL) {
+      continue;
+    }
+    *path++ = 0;
+    path[strcspn(path, "\n")] = 0;
+    if (strcmp(controllers + 1, "hugetlb") == 0) {
+      root_len = strlen("/sys/fs/cgroup/hugetlb");
+      snprintf(dir, sizeof(dir), "/sys/fs/cgroup/hugetlb%s", path);
+      v1 = true;
+      break;
+    } else if (controllers[1] == 0) {
+      root_len = strlen("/sys/fs/cgroup");
+      snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", path);
+    }
+  }
+  fclose(ifs);
+  if (dir[0] == 0) {
+    return;
+  }
+
+  for (size_t idx = 0; idx < caps->hugetlb_pool_count; idx++) {
+    uint64_t page_size = caps->hugetlb_pools[idx].page_size;
+    if (caps->hugetlb_pools[idx].node != -1 ||
+        caps->hugetlb_limit_count == LARGE_PAGE_MAX_SIZES) {
+      continue;
+    }
+
+    // The controller names its files after the page size, e.g. hugetlb.2MB.max.
+    char size_name[32];
+    if (page_size >= (1UL << 30)) {
+      snprintf(size_name, sizeof(size_name), "%" PRIu64 "GB", page_size >> 30);
+    } else if (page_size >= (1UL << 20)) {
+      snprintf(size_name, sizeof(size_name), "%" PRIu64 "MB", page_size >> 20);
+    } else {
+      snprintf(size_name, sizeof(size_name), "%" PRIu64 "KB", page_size >> 10);
+    }
+
+    hugetlb_limit limit = { page_size, UINT64_MAX, 0 };
+    bool found = false;
+    char cgroup[PATH_MAX];
+    char file[PATH_MAX + 64];
+    uint64_t value;
+    snprintf(cgroup, sizeof(cgroup), "%s", dir);
+    for (;;) {
+      snprintf(file, sizeof(file), "%s/hugetlb.%s.%s", cgroup, size_name,
+               v1 ? "limit_in_bytes" : "max");
+      if (ReadUint64(file, &value)) {
+        if (!found) {
+          snprintf(file, sizeof(file), "%s/hugetlb.%s.%s", cgroup, size_name,
+                   v1 ? "usage_in_bytes" : "current");
+          ReadUint64(file, &limit.usage_bytes);
+          found = true;
+        }
+        if (value < limit.limit_bytes) {
+          limit.limit_bytes = value;
+        }
+      }
+      char* slash = strrchr(cgroup, '/');
+      if (slash == NULL || slash < cgroup + root_len) {
+        break;
+      }
+      *slash = 0;
+    }
+    if (found) {
+      caps->hugetlb_limits[caps->hugetlb_limit_count++] = limit;
+    }
+  }
+}
+
+// The kernel rejects unknown advice with EINVAL before looking at the range,
+// and valid advice for an unmapped range with ENOMEM.
+static bool IsMadviseSupported(int advice) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  void* mem = mmap(NULL, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+  if (mem == MAP_FAILED) {
+    return false;
   }
+  munmap(mem, page_size);
+  return madvise(mem, page_size, advice) == 0 || errno != EINVAL;
+}
 
-  matched = fscanf(ifs, "%s %s %s", always, madvise, never);
-  fclose(ifs);
+static void ProbeLargePageCapabilities(large_page_capabilities* caps) {
+  char dir[PATH_MAX];
+  struct dirent* entry;
+  int node;
 
-  if (matched != 3) {
-    return map_malformed_thp_file;
-  }
+  memset(caps, 0, sizeof(*caps));
+  caps->thp_enabled =
+      ReadThpMode("/sys/kernel/mm/transparent_hugepage/enabled");
+  caps->thp_defrag =
+      ReadThpMode("/sys/kernel/mm/transparent_hugepage/defrag");
+  caps->thp_shmem_enabled =
+      ReadThpMode("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+  ReadUint64("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+             &caps->hpage_pmd_size);
+  ForEachPageSizeDir("/sys/kernel/mm/transparent_hugepage", AddMthpSize, -1,
+                     caps);
 
-  if (strcmp(always, "[always]") == 0) {
-    *result = true;
-  } else if (strcmp(madvise, "[madvise]") == 0) {
-    *result = true;
-  } else if (strcmp(never, "[never]") == 0) {
-    *result = false;
+  ForEachPageSizeDir("/sys/kernel/mm/hugepages", AddHugetlbPool, -1, caps);
+  DIR* nodes = opendir("/sys/devices/system/node");
+  if (nodes != NULL) {
+    while ((entry = readdir(nodes)) != NULL) {
+      if (sscanf(entry->d_name, "node%d", &node) == 1) {
+        snprintf(dir, sizeof(dir), "/sys/devices/system/node/%s/hugepages",
+                 entry->d_name);
+        ForEachPageSizeDir(dir, AddHugetlbPool, node, caps);
+      }
+    }
+    closedir(nodes);
   }
+  qsort(caps->mthp_sizes, caps->mthp_size_count, sizeof(mthp_size),
+        CompareMthpSizes);
+  qsort(caps->hugetlb_pools, caps->hugetlb_pool_count, sizeof(hugetlb_pool),
+        CompareHugetlbPools);
+  FindHugetlbLimits(caps);
 
-  return map_ok;
-#else
-  return map_unsupported_platform;
-#endif  // ENABLE_LARGE_CODE_PAGES
+  caps->madv_collapse = IsMadviseSupported(MADV_COLLAPSE);
+  caps->madv_populate_read = IsMadviseSupported(MADV_POPULATE_READ);
+  caps->madv_populate_write = IsMadviseSupported(MADV_POPULATE_WRITE);
+  caps->process_madvise =
+      syscall(__NR_process_madvise, -1, NULL, 0, MADV_COLD, 0) == 0 ||
+      errno != ENOSYS;
+}
+
+// Find the free explicit huge pages of the given size on the whole system.
+static uint64_t FreeHugetlbPages(const large_page_capabilities* caps,
+                                 uint64_t page_size) {
+  for (size_t idx = 0; idx < caps->hugetlb_pool_count; idx++) {
+    const hugetlb_pool* pool = &caps->hugetlb_pools[idx];
+    if (pool->node == -1 && pool->page_size == page_size) {
+      return pool->free_pages;
+    }
+  }
+  return 0;
 }
 
 // Move specified region to large pages. We need to be very careful.
@@ -257,22 +1360,29 @@ static map_status
 __attribute__((__section__("lpstub")))
 __attribute__((__aligned__(HPS)))
 __attribute__((__noinline__))
-MoveRegionToLargePages(const mem_range* r) {
+MoveRegionToLargePages(const mem_range* r, remap_timings* timings) {
   void* nmem = NULL;
   void* tmem = NULL;
   int ret = 0;
   map_status status = map_ok;
   void* start = r->from;
   size_t size = r->to - r->from;
+  uint64_t begin = now_ns();
+
+  IODLR_PROBE2(move_region_entry, start, size);
 
   // Allocate temporary region preparing for copy
   nmem = mmap(NULL, size,
               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (nmem == MAP_FAILED) {
+    IODLR_PROBE3(move_region_return, start, size, map_see_errno);
     return map_see_errno;
   }
+  timings->mmap += now_ns() - begin;
 
+  begin = now_ns();
   memcpy(nmem, r->from, size);
+  timings->copy += now_ns() - begin;
 
   // We already know the original page is r-xp
   // (PROT_READ, PROT_EXEC, MAP_PRIVATE)
@@ -285,9 +1395,11 @@ MoveRegionToLargePages(const mem_range* r) {
     if (ret < 0) {                                      \
       status = oper##_munmap_nmem_failed;               \
     }                                                   \
+    IODLR_PROBE3(move_region_return, start, size, status); \
     return status;                                      \
   }
 
+  begin = now_ns();
   if (iodlr_use_ehp) {
     // map to explicit hugepages
     tmem = mmap(start, size,
@@ -301,6 +1413,8 @@ MoveRegionToLargePages(const mem_range* r) {
   }
 
   CLEAN_EXIT_CHECK(map_see_errno_mmap_tmem);
+  timings->mmap += now_ns() - begin;
+  BindToNumaNode(tmem, size);
 
 #undef CLEAN_EXIT_CHECK
 
@@ -317,17 +1431,32 @@ MoveRegionToLargePages(const mem_range* r) {
         ? oper##_munmaps_failed                         \
         : oper##_munmap_nmem_failed;                    \
     }                                                   \
+    IODLR_PROBE3(move_region_return, start, size, status); \
     return status;                                      \
   }
 
   if (!iodlr_use_ehp) {
+    begin = now_ns();
     ret = madvise(tmem, size, MADV_HUGEPAGE);
     CLEAN_EXIT_CHECK(map_see_errno_madvise_tmem);
+    timings->madvise += now_ns() - begin;
   }
 
+  begin = now_ns();
   memcpy(start, nmem, size);
+  timings->copy += now_ns() - begin;
+
+  if (collapse_after_copy) {
+    // Best effort: the code stays on small pages if this fails.
+    begin = now_ns();
+    madvise(start, size, MADV_COLLAPSE);
+    timings->madvise += now_ns() - begin;
+  }
+
+  begin = now_ns();
   ret = mprotect(start, size, PROT_READ | PROT_EXEC);
   CLEAN_EXIT_CHECK(map_see_errno_mprotect);
+  timings->mprotect += now_ns() - begin;
 
 #undef CLEAN_EXIT_CHECK
 
@@ -337,9 +1466,459 @@ MoveRegionToLargePages(const mem_range* r) {
     status = map_see_errno_munmap_nmem_failed;
   }
 
+  IODLR_PROBE3(move_region_return, start, size, status);
   return status;
 }
 
+// Move specified region to large pages while other threads may be executing
+// code in it. The code is copied into a separate large page aligned mapping
+// first, which is then moved over the region with mremap(). Since the kernel
+// replaces the old mapping in one step, and the contents are identical, no
+// thread can observe a partially copied region.
+static map_status SwapRegionToLargePages(const mem_range* r,
+                                         remap_timings* timings) {
+  size_t size = (uintptr_t)r->to - (uintptr_t)r->from;
+  void* tmem;
+  int ret;
+  uint64_t begin = now_ns();
+
+  if (iodlr_use_ehp) {
+    // Explicit huge pages are always mapped at a large page boundary.
+    tmem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (tmem == MAP_FAILED) {
+      return map_see_errno_mmap_tmem_failed;
+    }
+    timings->mmap += now_ns() - begin;
+  } else {
+    // Over-allocate by one large page and trim, so the copy is aligned and
+    // can be backed by transparent huge pages when it is first touched.
+    char* nmem = mmap(NULL, size + HPS, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (nmem == MAP_FAILED) {
+      return map_see_errno_mmap_tmem_failed;
+    }
+    tmem = (void*)largepage_align_up((uintptr_t)nmem);
+    if ((char*)tmem > nmem) {
+      munmap(nmem, (char*)tmem - nmem);
+    }
+    munmap((char*)tmem + size, nmem + HPS - (char*)tmem);
+    timings->mmap += now_ns() - begin;
+
+    begin = now_ns();
+    ret = madvise(tmem, size, MADV_HUGEPAGE);
+    if (ret < 0) {
+      munmap(tmem, size);
+      return map_see_errno_madvise_tmem_failed;
+    }
+    timings->madvise += now_ns() - begin;
+  }
+
+  BindToNumaNode(tmem, size);
+
+  begin = now_ns();
+  memcpy(tmem, r->from, size);
+  timings->copy += now_ns() - begin;
+
+  if (collapse_after_copy) {
+    begin = now_ns();
+    madvise(tmem, size, MADV_COLLAPSE);
+    timings->madvise += now_ns() - begin;
+  }
+
+  begin = now_ns();
+  ret = mprotect(tmem, size, PROT_READ | PROT_EXEC);
+  if (ret < 0) {
+    munmap(tmem, size);
+    return map_see_errno_mprotect_failed;
+  }
+  timings->mprotect += now_ns() - begin;
+
+  begin = now_ns();
+  if (mremap(tmem, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, r->from) ==
+      MAP_FAILED) {
+    munmap(tmem, size);
+    return map_see_errno_mremap_tmem_failed;
+  }
+  timings->mmap += now_ns() - begin;
+
+  return map_ok;
+}
+
+static int FindObject(struct dl_phdr_info* hdr, size_t size, void* data) {
+  FindObjectParams* params = (FindObjectParams*)data;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    uintptr_t start = hdr->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type == PT_LOAD &&
+        params->addr >= start && params->addr < start + phdr->p_memsz) {
+      params->path =
+          (hdr->dlpi_name[0] == 0 ? "/proc/self/exe" : hdr->dlpi_name);
+      params->offset = phdr->p_offset + (params->addr - start);
+      params->base = hdr->dlpi_addr;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static region_entry* FindRegionEntry(const mem_range* r) {
+  for (size_t idx = 0; idx < remapped_region_count; idx++) {
+    if (remapped_regions[idx].range.from == r->from &&
+        remapped_regions[idx].range.to == r->to) {
+      return &remapped_regions[idx];
+    }
+  }
+  return NULL;
+}
+
+// Label an anonymous region holding code moved from the file `name`, so that
+// it shows up as "[anon:iodlr:<file name>]" in /proc/<pid>/maps and in
+// profiles. The kernel rejects some characters in names, so those are replaced.
+// This is best-effort: kernels without CONFIG_ANON_VMA_NAME fail the call.
+static void NameRegion(const mem_range* r, const char* name) {
+  char vma_name[80];
+
+  const char* base = strrchr(name, '/');
+  snprintf(vma_name, sizeof(vma_name), "iodlr:%.*s", (int)sizeof(vma_name) - 7,
+           base != NULL ? base + 1 : name);
+  for (char* c = vma_name; *c != 0; c++) {
+    if (*c < 0x20 || *c > 0x7e || strchr("[]\\$`", *c) != NULL) *c = '_';
+  }
+
+  prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, (unsigned long)r->from,
+        (unsigned long)((uintptr_t)r->to - (uintptr_t)r->from),
+        (unsigned long)vma_name);
+}
+
+typedef void (*function_visitor)(void* data, uintptr_t addr, size_t size,
+                                 const char* name, size_t name_len);
+
+// Call `visit` for every function of the object in `path`, loaded at `base`,
+// that starts within a moved region. Functions are taken from .symtab if the
+// object has one and from .dynsym otherwise. Returns the ELF machine of the
+// object, or EM_NONE if its symbols cannot be read.
+static ElfW(Half) VisitFunctions(const mem_range* r, const char* path,
+                                 uintptr_t base, function_visitor visit,
+                                 void* data) {
+  elf_image image;
+  ElfW(Shdr) symtab;
+
+  if (MapElfImage(path, &image) != map_ok) return EM_NONE;
+
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)image.data;
+  ElfW(Half) machine = ehdr->e_machine;
+  if (FindElfSection(&image, ".symtab", &symtab) != map_ok &&
+      FindElfSection(&image, ".dynsym", &symtab) != map_ok) {
+    UnmapElfImage(&image);
+    return EM_NONE;
+  }
+
+  const ElfW(Shdr)* shdrs = (const ElfW(Shdr)*)(image.data + ehdr->e_shoff);
+  const ElfW(Shdr)* strtab =
+      (symtab.sh_link < ehdr->e_shnum ? &shdrs[symtab.sh_link] : NULL);
+  if (strtab == NULL ||
+      symtab.sh_offset > image.size ||
+      symtab.sh_size > image.size - symtab.sh_offset ||
+      strtab->sh_offset > image.size ||
+      strtab->sh_size > image.size - strtab->sh_offset) {
+    UnmapElfImage(&image);
+    return EM_NONE;
+  }
+
+  const ElfW(Sym)* syms = (const ElfW(Sym)*)(image.data + symtab.sh_offset);
+  const char* names = image.data + strtab->sh_offset;
+  size_t count = symtab.sh_size / sizeof(ElfW(Sym));
+  for (size_t idx = 0; idx < count; idx++) {
+    const ElfW(Sym)* sym = &syms[idx];
+    uintptr_t addr = base + sym->st_value;
+    if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+        sym->st_shndx == SHN_UNDEF || sym->st_size == 0 ||
+        sym->st_name >= strtab->sh_size ||
+        addr < (uintptr_t)r->from || addr >= (uintptr_t)r->to) {
+      continue;
+    }
+    visit(data, addr, sym->st_size, names + sym->st_name,
+          strnlen(names + sym->st_name, strtab->sh_size - sym->st_name));
+  }
+
+  UnmapElfImage(&image);
+  return machine;
+}
+
+static void WritePerfMapEntry(void* data, uintptr_t addr, size_t size,
+                              const char* name, size_t name_len) {
+  fprintf((FILE*)data, "%lx %lx %.*s\n", (unsigned long)addr,
+          (unsigned long)size, (int)name_len, name);
+}
+
+// Append an entry for every function within a moved region to
+// /tmp/perf-<pid>.map, where perf looks up symbols for anonymous executable
+// memory.
+static void WritePerfMap(const mem_range* r, const char* path, uintptr_t base) {
+  char map_name[PATH_MAX];
+
+  snprintf(map_name, sizeof(map_name), "/tmp/perf-%d.map", getpid());
+  FILE* ofs = fopen(map_name, "a");
+  if (ofs == NULL) return;
+
+  VisitFunctions(r, path, base, WritePerfMapEntry, ofs);
+  fclose(ofs);
+}
+
+// The GDB JIT interface. A debugger sets a breakpoint in
+// `__jit_debug_register_code` and, when it is hit, reads the in-memory object
+// file that `__jit_debug_descriptor` points at. Both are weak and hidden, so
+// that a JIT engine linked into the same binary can provide them instead, and
+// so that they never interpose on those of other objects.
+typedef enum {
+  JIT_NOACTION = 0,
+  JIT_REGISTER_FN,
+  JIT_UNREGISTER_FN
+} jit_actions_t;
+
+struct jit_code_entry {
+  struct jit_code_entry* next_entry;
+  struct jit_code_entry* prev_entry;
+  const char*            symfile_addr;
+  uint64_t               symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t               version;
+  uint32_t               action_flag;
+  struct jit_code_entry* relevant_entry;
+  struct jit_code_entry* first_entry;
+};
+
+void __attribute__((weak, visibility("hidden"), noinline))
+__jit_debug_register_code() {
+  __asm__ __volatile__("");
+}
+
+struct jit_descriptor __attribute__((weak, visibility("hidden")))
+__jit_debug_descriptor = { 1, JIT_NOACTION, NULL, NULL };
+
+// A minimal ELF file describing a moved region to a debugger: a NOBITS .text
+// section at the address of the region and a symbol table with its functions.
+typedef struct {
+  ElfW(Sym)* syms;
+  char*      strtab;
+  size_t     sym_count;
+  size_t     strtab_size;
+} jit_symfile;
+
+static void CountJitSymbol(void* data, uintptr_t addr, size_t size,
+                           const char* name, size_t name_len) {
+  jit_symfile* symfile = (jit_symfile*)data;
+  symfile->sym_count++;
+  symfile->strtab_size += name_len + 1;
+}
+
+static void AddJitSymbol(void* data, uintptr_t addr, size_t size,
+                         const char* name, size_t name_len) {
+  jit_symfile* symfile = (jit_symfile*)data;
+  ElfW(Sym)* sym = &symfile->syms[symfile->sym_count++];
+
+  memset(sym, 0, sizeof(*sym));
+  sym->st_name = symfile->strtab_size;
+  sym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+  sym->st_shndx = 1;
+  sym->st_value = addr;
+  sym->st_size = size;
+  memcpy(symfile->strtab + symfile->strtab_size, name, name_len);
+  symfile->strtab[symfile->strtab_size + name_len] = 0;
+  symfile->strtab_size += name_len + 1;
+}
+
+// Build the ELF file for a moved region and register it with the debugger.
+// The caller holds `regions_lock`, which serializes registrations.
+static struct jit_code_entry* RegisterWithDebugger(const mem_range* r,
+                                                   const char* path,
+                                                   uintptr_t base) {
+  static const char section_names[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+  jit_symfile symfile = { NULL, NULL, 1, 1 };
+
+  ElfW(Half) machine = VisitFunctions(r, path, base, CountJitSymbol, &symfile);
+  if (machine == EM_NONE) return NULL;
+
+  size_t syms_offset = (sizeof(ElfW(Ehdr)) + sizeof(section_names) + 7) & ~7;
+  size_t strtab_offset = syms_offset + symfile.sym_count * sizeof(ElfW(Sym));
+  size_t shdrs_offset = (strtab_offset + symfile.strtab_size + 7) & ~7;
+  size_t size = shdrs_offset + 5 * sizeof(ElfW(Shdr));
+
+  char* image = calloc(1, size + sizeof(struct jit_code_entry));
+  if (image == NULL) return NULL;
+
+  symfile.syms = (ElfW(Sym)*)(image + syms_offset);
+  symfile.strtab = image + strtab_offset;
+  symfile.sym_count = 1;
+  symfile.strtab_size = 1;
+  VisitFunctions(r, path, base, AddJitSymbol, &symfile);
+
+  ElfW(Ehdr)* ehdr = (ElfW(Ehdr)*)image;
+  memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = ELFCLASSW;
+  ehdr->e_ident[EI_DATA] = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                                ? ELFDATA2LSB : ELFDATA2MSB);
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_type = ET_EXEC;
+  ehdr->e_machine = machine;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_shoff = shdrs_offset;
+  ehdr->e_ehsize = sizeof(ElfW(Ehdr));
+  ehdr->e_shentsize = sizeof(ElfW(Shdr));
+  ehdr->e_shnum = 5;
+  ehdr->e_shstrndx = 4;
+  memcpy(image + sizeof(ElfW(Ehdr)), section_names, sizeof(section_names));
+
+  ElfW(Shdr)* shdrs = (ElfW(Shdr)*)(image + shdrs_offset);
+  shdrs[1].sh_name = 1;
+  shdrs[1].sh_type = SHT_NOBITS;
+  shdrs[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  shdrs[1].sh_addr = (uintptr_t)r->from;
+  shdrs[1].sh_size = (uintptr_t)r->to - (uintptr_t)r->from;
+  shdrs[1].sh_addralign = 16;
+  shdrs[2].sh_name = 7;
+  shdrs[2].sh_type = SHT_SYMTAB;
+  shdrs[2].sh_offset = syms_offset;
+  shdrs[2].sh_size = symfile.sym_count * sizeof(ElfW(Sym));
+  shdrs[2].sh_link = 3;
+  shdrs[2].sh_info = 1;
+  shdrs[2].sh_addralign = 8;
+  shdrs[2].sh_entsize = sizeof(ElfW(Sym));
+  shdrs[3].sh_name = 15;
+  shdrs[3].sh_type = SHT_STRTAB;
+  shdrs[3].sh_offset = strtab_offset;
+  shdrs[3].sh_size = symfile.strtab_size;
+  shdrs[3].sh_addralign = 1;
+  shdrs[4].sh_name = 23;
+  shdrs[4].sh_type = SHT_STRTAB;
+  shdrs[4].sh_offset = sizeof(ElfW(Ehdr));
+  shdrs[4].sh_size = sizeof(section_names);
+  shdrs[4].sh_addralign = 1;
+
+  struct jit_code_entry* entry = (struct jit_code_entry*)(image + size);
+  entry->symfile_addr = image;
+  entry->symfile_size = size;
+  entry->next_entry = __jit_debug_descriptor.first_entry;
+  if (entry->next_entry != NULL) {
+    entry->next_entry->prev_entry = entry;
+  }
+  __jit_debug_descriptor.first_entry = entry;
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  __jit_debug_register_code();
+  return entry;
+}
+
+// Withdraw a registration made by RegisterWithDebugger() once the region no
+// longer holds moved code, and free its ELF file. The caller holds
+// `regions_lock`.
+static void UnregisterFromDebugger(struct jit_code_entry* entry) {
+  if (entry->prev_entry != NULL) {
+    entry->prev_entry->next_entry = entry->next_entry;
+  } else {
+    __jit_debug_descriptor.first_entry = entry->next_entry;
+  }
+  if (entry->next_entry != NULL) {
+    entry->next_entry->prev_entry = entry->prev_entry;
+  }
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+  __jit_debug_register_code();
+  free((void*)entry->symfile_addr);
+}
+
+// Remember a region that was moved to large pages along with the file and
+// offset it was loaded from, so that it can later be moved back. Regions that
+// do not belong to a loaded object cannot be moved back and are not recorded.
+static void RecordRemappedRegion(const mem_range* r) {
+  FindObjectParams params = { (uintptr_t)r->from, NULL, 0, 0 };
+  struct stat st;
+  char exe[PATH_MAX];
+
+  pthread_mutex_lock(&regions_lock);
+
+  region_entry* entry = FindRegionEntry(r);
+  if (entry != NULL) {
+    entry->demoted = false;
+    if (debugger_registration_enabled && entry->jit_entry == NULL) {
+      entry->jit_entry = RegisterWithDebugger(r, entry->path, entry->base);
+    }
+  } else if (remapped_region_count < MAX_REMAPPED_REGIONS) {
+    dl_iterate_phdr(FindObject, &params);
+    if (params.path != NULL && stat(params.path, &st) == 0) {
+      const char* name = params.path;
+      if (strcmp(name, "/proc/self/exe") == 0) {
+        ssize_t len = readlink(name, exe, sizeof(exe) - 1);
+        if (len > 0) {
+          exe[len] = 0;
+          name = exe;
+        }
+      }
+
+      entry = &remapped_regions[remapped_region_count];
+      entry->path = strdup(params.path);
+      entry->name = strdup(name);
+      if (entry->path != NULL && entry->name != NULL) {
+        entry->range = *r;
+        entry->offset = params.offset;
+        entry->base = params.base;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->demoted = false;
+        entry->jit_entry = NULL;
+        // Publish the entry to lock-free readers only once it is complete.
+        __atomic_store_n(&remapped_region_count, remapped_region_count + 1,
+                         __ATOMIC_RELEASE);
+        if (perf_map_enabled) {
+          WritePerfMap(r, entry->path, params.base);
+        }
+        if (debugger_registration_enabled) {
+          entry->jit_entry = RegisterWithDebugger(r, entry->path, params.base);
+        }
+      } else {
+        free(entry->path);
+        free(entry->name);
+        entry = NULL;
+      }
+    }
+  }
+  if (entry != NULL) {
+    NameRegion(r, entry->name);
+  }
+
+  pthread_mutex_unlock(&regions_lock);
+}
+
+// Replace a region with a private mapping of the file it was loaded from. The
+// file must still be the same one, because its contents are assumed to be
+// identical to the code in the region.
+static map_status RestoreRegionFromFile(const region_entry* entry) {
+  size_t size = (uintptr_t)entry->range.to - (uintptr_t)entry->range.from;
+  struct stat st;
+
+  int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return map_open_exe_failed;
+  }
+
+  if (fstat(fd, &st) != 0 ||
+      st.st_dev != entry->dev || st.st_ino != entry->ino) {
+    close(fd);
+    return map_object_file_changed;
+  }
+
+  void* mem = mmap(entry->range.from, size, PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE | MAP_FIXED, fd, entry->offset);
+  close(fd);
+
+  return (mem == MAP_FAILED ? map_see_errno_mmap_exe_failed : map_ok);
+}
+
 // Align the region to to be mapped to 2MB page boundaries.
 static void AlignRegionToPageBoundary(mem_range* r) {
   r->from = (void*)(largepage_align_up((uintptr_t)r->from));
@@ -358,27 +1937,195 @@ static map_status CheckMemRange(mem_range* r) {
   return map_ok;
 }
 
+// The .text section of the object linking this file may sit in the same
+// large page as the mover itself. If the region covers the large page holding
+// `MoveRegionToLargePages`, keep only the larger portion on either side of it.
+static void ExcludeMoverFromRegion(mem_range* r) {
+  uintptr_t mover = largepage_align_down((uintptr_t)MoveRegionToLargePages);
+  uintptr_t from = (uintptr_t)r->from;
+  uintptr_t to = (uintptr_t)r->to;
+
+  if (mover + HPS <= from || mover >= to) return;
+
+  if (mover - from >= to - (mover + HPS)) {
+    r->to = (void*)mover;
+  } else {
+    r->from = (void*)(mover + HPS);
+  }
+}
+
+// Fill in the name and GNU build-id of the loaded object that contains the
+// region of a report.
+static int FindReportObject(struct dl_phdr_info* hdr, size_t size, void* data) {
+  remap_report* report = (remap_report*)data;
+  uintptr_t addr = (uintptr_t)report->original.from;
+  bool found = false;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum && !found; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    uintptr_t start = hdr->dlpi_addr + phdr->p_vaddr;
+    found = (phdr->p_type == PT_LOAD &&
+             addr >= start && addr < start + phdr->p_memsz);
+  }
+  if (!found) return 0;
+
+  if (hdr->dlpi_name[0] == 0) {
+    ssize_t len = readlink("/proc/self/exe", report->object,
+                           sizeof(report->object) - 1);
+    report->object[len > 0 ? len : 0] = 0;
+  } else {
+    snprintf(report->object, sizeof(report->object), "%s", hdr->dlpi_name);
+  }
+
+  const char* desc;
+  const ElfW(Nhdr)* nhdr = FindNote(hdr, "GNU", NT_GNU_BUILD_ID, &desc);
+  if (nhdr != NULL) {
+    report->build_id_size = nhdr->n_descsz;
+    if (report->build_id_size > sizeof(report->build_id)) {
+      report->build_id_size = sizeof(report->build_id);
+    }
+    memcpy(report->build_id, desc, report->build_id_size);
+  }
+
+  return 1;
+}
+
+static void RecordRemapReport(remap_report* report) {
+  uintptr_t original_size =
+      (uintptr_t)report->original.to - (uintptr_t)report->original.from;
+
+  if (report->status == map_ok) {
+    report->bytes_covered =
+        (uintptr_t)report->aligned.to - (uintptr_t)report->aligned.from;
+    report->large_page_size = HPS;
+  }
+  if (report->original.to > report->original.from) {
+    report->bytes_skipped = original_size - report->bytes_covered;
+  }
+  if (report->bytes_skipped > 0) {
+    report->small_page_size = sysconf(_SC_PAGESIZE);
+  }
+  dl_iterate_phdr(FindReportObject, report);
+
+  pthread_mutex_lock(&regions_lock);
+  if (remap_report_count < MAX_REMAP_REPORTS) {
+    remap_reports[remap_report_count++] = *report;
+  }
+  pthread_mutex_unlock(&regions_lock);
+}
+
 // Align the region to to be mapped to 2MB page boundaries and then move the
-// region to large pages.
-static map_status AlignMoveRegionToLargePages(mem_range* r) {
+// region to large pages. The outcome is recorded in a remap report, to which
+// `discovery_ns` is credited as the time it took to find the region.
+static map_status AlignMoveRegionToLargePages(mem_range* r,
+                                              uint64_t discovery_ns) {
   map_status status;
+  remap_report report;
+  struct rusage before, after;
+
+  memset(&report, 0, sizeof(report));
+  report.original = *r;
+  report.timings_ns.discovery = discovery_ns;
+  getrusage(RUSAGE_THREAD, &before);
+
   AlignRegionToPageBoundary(r);
+  if (r->from < r->to && !thread_safe_remap) {
+    ExcludeMoverFromRegion(r);
+  }
+
+  report.numa_target_node = SelectNumaNode();
+  report.numa_node = -1;
 
   status = CheckMemRange(r);
+  if (status == map_ok && iodlr_use_ehp) {
+    status = ReserveExplicitHugePages((uintptr_t)r->to - (uintptr_t)r->from);
+  }
+  if (status == map_ok) {
+    if (thread_safe_remap) {
+      status = SwapRegionToLargePages(r, &report.timings_ns);
+    } else {
+      status = MoveRegionToLargePages(r, &report.timings_ns);
+    }
+    if (status == map_ok) {
+      RecordRemappedRegion(r);
+      report.aligned = *r;
+      FindNumaPlacement(&report);
+    } else if (iodlr_use_ehp) {
+      ReleaseExplicitHugePages((uintptr_t)r->to - (uintptr_t)r->from);
+    }
+  }
+
+  getrusage(RUSAGE_THREAD, &after);
+  if (r->from < r->to) {
+    report.aligned = *r;
+  }
+  IODLR_PROBE4(remap_region, report.original.from, report.original.to,
+               status, thread_safe_remap);
+  report.minor_faults = after.ru_minflt - before.ru_minflt;
+  report.major_faults = after.ru_majflt - before.ru_majflt;
+  report.status = status;
+  RecordRemapReport(&report);
+
+  return status;
+}
+
+// Move the hot ranges listed in a remap plan to large pages. Ranges whose large
+// page aligned portion covers less than the plan's minimum coverage are left on
+// small pages.
+static map_status ApplyRemapPlan(const remap_plan* plan,
+                                 uint64_t discovery_ns) {
+  map_status status = map_region_too_small;
+
+  for (uint32_t idx = 0; idx < plan->range_count; idx++) {
+    remap_plan_range range;
+    if (!GetLargePageRange(plan, idx, &range)) continue;
+
+    uintptr_t from = largepage_align_up(plan->base + range.from);
+    uintptr_t to = largepage_align_down(plan->base + range.to);
+    uint64_t covered = (to > from ? to - from : 0);
+    uint64_t wanted = range.to - range.from;
+    if (covered * 100 < (uint64_t)plan->min_coverage * wanted) continue;
+
+    mem_range r = { (void*)(plan->base + range.from),
+                    (void*)(plan->base + range.to) };
+    map_status range_status = AlignMoveRegionToLargePages(&r, discovery_ns);
+    if (range_status == map_ok) {
+      status = map_ok;
+    } else if (range_status != map_region_too_small) {
+      return range_status;
+    }
+  }
+
+  return status;
+}
+
+// Move the text region of the loaded object matching `lib_regex`, or of the
+// main executable if `lib_regex` is NULL, to large pages. If the object carries
+// a remap plan, only the ranges listed in the plan are moved.
+static map_status MapTextRegionToLargePages(const char* lib_regex) {
+  mem_range r = {0};
+  remap_plan plan = {0};
+  uint64_t begin = now_ns();
+  map_status status = FindTextRegion(lib_regex, &r, &plan);
+  uint64_t discovery_ns = now_ns() - begin;
   if (status != map_ok) {
     return status;
   }
-
-  return MoveRegionToLargePages(r);
+  if (plan.ranges != NULL) {
+    return ApplyRemapPlan(&plan, discovery_ns);
+  }
+  return AlignMoveRegionToLargePages(&r, discovery_ns);
 }
 
 // Map the .text segment of the linked application into 2MB pages.
 // The algorithm is simple:
 // 1. Find the text region of the executing binary in memory
-//    * Examine the /proc/self/maps to determine the currently mapped text
-//      region and obtain the start and end addresses.
-//    * Modify the start address to point to the very beginning of .text segment
-//      (from variable textsegment setup in ld.script).
+//    * Walk the program headers of the loaded objects with `dl_iterate_phdr`
+//      to find the largest executable PT_LOAD segment and obtain the start
+//      and end addresses, less the large page holding .init and the PLT.
+//      With `SetTextSectionLookup`, read the .text section bounds from the
+//      file instead. If the binary carries a `.note.iodlr` remap plan, use
+//      the hot ranges it lists instead.
 //    * Align the address of start and end addresses to large page boundaries.
 //
 // 2: Move the text region to large pages
@@ -389,40 +2136,48 @@ static map_status AlignMoveRegionToLargePages(mem_range* r) {
 //    * If successful, copy the code to the newly mapped area and unmap the
 //      original region.
 map_status MapStaticCodeToLargePages() {
-  mem_range r = {0};
-  map_status status = FindTextRegion(NULL, &r);
-  if (status != map_ok) {
-    return status;
-  }
-  return AlignMoveRegionToLargePages(&r);
+  return MapTextRegionToLargePages(NULL);
 }
 
 map_status MapDSOToLargePages(const char* lib_regex) {
-  mem_range r = {0};
-  map_status status;
-
   if (lib_regex == NULL) {
     return map_null_regex;
   }
 
-  status = FindTextRegion(lib_regex, &r);
-  if (status != map_ok) {
-    return status;
-  }
-  return AlignMoveRegionToLargePages(&r);
+  return MapTextRegionToLargePages(lib_regex);
 }
 
 // This function is similar to the function above. However, the region to be
 // mapped to 2MB pages is specified for this version as hotStart and hotEnd.
 map_status MapStaticCodeRangeToLargePages(void* from, void* to) {
   mem_range r = {from, to};
-  return AlignMoveRegionToLargePages(&r);
+  return AlignMoveRegionToLargePages(&r, 0);
 }
 
 // Return true if transparent huge pages is enabled on the system. Otherwise,
 // return false.
 map_status IsLargePagesEnabled(bool* result) {
+  large_page_capabilities caps;
+
+  GetLargePageCapabilities(&caps, false);
   iodlr_use_ehp = getenv("IODLR_USE_EXPLICIT_HP");
+  const char* numa_node = getenv("IODLR_NUMA_NODE");
+  if (numa_node != NULL) {
+    SetNumaNode(strcmp(numa_node, "off") == 0 ? -1 : atoi(numa_node));
+  }
+  // With IODLR_USE_EXPLICIT_HP=auto, use explicit huge pages only if
+  // transparent huge pages are disabled and there are free explicit ones.
+  if (iodlr_use_ehp && strcmp(iodlr_use_ehp, "auto") == 0 &&
+      (caps.thp_enabled != thp_mode_never ||
+       FreeHugetlbPages(&caps, HPS) == 0)) {
+    iodlr_use_ehp = NULL;
+  }
+  // Unless the page fault handler compacts memory for madvised regions, it
+  // falls back to small pages when no huge page is readily available, and
+  // khugepaged only collapses them much later, if ever.
+  collapse_after_copy = (!iodlr_use_ehp && caps.madv_collapse &&
+                         (caps.thp_defrag == thp_mode_defer ||
+                          caps.thp_defrag == thp_mode_never));
   if (iodlr_use_ehp) {
     fprintf(stderr, "- experimental: using explicit hugepages -  \n");
     fflush(stderr);
@@ -432,6 +2187,175 @@ map_status IsLargePagesEnabled(bool* result) {
   }
 }
 
+// Report what the system offers for large pages. The first call probes the
+// kernel and later ones return the same results unless `refresh` is set, e.g.
+// to see the current number of free huge pages.
+void GetLargePageCapabilities(large_page_capabilities* caps, bool refresh) {
+  pthread_mutex_lock(&capabilities_lock);
+  if (!capabilities_valid || refresh) {
+    ProbeLargePageCapabilities(&capabilities);
+    capabilities_valid = true;
+  }
+  *caps = capabilities;
+  pthread_mutex_unlock(&capabilities_lock);
+}
+
+// Select how regions are moved to large pages. By default the code is copied
+// aside and the region is unmapped and mapped again, which is only safe while
+// no other thread can execute code in the region, e.g. from a constructor.
+// When enabled, regions are swapped with mremap() instead, which is safe at any
+// time, for instance after the application has warmed up.
+void SetThreadSafeRemap(bool enabled) {
+  thread_safe_remap = enabled;
+}
+
+// Select whether the region of an object is narrowed from its code segment to
+// its .text section. This reads the section headers from disk for every object
+// moved from now on.
+void SetTextSectionLookup(bool enabled) {
+  text_section_lookup = enabled;
+}
+
+// Select whether perf map entries are written for the functions in regions
+// moved from now on. Code moved to large pages is anonymous memory, so without
+// them perf cannot attribute samples in it to symbols.
+void SetPerfMapEnabled(bool enabled) {
+  perf_map_enabled = enabled;
+}
+
+// Select whether regions moved from now on are registered with debuggers
+// through the GDB JIT interface, as in-memory ELF files listing the functions
+// in each region.
+void SetDebuggerRegistrationEnabled(bool enabled) {
+  debugger_registration_enabled = enabled;
+}
+
+// Select the NUMA node to place code moved from now on: a node number, -1 to
+// leave placement to the kernel, or LARGE_PAGE_NUMA_AUTO (the default) to use
+// the node the process is bound to, if it is bound to a single one.
+void SetNumaNode(int node) {
+  numa_node_setting = node;
+}
+
+// Find the object that the code at `addr` was moved to large pages from. Only
+// regions moved to large pages are considered; for any other address, ask
+// dladdr() or dl_iterate_phdr(). This neither locks nor allocates, so it may be
+// called from a signal handler, e.g. by a crash handler.
+bool FindRemappedObject(const void* addr, remapped_object* object) {
+  size_t count = __atomic_load_n(&remapped_region_count, __ATOMIC_ACQUIRE);
+
+  for (size_t idx = 0; idx < count; idx++) {
+    const region_entry* entry = &remapped_regions[idx];
+    if (addr >= entry->range.from && addr < entry->range.to) {
+      object->name = entry->name;
+      object->base = entry->base;
+      object->range = entry->range;
+      object->offset = entry->offset +
+                       ((uintptr_t)addr - (uintptr_t)entry->range.from);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Move a region that was previously moved to large pages back to the small
+// pages of the file it was loaded from, returning its large pages to the
+// system. The region must be one of those returned by GetRemappedRegions().
+map_status UnmapFromLargePages(const mem_range* region) {
+  map_status status = map_region_not_found;
+
+  pthread_mutex_lock(&regions_lock);
+  region_entry* entry = FindRegionEntry(region);
+  if (entry != NULL && !entry->demoted) {
+    status = RestoreRegionFromFile(entry);
+    if (status == map_ok) {
+      entry->demoted = true;
+      counters.demotions++;
+      if (entry->jit_entry != NULL) {
+        UnregisterFromDebugger(entry->jit_entry);
+        entry->jit_entry = NULL;
+      }
+      if (iodlr_use_ehp) {
+        ReleaseExplicitHugePages((uintptr_t)region->to -
+                                 (uintptr_t)region->from);
+      }
+    }
+  }
+  pthread_mutex_unlock(&regions_lock);
+  IODLR_PROBE3(demote_region, region->from, region->to, status);
+
+  return status;
+}
+
+// Move a region demoted by UnmapFromLargePages() back to large pages. This is
+// safe while other threads are executing code in the region.
+map_status RemapToLargePages(const mem_range* region) {
+  map_status status = map_region_not_found;
+
+  pthread_mutex_lock(&regions_lock);
+  region_entry* entry = FindRegionEntry(region);
+  if (entry != NULL && entry->demoted) {
+    status = map_ok;
+    if (iodlr_use_ehp) {
+      status = ReserveExplicitHugePages((uintptr_t)region->to -
+                                        (uintptr_t)region->from);
+    }
+    if (status == map_ok) {
+      remap_timings timings = {0};
+      SelectNumaNode();
+      status = SwapRegionToLargePages(&entry->range, &timings);
+      if (status != map_ok && iodlr_use_ehp) {
+        ReleaseExplicitHugePages((uintptr_t)region->to -
+                                 (uintptr_t)region->from);
+      }
+    }
+    if (status == map_ok) {
+      entry->demoted = false;
+      counters.promotions++;
+      NameRegion(&entry->range, entry->name);
+      if (debugger_registration_enabled) {
+        entry->jit_entry =
+            RegisterWithDebugger(&entry->range, entry->path, entry->base);
+      }
+    }
+  }
+  pthread_mutex_unlock(&regions_lock);
+  IODLR_PROBE3(promote_region, region->from, region->to, status);
+
+  return status;
+}
+
+// Copy up to `max_regions` of the regions moved to large pages so far, in the
+// order in which they were moved, and return the total number of regions.
+size_t GetRemappedRegions(remapped_region* regions, size_t max_regions) {
+  pthread_mutex_lock(&regions_lock);
+  size_t count = remapped_region_count;
+  for (size_t idx = 0; idx < count && idx < max_regions; idx++) {
+    regions[idx].range = remapped_regions[idx].range;
+    regions[idx].demoted = remapped_regions[idx].demoted;
+  }
+  pthread_mutex_unlock(&regions_lock);
+  return count;
+}
+
+void GetRemapCounters(remap_counters* result) {
+  pthread_mutex_lock(&regions_lock);
+  *result = counters;
+  pthread_mutex_unlock(&regions_lock);
+}
+
+// Copy up to `max_reports` of the reports on the attempts to move regions to
+// large pages so far, in order, and return the total number of reports.
+size_t GetRemapReports(remap_report* reports, size_t max_reports) {
+  pthread_mutex_lock(&regions_lock);
+  size_t count = remap_report_count;
+  for (size_t idx = 0; idx < count && idx < max_reports; idx++) {
+    reports[idx] = remap_reports[idx];
+  }
+  pthread_mutex_unlock(&regions_lock);
+  return count;
+}
+
 const char* MapStatusStr(map_status status, bool fulltext) {
   static const char* map_status_text[] = {
     "map_ok",
@@ -493,7 +2417,13 @@ const char* MapStatusStr(map_status status, bool fulltext) {
     "map_failed_to_open_ehp_file",
       "failed to open nr_hugepages file",
     "map_not_enough_explicit_hugepages_are_allocated",
-      "not enough explicit hugepages are available"
+      "not enough explicit hugepages are available",
+    "map_see_errno_mmap_exe_failed",
+      "mapping of executable file failed",
+    "map_see_errno_mremap_tmem_failed",
+      "moving destination over the region failed",
+    "map_object_file_changed",
+      "the file the region was loaded from has changed"
   };
   return map_status_text[((int)status << 1) + (fulltext & 1)];
 }
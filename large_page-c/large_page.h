@@ -24,6 +24,8 @@
 #define LARGE_PAGE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
   map_ok,
@@ -55,9 +57,165 @@ typedef enum {
   map_see_errno_seek_exe_string_table_failed,
   map_read_exe_string_table_failed,
   map_failed_to_open_ehp_file,
-  map_not_enough_explicit_hugepages_are_allocated
+  map_not_enough_explicit_hugepages_are_allocated,
+  map_see_errno_mmap_exe_failed,
+  map_see_errno_mremap_tmem_failed,
+  map_object_file_changed
 } map_status;
 
+typedef struct {
+  void*     from;
+  void*     to;
+} mem_range;
+
+// A region that was moved to large pages. A demoted region is backed by the
+// small pages of the file it was loaded from again.
+typedef struct {
+  mem_range range;
+  bool      demoted;
+} remapped_region;
+
+typedef struct {
+  uint64_t demotions;
+  uint64_t promotions;
+} remap_counters;
+
+// The object that code moved to large pages was originally loaded from.
+// `offset` is the file offset corresponding to the address looked up.
+typedef struct {
+  const char* name;
+  uintptr_t   base;
+  mem_range   range;
+  uint64_t    offset;
+} remapped_object;
+
+#define REMAP_REPORT_OBJECT_MAX 256
+#define REMAP_REPORT_BUILD_ID_MAX 32
+
+// Time spent in each step of moving a region, in nanoseconds. Discovery covers
+// finding the text region or remap plan of the object and is shared by all the
+// regions moved from one plan.
+typedef struct {
+  uint64_t discovery;
+  uint64_t copy;
+  uint64_t mmap;
+  uint64_t madvise;
+  uint64_t mprotect;
+} remap_timings;
+
+// The outcome of one attempt to move a region to large pages. `original` is the
+// region asked for and `aligned` the large page aligned part of it that was
+// actually moved. Bytes outside of `aligned` stay on small pages and are
+// counted as skipped. `numa_node` holds most of the large pages, and
+// `numa_remote_pages` are on another node than `numa_target_node`, the node
+// asked for, or than `numa_node` if none was. Nodes are -1 if unknown.
+typedef struct {
+  char          object[REMAP_REPORT_OBJECT_MAX];
+  uint8_t       build_id[REMAP_REPORT_BUILD_ID_MAX];
+  size_t        build_id_size;
+  mem_range     original;
+  mem_range     aligned;
+  uint64_t      bytes_covered;
+  uint64_t      bytes_skipped;
+  uint64_t      large_page_size;
+  uint64_t      small_page_size;
+  remap_timings timings_ns;
+  uint64_t      minor_faults;
+  uint64_t      major_faults;
+  int32_t       numa_target_node;
+  int32_t       numa_node;
+  uint32_t      numa_remote_pages;
+  map_status    status;
+} remap_report;
+
+// The mode selected in one of the transparent huge page sysfs files, i.e. the
+// `enabled`, `defrag` and `shmem_enabled` files, and the `enabled` file of each
+// mTHP size.
+typedef enum {
+  thp_mode_unknown,
+  thp_mode_always,
+  thp_mode_madvise,
+  thp_mode_never,
+  thp_mode_inherit,
+  thp_mode_defer,
+  thp_mode_defer_madvise,
+  thp_mode_within_size,
+  thp_mode_advise,
+  thp_mode_deny,
+  thp_mode_force
+} thp_mode;
+
+// Passed to SetNumaNode() to place moved code on the node the process is bound
+// to.
+#define LARGE_PAGE_NUMA_AUTO  (-2)
+
+#define LARGE_PAGE_MAX_SIZES  16
+#define LARGE_PAGE_MAX_POOLS  64
+
+typedef struct {
+  uint64_t page_size;
+  thp_mode enabled;
+} mthp_size;
+
+// A pool of explicit huge pages of one size, either on one NUMA node or, if
+// `node` is -1, on the whole system.
+typedef struct {
+  uint64_t page_size;
+  int      node;
+  uint64_t total_pages;
+  uint64_t free_pages;
+} hugetlb_pool;
+
+// The hugetlb controller limit of the cgroup of the process for one page size,
+// which is the lowest limit on the way up to the root. UINT64_MAX if unlimited.
+typedef struct {
+  uint64_t page_size;
+  uint64_t limit_bytes;
+  uint64_t usage_bytes;
+} hugetlb_limit;
+
+// What the kernel and its configuration offer for backing memory with large
+// pages. Sizes the kernel does not know about, or files it does not have, are
+// left at 0, thp_mode_unknown or false.
+typedef struct {
+  thp_mode      thp_enabled;
+  thp_mode      thp_defrag;
+  thp_mode      thp_shmem_enabled;
+  uint64_t      hpage_pmd_size;
+  size_t        mthp_size_count;
+  mthp_size     mthp_sizes[LARGE_PAGE_MAX_SIZES];
+  size_t        hugetlb_pool_count;
+  hugetlb_pool  hugetlb_pools[LARGE_PAGE_MAX_POOLS];
+  size_t        hugetlb_limit_count;
+  hugetlb_limit hugetlb_limits[LARGE_PAGE_MAX_SIZES];
+  bool          madv_collapse;
+  bool          madv_populate_read;
+  bool          madv_populate_write;
+  bool          process_madvise;
+} large_page_capabilities;
+
+// An executable or DSO may carry a remap plan in an ELF note named "iodlr" of
+// type NT_IODLR_REMAP_PLAN, placed in a `.note.iodlr` section covered by a
+// PT_NOTE segment. The note descriptor is a remap_plan_header followed by
+// `range_count` remap_plan_range entries. Range addresses are virtual addresses
+// relative to the load base of the object. See tools/add-remap-note.py.
+#define IODLR_NOTE_NAME           "iodlr"
+#define NT_IODLR_REMAP_PLAN       1
+#define IODLR_REMAP_PLAN_VERSION  1
+
+typedef struct {
+  uint32_t version;
+  uint32_t min_coverage;  // percent of each range that must be covered
+  uint32_t range_count;
+  uint32_t reserved;
+} remap_plan_header;
+
+typedef struct {
+  uint64_t from;
+  uint64_t to;
+  uint64_t page_size;     // 0 for the default large page size
+} remap_plan_range;
+
 #define MAP_STATUS_STR(status)        MapStatusStr(status, true)
 #define MAP_STATUS_STR_SHORT(status)  MapStatusStr(status, false)
 
@@ -65,6 +223,18 @@ map_status MapStaticCodeToLargePages();
 map_status MapDSOToLargePages(const char* lib_regex);
 map_status MapStaticCodeRangeToLargePages(void* from, void* to);
 map_status IsLargePagesEnabled(bool* result);
+void GetLargePageCapabilities(large_page_capabilities* caps, bool refresh);
+void SetThreadSafeRemap(bool enabled);
+void SetTextSectionLookup(bool enabled);
+void SetPerfMapEnabled(bool enabled);
+void SetDebuggerRegistrationEnabled(bool enabled);
+void SetNumaNode(int node);
+bool FindRemappedObject(const void* addr, remapped_object* object);
+map_status UnmapFromLargePages(const mem_range* region);
+map_status RemapToLargePages(const mem_range* region);
+size_t GetRemappedRegions(remapped_region* regions, size_t max_regions);
+void GetRemapCounters(remap_counters* counters);
+size_t GetRemapReports(remap_report* reports, size_t max_reports);
 const char* MapStatusStr(map_status status, bool fulltext);
 
 #endif  // LARGE_PAGE_H_
@@ -0,0 +1,404 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include "lp_policy.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POLICY_MAX_RULES    64
+#define POLICY_MAX_OBJECTS  128
+
+typedef enum {
+  policy_rank_auto,
+  policy_rank_size,
+  policy_rank_hotness
+} policy_rank;
+
+typedef struct {
+  bool     include;
+  regex_t  regex;
+  uint64_t page_size;  // 0 for the default large page size
+  uint64_t min_size;
+} policy_rule;
+
+typedef struct {
+  char*  name;
+  double weight;
+} profile_entry;
+
+struct lp_policy {
+  policy_rule    rules[POLICY_MAX_RULES];
+  size_t         rule_count;
+  bool           has_include;
+  uint64_t       budget;  // 0 for no budget
+  policy_rank    rank;
+  char*          profile_path;
+  profile_entry* profile;
+  size_t         profile_count;
+  bool           dry_run;
+};
+
+static const char* const rank_names[] = { "size", "size", "hotness" };
+
+// Parse a size such as "512", "4K", "2M" or "1G". A number without a suffix is
+// taken as MB.
+static bool ParseSize(const char* str, uint64_t* size) {
+  char* end;
+  uint64_t value = strtoull(str, &end, 10);
+
+  if (end == str) return false;
+  switch (toupper((unsigned char)*end)) {
+    case 'K': value <<= 10; end++; break;
+    case 'G': value <<= 30; end++; break;
+    case 'M': end++;  // fall through
+    case 0: value <<= 20; break;
+    default: return false;
+  }
+  if (toupper((unsigned char)*end) == 'B') end++;
+  if (*end != 0) return false;
+  *size = value;
+  return true;
+}
+
+// Split a line into whitespace separated words, dropping comments. A comment
+// starts with a '#' at the start of a word, so regular expressions may still
+// contain one.
+static size_t SplitWords(char* line, char** words, size_t max_words) {
+  size_t count = 0;
+  char* save;
+
+  for (char* word = strtok_r(line, " \t\r\n", &save);
+       word != NULL && word[0] != '#' && count < max_words;
+       word = strtok_r(NULL, " \t\r\n", &save)) {
+    words[count++] = word;
+  }
+  return count;
+}
+
+// Read a profile of "<weight>[%] <object>" lines, which is what
+// `perf report --sort dso --stdio` prints. Further percentage columns, e.g.
+// from `--children`, are skipped. Weights of the same object are summed.
+static bool LoadProfile(lp_policy* policy) {
+  FILE* ifs = fopen(policy->profile_path, "r");
+  char* line = NULL;
+  size_t len = 0;
+
+  if (ifs == NULL) return false;
+  while (getline(&line, &len, ifs) > 0) {
+    char* words[8];
+    size_t count = SplitWords(line, words, 8);
+    size_t idx = 1;
+    char* end;
+
+    if (count < 2) continue;
+    double weight = strtod(words[0], &end);
+    if (end == words[0] || (*end != 0 && strcmp(end, "%") != 0)) continue;
+    while (idx < count - 1 && strchr(words[idx], '%') != NULL) idx++;
+
+    size_t entry;
+    for (entry = 0; entry < policy->profile_count; entry++) {
+      if (strcmp(policy->profile[entry].name, words[idx]) == 0) break;
+    }
+    if (entry == policy->profile_count) {
+      profile_entry* profile = realloc(policy->profile,
+                                       (entry + 1) * sizeof(*profile));
+      if (profile == NULL) break;
+      policy->profile = profile;
+      policy->profile[entry].name = strdup(words[idx]);
+      policy->profile[entry].weight = 0;
+      policy->profile_count++;
+    }
+    policy->profile[entry].weight += weight;
+  }
+  free(line);
+  fclose(ifs);
+  return true;
+}
+
+// Parse "include REGEX [page-size=SIZE] [min-size=SIZE]" or "exclude REGEX".
+static const char* ParseRule(lp_policy* policy, char** words, size_t count) {
+  policy_rule* rule = &policy->rules[policy->rule_count];
+
+  if (count < 2) return "missing regular expression";
+  if (policy->rule_count == POLICY_MAX_RULES) return "too many rules";
+
+  rule->include = (strcmp(words[0], "include") == 0);
+  rule->page_size = 0;
+  rule->min_size = 0;
+  for (size_t idx = 2; idx < count; idx++) {
+    if (!rule->include) return "exclude takes no options";
+    if (strncmp(words[idx], "page-size=", 10) == 0) {
+      if (!ParseSize(words[idx] + 10, &rule->page_size) ||
+          rule->page_size == 0) {
+        return "invalid page-size";
+      }
+    } else if (strncmp(words[idx], "min-size=", 9) == 0) {
+      if (!ParseSize(words[idx] + 9, &rule->min_size)) {
+        return "invalid min-size";
+      }
+    } else {
+      return "unknown rule option";
+    }
+  }
+  if (regcomp(&rule->regex, words[1], REG_EXTENDED | REG_NOSUB) != 0) {
+    return "invalid regular expression";
+  }
+  policy->has_include |= rule->include;
+  policy->rule_count++;
+  return NULL;
+}
+
+static const char* ParseLine(lp_policy* policy, char* line) {
+  char* words[8];
+  size_t count = SplitWords(line, words, 8);
+
+  if (count == 0) return NULL;
+  if (strcmp(words[0], "include") == 0 || strcmp(words[0], "exclude") == 0) {
+    return ParseRule(policy, words, count);
+  }
+  if (strcmp(words[0], "budget") == 0) {
+    if (count != 2 || !ParseSize(words[1], &policy->budget)) {
+      return "invalid budget";
+    }
+  } else if (strcmp(words[0], "rank") == 0) {
+    if (count == 2 && strcmp(words[1], "size") == 0) {
+      policy->rank = policy_rank_size;
+    } else if (count == 2 && strcmp(words[1], "hotness") == 0) {
+      policy->rank = policy_rank_hotness;
+    } else {
+      return "rank must be size or hotness";
+    }
+  } else if (strcmp(words[0], "profile") == 0) {
+    if (count != 2) return "missing profile path";
+    free(policy->profile_path);
+    policy->profile_path = strdup(words[1]);
+  } else if (strcmp(words[0], "dry-run") == 0) {
+    if (count != 1) return "dry-run takes no arguments";
+    policy->dry_run = true;
+  } else {
+    return "unknown keyword";
+  }
+  return NULL;
+}
+
+// Read a policy file. Returns NULL after printing the first error, if the file
+// cannot be read or is not valid, so that a broken policy moves nothing.
+lp_policy* LoadPolicy(const char* path) {
+  lp_policy* policy = calloc(1, sizeof(*policy));
+  const char* error = NULL;
+  char* line = NULL;
+  size_t len = 0;
+  size_t lineno = 0;
+
+  if (policy == NULL) return NULL;
+  FILE* ifs = fopen(path, "r");
+  if (ifs == NULL) {
+    fprintf(stderr, "%s: cannot read the policy file\n", path);
+    FreePolicy(policy);
+    return NULL;
+  }
+  while (error == NULL && getline(&line, &len, ifs) > 0) {
+    lineno++;
+    error = ParseLine(policy, line);
+  }
+  free(line);
+  fclose(ifs);
+
+  if (error == NULL && policy->profile_path != NULL && !LoadProfile(policy)) {
+    fprintf(stderr, "%s: cannot read the profile %s\n", path,
+            policy->profile_path);
+    FreePolicy(policy);
+    return NULL;
+  }
+  if (error == NULL && policy->rank == policy_rank_hotness &&
+      policy->profile_path == NULL) {
+    error = "rank hotness needs a profile";
+    lineno = 0;
+  }
+  if (error != NULL) {
+    if (lineno > 0) {
+      fprintf(stderr, "%s:%zu: %s\n", path, lineno, error);
+    } else {
+      fprintf(stderr, "%s: %s\n", path, error);
+    }
+    FreePolicy(policy);
+    return NULL;
+  }
+  if (policy->rank == policy_rank_auto && policy->profile_path != NULL) {
+    policy->rank = policy_rank_hotness;
+  }
+  return policy;
+}
+
+void FreePolicy(lp_policy* policy) {
+  if (policy == NULL) return;
+  for (size_t idx = 0; idx < policy->rule_count; idx++) {
+    regfree(&policy->rules[idx].regex);
+  }
+  for (size_t idx = 0; idx < policy->profile_count; idx++) {
+    free(policy->profile[idx].name);
+  }
+  free(policy->profile);
+  free(policy->profile_path);
+  free(policy);
+}
+
+bool IsPolicyDryRun(const lp_policy* policy) {
+  return policy != NULL && policy->dry_run;
+}
+
+// The profile weight of an object, matched by full path or by file name, since
+// perf prints only the latter unless asked otherwise.
+static double FindHotness(const lp_policy* policy, const char* name) {
+  const char* base = strrchr(name, '/');
+  double hotness = 0;
+
+  base = (base != NULL ? base + 1 : name);
+  for (size_t idx = 0; idx < policy->profile_count; idx++) {
+    if (strcmp(policy->profile[idx].name, name) == 0 ||
+        strcmp(policy->profile[idx].name, base) == 0) {
+      hotness += policy->profile[idx].weight;
+    }
+  }
+  return hotness;
+}
+
+// Whether candidate `a` should be moved before candidate `b`: by profile
+// weight per MB of large page memory, or by size.
+static bool RanksBefore(const lp_policy* policy, const policy_candidate* a,
+                        const policy_candidate* b) {
+  if (policy->rank == policy_rank_hotness) {
+    double density_a = a->hotness / a->text_size;
+    double density_b = b->hotness / b->text_size;
+    if (density_a != density_b) return density_a > density_b;
+  }
+  return a->text_size > b->text_size;
+}
+
+// Decide which candidates to move. Every object is checked against the rules
+// in order, and the first matching rule applies. An object that no rule
+// matches is moved only if there are no include rules. The objects that pass
+// are then taken in rank order for as long as they fit into the budget.
+// Without a policy, every candidate is selected. `page_size` of each candidate
+// must be set to the large page size in use.
+void ApplyPolicy(const lp_policy* policy, policy_candidate* candidates,
+                 size_t count) {
+  size_t order[POLICY_MAX_OBJECTS];
+  size_t eligible = 0;
+  uint64_t used = 0;
+
+  for (size_t idx = 0; idx < count; idx++) {
+    policy_candidate* c = &candidates[idx];
+    const policy_rule* rule = NULL;
+
+    c->selected = false;
+    c->reason = NULL;
+    c->hotness = 0;
+    if (policy == NULL) {
+      c->selected = true;
+      continue;
+    }
+
+    for (size_t r = 0; r < policy->rule_count && rule == NULL; r++) {
+      if (regexec(&policy->rules[r].regex, c->name, 0, NULL, 0) == 0) {
+        rule = &policy->rules[r];
+      }
+    }
+    c->hotness = FindHotness(policy, c->name);
+    if (rule == NULL && policy->has_include) {
+      c->reason = "no include rule matches";
+    } else if (rule != NULL && !rule->include) {
+      c->reason = "excluded";
+    } else if (rule != NULL && rule->page_size != 0 &&
+               rule->page_size < c->page_size) {
+      c->reason = "page-size keeps it on small pages";
+    } else if (rule != NULL && rule->page_size > c->page_size) {
+      c->reason = "page-size not supported";
+    } else if (c->text_size == 0) {
+      c->reason = "text smaller than a large page";
+    } else if (rule != NULL && c->text_size < rule->min_size) {
+      c->reason = "smaller than min-size";
+    } else if (eligible < POLICY_MAX_OBJECTS) {
+      // Insertion sort, there are only a few dozen objects.
+      size_t pos = eligible++;
+      while (pos > 0 && RanksBefore(policy, c, &candidates[order[pos - 1]])) {
+        order[pos] = order[pos - 1];
+        pos--;
+      }
+      order[pos] = idx;
+    }
+  }
+
+  for (size_t pos = 0; pos < eligible; pos++) {
+    policy_candidate* c = &candidates[order[pos]];
+    if (policy->budget == 0 || used + c->text_size <= policy->budget) {
+      c->selected = true;
+      used += c->text_size;
+    } else {
+      c->reason = "over budget";
+    }
+  }
+}
+
+// Print which objects would be moved and why the others would not.
+void PrintPolicyPlan(FILE* ofs, const lp_policy* policy,
+                     const policy_candidate* candidates, size_t count) {
+  uint64_t used = 0;
+  size_t selected = 0;
+
+  fprintf(ofs, "iodlr plan: ");
+  if (policy == NULL) {
+    fprintf(ofs, "no policy, all objects\n");
+  } else {
+    if (policy->budget != 0) {
+      fprintf(ofs, "budget %" PRIu64 " MB", policy->budget >> 20);
+    } else {
+      fprintf(ofs, "no budget");
+    }
+    fprintf(ofs, ", ranked by %s", rank_names[policy->rank]);
+    if (policy->profile_path != NULL) {
+      fprintf(ofs, " (profile %s)", policy->profile_path);
+    }
+    fputc('\n', ofs);
+  }
+
+  for (size_t idx = 0; idx < count; idx++) {
+    const policy_candidate* c = &candidates[idx];
+    fprintf(ofs, "  %-6s %6" PRIu64 " MB  %s", c->selected ? "remap" : "skip",
+            c->text_size >> 20, c->name);
+    if (policy != NULL && policy->profile_path != NULL) {
+      fprintf(ofs, "  hotness %.2f", c->hotness);
+    }
+    if (c->reason != NULL) fprintf(ofs, "  (%s)", c->reason);
+    fputc('\n', ofs);
+    if (c->selected) {
+      used += c->text_size;
+      selected++;
+    }
+  }
+  fprintf(ofs, "iodlr plan: %zu of %zu objects, %" PRIu64 " MB of large "
+          "pages\n", selected, count, used >> 20);
+}
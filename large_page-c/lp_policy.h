@@ -0,0 +1,54 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+#ifndef LP_POLICY_H_
+#define LP_POLICY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A policy file (IODLR_CONFIG) decides which of the loaded objects
+// liblppreload.so moves to large pages. See README.md for the format.
+typedef struct lp_policy lp_policy;
+
+// An object that could be moved to large pages. `text_size` is the large page
+// aligned part of its text, i.e. the large page memory it would take.
+typedef struct {
+  char*       name;
+  bool        is_exe;
+  uint64_t    text_size;
+  double      hotness;
+  uint64_t    page_size;
+  bool        selected;
+  const char* reason;
+} policy_candidate;
+
+lp_policy* LoadPolicy(const char* path);
+void FreePolicy(lp_policy* policy);
+bool IsPolicyDryRun(const lp_policy* policy);
+void ApplyPolicy(const lp_policy* policy, policy_candidate* candidates,
+                 size_t count);
+void PrintPolicyPlan(FILE* ofs, const lp_policy* policy,
+                     const policy_candidate* candidates, size_t count);
+
+#endif  // LP_POLICY_H_
@@ -1,62 +1,940 @@
 #define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <link.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <regex.h>
+#include <time.h>
+#include <unistd.h>
 #include "large_page.h"
+#include "lp_policy.h"
+#include "lp_preload.h"
+#include "lp_probes.h"
+
+#define MAX_REGIONS 128
+#define MAX_REPORTS 256
+#define PSI_MEMORY_FILE "/proc/pressure/memory"
+#define PSI_DEFAULT_TRIGGER "some 150000 1000000"
+#define PSI_DEFAULT_THRESHOLD 10.0
+#define PSI_DEFAULT_CALM_SECONDS 30
+#define PAGE_IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+#define PAGEMAP_BATCH 512
+#define AUTOTUNE_DEFAULT_WINDOW_MS 1000
+#define AUTOTUNE_DEFAULT_MIN_GAIN 5.0
+#define AUTOTUNE_MIN_INSTRUCTIONS 1000000
+#define MAX_TUNED_THREADS 256
 
 pid_t gettid(void);
 
+static pthread_mutex_t remap_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t remap_request;
+static bool large_pages_enabled = false;
+static long remap_delay = 0;
+static bool remap_on_signal = false;
+static long autotune_window_ms = 0;
+static double autotune_min_gain = AUTOTUNE_DEFAULT_MIN_GAIN;
+static FILE* autotune_log = NULL;
+static mem_range rejected_regions[MAX_REGIONS];
+static size_t rejected_region_count = 0;
+static lp_policy* policy = NULL;
+static bool dry_run = false;
+
 void printErr (map_status status, const char * lib) {
   fprintf(stderr,
     "Mapping to large pages failed for %s: %s\n", lib,
     MapStatusStr(status, true));
 }
 
-static int tryMapAllDSOs(struct dl_phdr_info* hdr, size_t size, void* data) {
-  regex_t * ignoreReg = (regex_t *)data;
-  const char * lib = hdr->dlpi_name;
-  if (lib && lib[0] != 0) {
-    if (ignoreReg != NULL && regexec(ignoreReg, lib, 0, NULL, 0) == 0) {
-      fprintf(stderr, "Ignoring %s\n", lib);
+// Return true if a region of the object was already moved to large pages by an
+// earlier pass, so that deferred or repeated passes leave it alone.
+static bool isObjectRemapped(struct dl_phdr_info* hdr) {
+  remapped_region regions[MAX_REGIONS];
+  size_t count = GetRemappedRegions(regions, MAX_REGIONS);
+  if (count > MAX_REGIONS) count = MAX_REGIONS;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    if (phdr->p_type != PT_LOAD) continue;
+    uintptr_t start = hdr->dlpi_addr + phdr->p_vaddr;
+    uintptr_t end = start + phdr->p_memsz;
+    for (size_t r = 0; r < count; r++) {
+      uintptr_t from = (uintptr_t)regions[r].range.from;
+      if (from >= start && from < end) return true;
+    }
+  }
+  return false;
+}
+
+// The objects a remap pass considers: the executable, reported first, and all
+// loaded DSOs, except those moved by an earlier pass and DSOs matched by
+// LP_IGNORE. The policy then decides which of them are moved.
+typedef struct {
+  policy_candidate items[MAX_REGIONS];
+  uintptr_t        bases[MAX_REGIONS];
+  size_t           count;
+  size_t           visited;
+  uint64_t         page_size;
+  const regex_t*   ignore;
+} remap_candidates;
+
+// The large page aligned part of the executable segments of an object.
+static uint64_t largePageTextSize(struct dl_phdr_info* hdr,
+                                  uint64_t page_size) {
+  uint64_t size = 0;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)* phdr = &hdr->dlpi_phdr[idx];
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+    uintptr_t start = hdr->dlpi_addr + phdr->p_vaddr;
+    uintptr_t from = (start + page_size - 1) & ~(page_size - 1);
+    uintptr_t to = (start + phdr->p_memsz) & ~(page_size - 1);
+    if (to > from) size += to - from;
+  }
+  return size;
+}
+
+static int findCandidates(struct dl_phdr_info* hdr, size_t size, void* data) {
+  remap_candidates* candidates = (remap_candidates*)data;
+  const char* name = hdr->dlpi_name;
+  bool is_exe = (candidates->visited++ == 0);
+  char exe[PATH_MAX];
+
+  if (candidates->count == MAX_REGIONS || isObjectRemapped(hdr)) return 0;
+  if (is_exe) {
+    // The executable is reported first, with an empty name.
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len <= 0) return 0;
+    exe[len] = 0;
+    name = exe;
+  } else if (name == NULL || name[0] == 0) {
+    return 0;
+  } else if (candidates->ignore != NULL &&
+             regexec(candidates->ignore, name, 0, NULL, 0) == 0) {
+    fprintf(stderr, "Ignoring %s\n", name);
+    return 0;
+  }
+
+  policy_candidate* c = &candidates->items[candidates->count];
+  memset(c, 0, sizeof(*c));
+  c->name = strdup(name);
+  if (c->name == NULL) return 0;
+  c->is_exe = is_exe;
+  c->page_size = candidates->page_size;
+  c->text_size = largePageTextSize(hdr, candidates->page_size);
+  candidates->bases[candidates->count++] = hdr->dlpi_addr;
+  return 0;
+}
+
+// Collect the candidates of a remap pass and apply the policy to them. In a
+// dry run, the plan is printed and nothing is selected.
+static void collectCandidates(remap_candidates* candidates) {
+  large_page_capabilities caps;
+  regex_t ignoreReg;
+
+  memset(candidates, 0, sizeof(*candidates));
+  GetLargePageCapabilities(&caps, false);
+  candidates->page_size =
+      (caps.hpage_pmd_size != 0 ? caps.hpage_pmd_size : 2UL * 1024 * 1024);
+
+  const char * ignoreStr = secure_getenv("LP_IGNORE");
+  if (ignoreStr != NULL && regcomp(&ignoreReg, ignoreStr, REG_EXTENDED) == 0) {
+    candidates->ignore = &ignoreReg;
+  }
+  dl_iterate_phdr(findCandidates, candidates);
+  if (candidates->ignore != NULL) regfree(&ignoreReg);
+  candidates->ignore = NULL;
+
+  ApplyPolicy(policy, candidates->items, candidates->count);
+  if (dry_run) {
+    PrintPolicyPlan(stderr, policy, candidates->items, candidates->count);
+    for (size_t idx = 0; idx < candidates->count; idx++) {
+      candidates->items[idx].selected = false;
+    }
+  }
+}
+
+static void freeCandidates(remap_candidates* candidates) {
+  for (size_t idx = 0; idx < candidates->count; idx++) {
+    free(candidates->items[idx].name);
+  }
+}
+
+static void writeJsonString(FILE* ofs, const char* str) {
+  fputc('"', ofs);
+  for (; *str != 0; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(ofs, "\\%c", *str);
+    } else if ((unsigned char)*str < 0x20) {
+      fprintf(ofs, "\\u%04x", *str);
     } else {
-      fprintf(stderr, "Enabling large code pages for %s ", lib);
-      fflush(stderr); // flush output before a possible error
-      map_status status = MapDSOToLargePages(lib);
-      if (status == map_ok) {
-        fprintf(stderr, " - success.\n");
-      } else {
-        fprintf(stderr, "\n");
-        printErr(status, lib);
+      fputc(*str, ofs);
+    }
+  }
+  fputc('"', ofs);
+}
+
+// Write the remap reports collected so far as JSON to the file named by
+// IODLR_REPORT, or to stderr if it is "-". The file is rewritten after every
+// remap pass, so it always reflects all passes so far.
+static void writeRemapReport() {
+  const char* path = secure_getenv("IODLR_REPORT");
+  if (path == NULL) return;
+
+  static remap_report reports[MAX_REPORTS];
+  size_t count = GetRemapReports(reports, MAX_REPORTS);
+  if (count > MAX_REPORTS) count = MAX_REPORTS;
+
+  FILE* ofs = (strcmp(path, "-") == 0 ? stderr : fopen(path, "w"));
+  if (ofs == NULL) {
+    fprintf(stderr, "Failed to write the remap report to %s\n", path);
+    return;
+  }
+
+  fprintf(ofs, "{\"pid\": %d, \"regions\": [", getpid());
+  for (size_t idx = 0; idx < count; idx++) {
+    const remap_report* r = &reports[idx];
+    fprintf(ofs, "%s\n  {\"object\": ", idx > 0 ? "," : "");
+    writeJsonString(ofs, r->object);
+    fprintf(ofs, ", \"build_id\": \"");
+    for (size_t byte = 0; byte < r->build_id_size; byte++) {
+      fprintf(ofs, "%02x", r->build_id[byte]);
+    }
+    fprintf(ofs, "\",\n   \"original\": [\"%p\", \"%p\"], "
+                 "\"aligned\": [\"%p\", \"%p\"],\n",
+            r->original.from, r->original.to, r->aligned.from, r->aligned.to);
+    fprintf(ofs, "   \"bytes_covered\": %" PRIu64 ", "
+                 "\"bytes_skipped\": %" PRIu64 ", "
+                 "\"page_sizes\": {\"large\": %" PRIu64 ", "
+                 "\"small\": %" PRIu64 "},\n",
+            r->bytes_covered, r->bytes_skipped,
+            r->large_page_size, r->small_page_size);
+    fprintf(ofs, "   \"timings_ns\": {\"discovery\": %" PRIu64 ", "
+                 "\"copy\": %" PRIu64 ", \"mmap\": %" PRIu64 ", "
+                 "\"madvise\": %" PRIu64 ", \"mprotect\": %" PRIu64 "},\n",
+            r->timings_ns.discovery, r->timings_ns.copy, r->timings_ns.mmap,
+            r->timings_ns.madvise, r->timings_ns.mprotect);
+    fprintf(ofs, "   \"numa\": {\"target_node\": %d, \"node\": %d, "
+                 "\"remote_pages\": %u},\n",
+            r->numa_target_node, r->numa_node, r->numa_remote_pages);
+    fprintf(ofs, "   \"minor_faults\": %" PRIu64 ", "
+                 "\"major_faults\": %" PRIu64 ", \"status\": \"%s\"}",
+            r->minor_faults, r->major_faults,
+            MapStatusStr(r->status, false));
+  }
+  fprintf(ofs, "\n]}\n");
+
+  if (ofs != stderr) fclose(ofs);
+}
+
+// Counts taken in all threads of the process over one measurement window.
+typedef struct {
+  uint64_t instructions;
+  uint64_t itlb_misses;
+  uint64_t frontend_stalls;
+  bool     have_stalls;
+} tune_sample;
+
+static int openCounter(pid_t tid, uint32_t type, uint64_t config,
+                       int group_fd) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (group_fd == -1);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, tid, -1, group_fd,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+// Count retired instructions, iTLB misses and, where the PMU provides them,
+// front-end stall cycles over one window in every thread running at its
+// start. Returns false if the counters are not available, e.g. in a VM without
+// a virtual PMU or with a restrictive perf_event_paranoid setting.
+static bool measureWindow(tune_sample* sample) {
+  int fds[MAX_TUNED_THREADS][3];
+  size_t events[MAX_TUNED_THREADS];
+  size_t thread_count = 0;
+  size_t stall_count = 0;
+  struct dirent* entry;
+  pid_t self = gettid();
+
+  memset(sample, 0, sizeof(*sample));
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == NULL) return false;
+  while ((entry = readdir(dir)) != NULL && thread_count < MAX_TUNED_THREADS) {
+    pid_t tid = atoi(entry->d_name);
+    if (tid <= 0 || tid == self) continue;
+
+    int* group = fds[thread_count];
+    group[0] = openCounter(tid, PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS, -1);
+    if (group[0] < 0) continue;
+    group[1] = openCounter(tid, PERF_TYPE_HW_CACHE,
+                           PERF_COUNT_HW_CACHE_ITLB |
+                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                           group[0]);
+    if (group[1] < 0) {
+      close(group[0]);
+      continue;
+    }
+    group[2] = openCounter(tid, PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_STALLED_CYCLES_FRONTEND, group[0]);
+    events[thread_count] = (group[2] >= 0 ? 3 : 2);
+    stall_count += (group[2] >= 0);
+    thread_count++;
+  }
+  closedir(dir);
+  if (thread_count == 0) return false;
+
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    ioctl(fds[idx][0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  struct timespec window = { autotune_window_ms / 1000,
+                             (autotune_window_ms % 1000) * 1000000 };
+  while (nanosleep(&window, &window) != 0 && errno == EINTR) {
+  }
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    ioctl(fds[idx][0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  // With PERF_FORMAT_GROUP, a read returns the number of events followed by
+  // their values in the order in which the events were opened.
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    uint64_t values[4] = { 0 };
+    if (read(fds[idx][0], values, sizeof(values)) > 0 && values[0] >= 2) {
+      sample->instructions += values[1];
+      sample->itlb_misses += values[2];
+      if (values[0] >= 3) sample->frontend_stalls += values[3];
+    }
+    for (size_t event = 0; event < events[idx]; event++) {
+      close(fds[idx][event]);
+    }
+  }
+  sample->have_stalls = (stall_count == thread_count);
+  return true;
+}
+
+static double perKiloInstruction(uint64_t count, const tune_sample* sample) {
+  return sample->instructions > 0 ? 1000.0 * count / sample->instructions : 0;
+}
+
+// Write a path to the tuning log as an anchored extended regular expression.
+static void writeRegex(FILE* ofs, const char* str) {
+  fputc('^', ofs);
+  for (; *str != 0; str++) {
+    if (strchr(".[]()*+?{}|^$\\", *str) != NULL) fputc('\\', ofs);
+    fputc(*str, ofs);
+  }
+  fputc('$', ofs);
+}
+
+// Move one object to large pages, measuring the process for a window before
+// and after, and move it back unless its iTLB miss rate dropped by at least
+// IODLR_AUTOTUNE_MIN_GAIN percent. Returns false if no counters are available.
+static bool tuneObject(const char* name, bool is_exe, map_status* status) {
+  remapped_region regions[MAX_REGIONS];
+  tune_sample before, after;
+  const char* reason = NULL;
+
+  if (!measureWindow(&before)) return false;
+
+  size_t first = GetRemappedRegions(regions, MAX_REGIONS);
+  *status = is_exe ? MapStaticCodeToLargePages() : MapDSOToLargePages(name);
+  if (*status != map_ok) {
+    fprintf(autotune_log, "# %s: %s\n", name, MapStatusStr(*status, true));
+    return true;
+  }
+  measureWindow(&after);
+
+  double miss_before = perKiloInstruction(before.itlb_misses, &before);
+  double miss_after = perKiloInstruction(after.itlb_misses, &after);
+  double gain = (miss_before > 0
+                 ? 100.0 * (miss_before - miss_after) / miss_before : 0);
+  bool keep = (gain >= autotune_min_gain);
+  // Without work to measure, there is no evidence that remapping hurts.
+  if (before.instructions < AUTOTUNE_MIN_INSTRUCTIONS ||
+      after.instructions < AUTOTUNE_MIN_INSTRUCTIONS) {
+    keep = true;
+    reason = "idle";
+  }
+
+  if (!keep) {
+    size_t count = GetRemappedRegions(regions, MAX_REGIONS);
+    if (count > MAX_REGIONS) count = MAX_REGIONS;
+    for (size_t idx = first; idx < count; idx++) {
+      UnmapFromLargePages(&regions[idx].range);
+      if (rejected_region_count < MAX_REGIONS) {
+        rejected_regions[rejected_region_count++] = regions[idx].range;
       }
     }
   }
-  return 0;
+
+  fprintf(autotune_log, "%s ", keep ? "include" : "exclude");
+  writeRegex(autotune_log, name);
+  fprintf(autotune_log, "  # itlb mpki %.3f -> %.3f (%+.1f%%)",
+          miss_before, miss_after, -gain);
+  if (before.have_stalls && after.have_stalls) {
+    fprintf(autotune_log, ", frontend stalls pki %.1f -> %.1f",
+            perKiloInstruction(before.frontend_stalls, &before),
+            perKiloInstruction(after.frontend_stalls, &after));
+  }
+  if (reason != NULL) fprintf(autotune_log, ", %s", reason);
+  fputc('\n', autotune_log);
+  fflush(autotune_log);
+  return true;
 }
 
+// Move the objects that mapAllToLargePages() would move one at a time, keeping
+// only those that pay off. Each decision is logged as an include or exclude
+// rule for the object. If no counters are available, every object is kept.
+static map_status tuneAllToLargePages(remap_candidates* candidates) {
+  map_status status = map_ok;
+  bool tuning = true;
+  size_t selected = 0;
+
+  for (size_t idx = 0; idx < candidates->count; idx++) {
+    selected += candidates->items[idx].selected;
+  }
+  if (selected == 0) return map_ok;
+
+  fprintf(autotune_log, "# iodlr autotune: %zu objects, %ld ms windows, "
+          "minimum gain %.1f%%\n", selected, autotune_window_ms,
+          autotune_min_gain);
+  for (size_t idx = 0; idx < candidates->count; idx++) {
+    const policy_candidate* c = &candidates->items[idx];
+    map_status object_status = map_ok;
+    if (!c->selected) continue;
+    if (tuning && !tuneObject(c->name, c->is_exe, &object_status)) {
+      fprintf(autotune_log, "# performance counters unavailable, keeping "
+              "all objects\n");
+      tuning = false;
+    }
+    if (!tuning) {
+      object_status = c->is_exe ? MapStaticCodeToLargePages()
+                                : MapDSOToLargePages(c->name);
+      if (object_status != map_ok) {
+        printErr(object_status, c->name);
+      }
+    }
+    if (c->is_exe) status = object_status;
+  }
+  fflush(autotune_log);
+  return status;
+}
+
+// Whether a region was moved back to small pages by the auto-tuner, and must
+// stay there.
+static bool isRegionRejected(const mem_range* range) {
+  for (size_t idx = 0; idx < rejected_region_count; idx++) {
+    if (rejected_regions[idx].from == range->from) return true;
+  }
+  return false;
+}
+
+// Move the executable and the loaded DSOs selected by the policy to large
+// pages, or all of them if there is no policy. Objects moved by an earlier
+// pass are skipped.
+static map_status mapAllToLargePages() {
+  remap_candidates candidates;
+  map_status status = map_ok;
+
+  collectCandidates(&candidates);
+  if (autotune_window_ms > 0) {
+    status = tuneAllToLargePages(&candidates);
+    freeCandidates(&candidates);
+    return status;
+  }
+
+  for (size_t idx = 0; idx < candidates.count; idx++) {
+    const policy_candidate* c = &candidates.items[idx];
+    if (!c->selected) continue;
+
+    if (c->is_exe) {
+      fprintf(stderr, "Base address: %lx.", candidates.bases[idx]);
+      status = MapStaticCodeToLargePages();
+      if (status != map_ok) {
+        printErr(status, "static code");
+      }
+      continue;
+    }
+
+    fprintf(stderr, "Enabling large code pages for %s Base address: %lx.",
+            c->name, candidates.bases[idx]);
+    fflush(stderr); // flush output before a possible error
+    IODLR_PROBE1(map_dso_entry, c->name);
+    map_status dso_status = MapDSOToLargePages(c->name);
+    IODLR_PROBE2(map_dso_return, c->name, dso_status);
+    if (dso_status == map_ok) {
+      fprintf(stderr, " - success.\n");
+    } else {
+      fprintf(stderr, "\n");
+      printErr(dso_status, c->name);
+    }
+  }
+  freeCandidates(&candidates);
+
+  return status;
+}
+
+// Move the executable and all DSOs loaded so far to large pages now. This may
+// be called by the application at any time, e.g. once it has warmed up, and
+// repeatedly, e.g. after loading further DSOs. Regions are swapped in with
+// mremap(), so other threads may keep running. Returns the status of moving the
+// executable.
+map_status iodlr_remap_now(void) {
+  map_status status = map_ok;
+
+  pthread_mutex_lock(&remap_lock);
+  if (large_pages_enabled) {
+    SetThreadSafeRemap(true);
+    IODLR_PROBE(remap_now_entry);
+    status = mapAllToLargePages();
+    IODLR_PROBE1(remap_now_return, status);
+    writeRemapReport();
+  }
+  pthread_mutex_unlock(&remap_lock);
+
+  return status;
+}
+
+static void requestRemap(int sig) {
+  sem_post(&remap_request);
+}
+
+// Parse a signal given by number or by name, with or without the SIG prefix.
+static int parseSignal(const char* str) {
+  static const struct { const char* name; int sig; } names[] = {
+    { "HUP", SIGHUP }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+    { "WINCH", SIGWINCH }, { "URG", SIGURG }
+  };
+  char* end;
+  long sig = strtol(str, &end, 10);
+  if (*str != 0 && *end == 0) {
+    return (sig > 0 && sig < NSIG ? (int)sig : -1);
+  }
+
+  if (strncmp(str, "SIG", 3) == 0) str += 3;
+  for (size_t idx = 0; idx < sizeof(names) / sizeof(names[0]); idx++) {
+    if (strcmp(str, names[idx].name) == 0) return names[idx].sig;
+  }
+  return -1;
+}
+
+// Wait for the remap delay to pass or for a remap signal, whichever comes
+// first, and then keep serving remap signals, if one is configured.
+static void* remapWorker(void* data) {
+  if (remap_delay > 0 || autotune_window_ms > 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += remap_delay;
+    while (sem_timedwait(&remap_request, &deadline) != 0 && errno == EINTR) {
+    }
+    iodlr_remap_now();
+  }
+
+  while (remap_on_signal) {
+    if (sem_wait(&remap_request) == 0) {
+      iodlr_remap_now();
+    }
+  }
+
+  return NULL;
+}
+
+// Set up deferred remapping as requested by IODLR_REMAP_DELAY (seconds) and
+// IODLR_REMAP_SIGNAL. Returns false if remapping should happen right away.
+static bool deferRemap() {
+  const char* delay_str = secure_getenv("IODLR_REMAP_DELAY");
+  const char* signal_str = secure_getenv("IODLR_REMAP_SIGNAL");
+  int sig = -1;
+
+  const char* autotune_str = secure_getenv("IODLR_AUTOTUNE");
+  const char* min_gain_str = secure_getenv("IODLR_AUTOTUNE_MIN_GAIN");
+  const char* log_str = secure_getenv("IODLR_AUTOTUNE_LOG");
+
+  remap_delay = (delay_str ? atol(delay_str) : 0);
+
+  // The auto-tuner measures the running application, so it always remaps from
+  // the remap thread, right away unless a delay is set.
+  if (autotune_str != NULL) {
+    autotune_window_ms = atol(autotune_str);
+    if (autotune_window_ms <= 0) {
+      autotune_window_ms = AUTOTUNE_DEFAULT_WINDOW_MS;
+    }
+    if (min_gain_str != NULL) autotune_min_gain = atof(min_gain_str);
+    autotune_log = (log_str != NULL ? fopen(log_str, "a") : NULL);
+    if (autotune_log == NULL) autotune_log = stderr;
+  }
+
+  if (signal_str != NULL) {
+    sig = parseSignal(signal_str);
+    if (sig < 0) {
+      fprintf(stderr, "Ignoring unknown remap signal %s\n", signal_str);
+    }
+  }
+  if (remap_delay <= 0 && sig < 0 && autotune_window_ms <= 0) return false;
+
+  if (sem_init(&remap_request, 0, 0) != 0) return false;
+
+  if (sig >= 0) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = requestRemap;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(sig, &sa, NULL) != 0) {
+      fprintf(stderr, "Failed to install the remap signal handler\n");
+      if (remap_delay <= 0) return false;
+    } else {
+      remap_on_signal = true;
+    }
+  }
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  bool started;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  started = (pthread_create(&thread, &attr, remapWorker, NULL) == 0);
+  pthread_attr_destroy(&attr);
+
+  if (!started) {
+    fprintf(stderr, "Failed to start the deferred remap thread\n");
+    return false;
+  }
+  return true;
+}
+
+// Walk the page frames backing `range`, as listed in /proc/self/pagemap. With
+// `mark`, set them idle in the idle page bitmap; otherwise add the bytes of
+// those accessed since then to `*referenced`. Only frames of the range are
+// touched, so the accessed bits of the rest of the process are left alone.
+// Returns false if the frames cannot be tracked, e.g. because frame numbers
+// are hidden without CAP_SYS_ADMIN.
+static bool walkIdleFrames(int pagemap, int bitmap, const mem_range* range,
+                           bool mark, uint64_t* referenced) {
+  uint64_t entries[PAGEMAP_BATCH];
+  uint64_t word = 0;
+  uint64_t word_index = UINT64_MAX;
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t addr = (uintptr_t)range->from;
+  uintptr_t to = (uintptr_t)range->to;
+
+  while (addr < to) {
+    size_t count = (to - addr) / page_size;
+    if (count > PAGEMAP_BATCH) count = PAGEMAP_BATCH;
+    if (count == 0) break;
+    ssize_t got = pread(pagemap, entries, count * sizeof(entries[0]),
+                        addr / page_size * sizeof(entries[0]));
+    if (got < (ssize_t)sizeof(entries[0])) return false;
+    count = got / sizeof(entries[0]);
+
+    for (size_t idx = 0; idx < count; idx++) {
+      if (!(entries[idx] & PAGEMAP_PRESENT)) continue;
+      uint64_t pfn = entries[idx] & PAGEMAP_PFN_MASK;
+      if (pfn == 0) return false;
+      if (pfn / 64 != word_index) {
+        if (mark && word_index != UINT64_MAX &&
+            pwrite(bitmap, &word, sizeof(word), word_index * sizeof(word)) !=
+                sizeof(word)) {
+          return false;
+        }
+        word_index = pfn / 64;
+        word = 0;
+        if (!mark &&
+            pread(bitmap, &word, sizeof(word), word_index * sizeof(word)) !=
+                sizeof(word)) {
+          return false;
+        }
+      }
+      if (mark) {
+        word |= 1ULL << (pfn % 64);
+      } else if (!(word & (1ULL << (pfn % 64)))) {
+        *referenced += page_size;
+      }
+    }
+    addr += count * page_size;
+  }
+  return !mark || word_index == UINT64_MAX ||
+         pwrite(bitmap, &word, sizeof(word), word_index * sizeof(word)) ==
+             sizeof(word);
+}
+
+// Mark the pages of every region idle, or with `referenced` count the bytes of
+// each region accessed since. Uses idle page tracking, which needs
+// CONFIG_IDLE_PAGE_TRACKING and CAP_SYS_ADMIN; says so once and returns false
+// if it is not available. Explicit huge pages are not tracked and count as
+// referenced.
+static bool trackIdleRegions(const remapped_region* regions, size_t count,
+                             uint64_t* referenced) {
+  static bool unavailable = false;
+  bool tracked = true;
+
+  if (unavailable) return false;
+
+  int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  int bitmap = open(PAGE_IDLE_BITMAP,
+                    (referenced != NULL ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+  if (referenced != NULL) {
+    memset(referenced, 0, count * sizeof(*referenced));
+  }
+  for (size_t idx = 0; idx < count && pagemap >= 0 && bitmap >= 0 && tracked;
+       idx++) {
+    tracked = walkIdleFrames(pagemap, bitmap, &regions[idx].range,
+                             referenced == NULL,
+                             referenced != NULL ? &referenced[idx] : NULL);
+  }
+  if (pagemap < 0 || bitmap < 0 || !tracked) {
+    fprintf(stderr, "Idle page tracking unavailable, ranking regions by the "
+                    "order they were remapped in\n");
+    unavailable = true;
+    tracked = false;
+  }
+  if (pagemap >= 0) close(pagemap);
+  if (bitmap >= 0) close(bitmap);
+  return tracked;
+}
+
+// Mark the pages of all regions idle, so that the next trackIdleRegions()
+// only counts memory touched from now on.
+static void markRegionsIdle() {
+  remapped_region regions[MAX_REGIONS];
+  size_t count = GetRemappedRegions(regions, MAX_REGIONS);
+  if (count > MAX_REGIONS) count = MAX_REGIONS;
+
+  trackIdleRegions(regions, count, NULL);
+}
+
+// The share of a region that was referenced since the last markRegionsIdle().
+static double referencedShare(const remapped_region* region,
+                              uint64_t referenced) {
+  uintptr_t size = (uintptr_t)region->range.to - (uintptr_t)region->range.from;
+  return (size > 0 ? (double)referenced / size : 0.0);
+}
+
+// Demote the region still on large pages of which the smallest share was
+// referenced since the last markRegionsIdle(). Ties, and regions whose use
+// cannot be measured, go to the region remapped last.
+static void demoteColdestRegion() {
+  remapped_region regions[MAX_REGIONS];
+  uint64_t referenced[MAX_REGIONS];
+  size_t count = GetRemappedRegions(regions, MAX_REGIONS);
+  size_t coldest = MAX_REGIONS;
+  if (count > MAX_REGIONS) count = MAX_REGIONS;
+
+  if (!trackIdleRegions(regions, count, referenced)) {
+    memset(referenced, 0, sizeof(referenced));
+  }
+  while (count-- > 0) {
+    if (!regions[count].demoted &&
+        (coldest == MAX_REGIONS ||
+         referencedShare(&regions[count], referenced[count]) <
+             referencedShare(&regions[coldest], referenced[coldest]))) {
+      coldest = count;
+    }
+  }
+  if (coldest == MAX_REGIONS) return;
+
+  map_status status = UnmapFromLargePages(&regions[coldest].range);
+  fprintf(stderr, "Memory pressure: demoting %p-%p (%" PRIu64 " kB "
+                  "referenced): %s\n",
+          regions[coldest].range.from, regions[coldest].range.to,
+          referenced[coldest] / 1024, MapStatusStr(status, true));
+}
+
+// Re-promote the demoted region of which the largest share was referenced
+// since the last markRegionsIdle(). Ties go to the region remapped first.
+static void promoteHottestRegion() {
+  remapped_region regions[MAX_REGIONS];
+  uint64_t referenced[MAX_REGIONS];
+  size_t count = GetRemappedRegions(regions, MAX_REGIONS);
+  size_t hottest = MAX_REGIONS;
+  if (count > MAX_REGIONS) count = MAX_REGIONS;
+
+  if (!trackIdleRegions(regions, count, referenced)) {
+    memset(referenced, 0, sizeof(referenced));
+  }
+  for (size_t idx = 0; idx < count; idx++) {
+    if (regions[idx].demoted && !isRegionRejected(&regions[idx].range) &&
+        (hottest == MAX_REGIONS ||
+         referencedShare(&regions[idx], referenced[idx]) >
+             referencedShare(&regions[hottest], referenced[hottest]))) {
+      hottest = idx;
+    }
+  }
+  if (hottest == MAX_REGIONS) return;
+
+  map_status status = RemapToLargePages(&regions[hottest].range);
+  fprintf(stderr, "Memory pressure cleared: promoting %p-%p (%" PRIu64 " kB "
+                  "referenced): %s\n",
+          regions[hottest].range.from, regions[hottest].range.to,
+          referenced[hottest] / 1024, MapStatusStr(status, true));
+}
+
+static bool readMemoryPressure(double* avg10) {
+  FILE* ifs = fopen(PSI_MEMORY_FILE, "r");
+  if (ifs == NULL) return false;
+  int matched = fscanf(ifs, "some avg10=%lf", avg10);
+  fclose(ifs);
+  return matched == 1;
+}
+
+// Watch the memory pressure stall information of the system. When pressure
+// rises, demote one region at a time, and when there has been no pressure for
+// IODLR_PSI_CALM seconds, promote one region at a time. Regions are ranked by
+// how much of them was referenced since the watcher last woke up. A PSI trigger
+// (IODLR_PSI_TRIGGER) is used where the kernel permits it. Otherwise the
+// "some" avg10 value is sampled once a second and compared against
+// IODLR_PSI_THRESHOLD.
+static void* watchMemoryPressure(void* data) {
+  const char* trigger = secure_getenv("IODLR_PSI_TRIGGER");
+  const char* threshold_str = secure_getenv("IODLR_PSI_THRESHOLD");
+  const char* calm_str = secure_getenv("IODLR_PSI_CALM");
+  double threshold =
+      (threshold_str ? atof(threshold_str) : PSI_DEFAULT_THRESHOLD);
+  int calm_seconds = (calm_str ? atoi(calm_str) : PSI_DEFAULT_CALM_SECONDS);
+  int calm = 0;
+
+  if (trigger == NULL) trigger = PSI_DEFAULT_TRIGGER;
+  if (calm_seconds <= 0) calm_seconds = PSI_DEFAULT_CALM_SECONDS;
+
+  struct pollfd pfd = {
+    open(PSI_MEMORY_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC), POLLPRI, 0
+  };
+  if (pfd.fd >= 0 && write(pfd.fd, trigger, strlen(trigger) + 1) < 0) {
+    close(pfd.fd);
+    pfd.fd = -1;
+  }
+
+  markRegionsIdle();
+  for (;;) {
+    bool pressure;
+    if (pfd.fd >= 0) {
+      int ret = poll(&pfd, 1, calm_seconds * 1000);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0 || (pfd.revents & POLLERR)) break;
+      pressure = (ret > 0);
+      calm = (pressure ? 0 : calm_seconds);
+    } else {
+      double avg10;
+      sleep(1);
+      if (!readMemoryPressure(&avg10)) break;
+      pressure = (avg10 >= threshold);
+      calm = (pressure ? 0 : calm + 1);
+    }
+
+    IODLR_PROBE2(memory_pressure, pressure, calm);
+    if (pressure) {
+      demoteColdestRegion();
+    } else if (calm >= calm_seconds) {
+      promoteHottestRegion();
+      calm = 0;
+    }
+    markRegionsIdle();
+  }
+
+  fprintf(stderr, "Memory pressure information unavailable, "
+                  "no longer watching it\n");
+  return NULL;
+}
+
+static void startMemoryPressureWatcher() {
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, watchMemoryPressure, NULL) != 0) {
+    fprintf(stderr, "Failed to start the memory pressure watcher\n");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void __attribute__((destructor)) report_remap_counters() {
+  if (secure_getenv("IODLR_PSI") != NULL) {
+    remap_counters counters;
+    GetRemapCounters(&counters);
+    fprintf(stderr, "Large page demotions: %lu, promotions: %lu\n",
+            counters.demotions, counters.promotions);
+  }
+}
+
+// Whether other threads are running, i.e. the library was not preloaded but
+// loaded into a running process with dlopen(), e.g. by iodlr-remap.
+static bool hasOtherThreads() {
+  struct dirent* entry;
+  int threads = 0;
+
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == NULL) return false;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') threads++;
+  }
+  closedir(dir);
+  return threads > 1;
+}
 
 void __attribute__((constructor)) map_to_large_pages() {
   bool is_enabled = true;
   fprintf(stderr, "TID: %d\n:", gettid());
+  IODLR_PROBE(preload_entry);
   map_status status = IsLargePagesEnabled(&is_enabled);
+  IODLR_PROBE2(preload_enabled, status, is_enabled);
   if (status != map_ok) goto fail;
 
   if (!is_enabled) goto fail;
 
-  status = MapStaticCodeToLargePages();
-  if (status != map_ok) {
-    printErr(status, "static code");
+  // A policy that cannot be read moves nothing rather than everything.
+  const char* config = secure_getenv("IODLR_CONFIG");
+  if (config != NULL && (policy = LoadPolicy(config)) == NULL) return;
+  dry_run = (IsPolicyDryRun(policy) || secure_getenv("IODLR_DRY_RUN") != NULL);
+
+  large_pages_enabled = true;
+  if (secure_getenv("IODLR_TEXT_SECTION") != NULL) {
+    SetTextSectionLookup(true);
   }
+  if (secure_getenv("IODLR_PERF_MAP") != NULL) {
+    SetPerfMapEnabled(true);
+  }
+  if (secure_getenv("IODLR_GDB_JIT") != NULL) {
+    SetDebuggerRegistrationEnabled(true);
+  }
+  // Code cannot be moved safely from here while other threads run. A remap
+  // delay, signal or the auto-tuner still remap from their own thread;
+  // otherwise leave it to iodlr_remap_now() or to whoever loaded the library.
+  if (hasOtherThreads()) {
+    SetThreadSafeRemap(true);
+    deferRemap();
+  } else if (!deferRemap()) {
+    pthread_mutex_lock(&remap_lock);
+    status = mapAllToLargePages();
+    writeRemapReport();
+    pthread_mutex_unlock(&remap_lock);
+  }
+  IODLR_PROBE1(preload_return, status);
 
-  regex_t ignoreReg;
-  const char * ignoreStr = secure_getenv("LP_IGNORE");
-  if (ignoreStr == NULL || regcomp(&ignoreReg, ignoreStr, REG_EXTENDED) != 0) {
-    dl_iterate_phdr(tryMapAllDSOs, NULL);
-  } else {
-    dl_iterate_phdr(tryMapAllDSOs, &ignoreReg);
-    regfree(&ignoreReg);
+  if (secure_getenv("IODLR_PSI") != NULL) {
+    startMemoryPressureWatcher();
   }
 
   return;
@@ -0,0 +1,45 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+
+#ifndef LP_PRELOAD_H_
+#define LP_PRELOAD_H_
+
+#include "large_page.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Exported by liblppreload.so. Moves the executable and all DSOs loaded so
+// far to large pages now, e.g. once the application has warmed up; see
+// README.md. Declared weak so that programs also run without the library
+// preloaded, in which case the address is NULL:
+//
+//   if (iodlr_remap_now) iodlr_remap_now();
+map_status iodlr_remap_now(void) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LP_PRELOAD_H_
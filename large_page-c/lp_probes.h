@@ -0,0 +1,113 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+#ifndef LP_PROBES_H_
+#define LP_PROBES_H_
+
+// USDT probes of the "iodlr" provider, for use with bpftrace, perf and
+// SystemTap, e.g. `bpftrace -e 'usdt:./liblppreload.so:iodlr:* { ... }'`.
+// A probe is a single nop plus an ELF note describing where its arguments
+// live, so it costs nothing while no tracer is attached. Arguments must be
+// integers or pointers; strings are passed as pointers.
+//
+// <sys/sdt.h> is used where it is installed. Otherwise the notes are emitted
+// directly in the same format on x86-64 and aarch64, and probes compile to
+// nothing elsewhere or if IODLR_NO_PROBES is defined.
+
+#if !defined(IODLR_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define IODLR_PROBES_SDT 1
+#elif (defined(__x86_64__) || defined(__aarch64__)) && defined(__GNUC__)
+#define IODLR_PROBES_BUILTIN 1
+#endif
+#endif
+
+#if defined(IODLR_PROBES_SDT)
+
+#define IODLR_PROBE(name) DTRACE_PROBE(iodlr, name)
+#define IODLR_PROBE1(name, a1) DTRACE_PROBE1(iodlr, name, a1)
+#define IODLR_PROBE2(name, a1, a2) DTRACE_PROBE2(iodlr, name, a1, a2)
+#define IODLR_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(iodlr, name, a1, a2, a3)
+#define IODLR_PROBE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4(iodlr, name, a1, a2, a3, a4)
+
+#elif defined(IODLR_PROBES_BUILTIN)
+
+// The layout of a `.note.stapsdt` entry: the probe address, the address of
+// `_.stapsdt.base` (to detect prelinking), the semaphore address (none), and
+// the provider, probe name and argument description strings. Every argument
+// is passed as a signed 64-bit value.
+#define IODLR_SDT_NOTE(name, args)                                        \
+  "990: nop\n"                                                            \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+  ".balign 4\n"                                                           \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+  "991: .asciz \"stapsdt\"\n"                                             \
+  "992: .balign 4\n"                                                      \
+  "993: .8byte 990b\n"                                                    \
+  ".8byte _.stapsdt.base\n"                                               \
+  ".8byte 0\n"                                                            \
+  ".asciz \"iodlr\"\n"                                                    \
+  ".asciz \"" #name "\"\n"                                                \
+  ".asciz \"" args "\"\n"                                                 \
+  "994: .balign 4\n"                                                      \
+  ".popsection\n"                                                         \
+  ".ifndef _.stapsdt.base\n"                                              \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+  ".weak _.stapsdt.base\n"                                                \
+  ".hidden _.stapsdt.base\n"                                              \
+  "_.stapsdt.base: .space 1\n"                                            \
+  ".size _.stapsdt.base, 1\n"                                             \
+  ".popsection\n"                                                         \
+  ".endif\n"
+
+#define IODLR_SDT_ARG(a) "nor"((long long)(a))
+
+#define IODLR_PROBE(name) \
+  __asm__ __volatile__(IODLR_SDT_NOTE(name, ""))
+#define IODLR_PROBE1(name, a1)                   \
+  __asm__ __volatile__(IODLR_SDT_NOTE(name, "-8@%0") \
+                       :: IODLR_SDT_ARG(a1))
+#define IODLR_PROBE2(name, a1, a2)                         \
+  __asm__ __volatile__(IODLR_SDT_NOTE(name, "-8@%0 -8@%1") \
+                       :: IODLR_SDT_ARG(a1), IODLR_SDT_ARG(a2))
+#define IODLR_PROBE3(name, a1, a2, a3)                           \
+  __asm__ __volatile__(IODLR_SDT_NOTE(name, "-8@%0 -8@%1 -8@%2") \
+                       :: IODLR_SDT_ARG(a1), IODLR_SDT_ARG(a2),  \
+                          IODLR_SDT_ARG(a3))
+#define IODLR_PROBE4(name, a1, a2, a3, a4)                             \
+  __asm__ __volatile__(IODLR_SDT_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3") \
+                       :: IODLR_SDT_ARG(a1), IODLR_SDT_ARG(a2),        \
+                          IODLR_SDT_ARG(a3), IODLR_SDT_ARG(a4))
+
+#else
+
+#define IODLR_PROBE(name) do {} while (0)
+#define IODLR_PROBE1(name, a1) do {} while (0)
+#define IODLR_PROBE2(name, a1, a2) do {} while (0)
+#define IODLR_PROBE3(name, a1, a2, a3) do {} while (0)
+#define IODLR_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+
+#endif
+
+#endif  // LP_PROBES_H_
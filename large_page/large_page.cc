@@ -21,15 +21,21 @@
 // SPDX-License-Identifier: MIT
 
 #include "large_page.h"
+#include "../large_page-c/lp_probes.h"
 
+#include <link.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <climits>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <regex>
+#include <vector>
 #include <inttypes.h>
 
 extern char __attribute__((weak))  __textsegment;
@@ -44,6 +50,7 @@ namespace largepage {
   using std::cerr;
   using std::regex;
   using std::smatch;
+  using std::vector;
 
 
 namespace {
@@ -66,6 +73,16 @@ constexpr uintptr_t LargePageAlignUp(uintptr_t addr) {
   return LargePageAlignDown(addr + hps - 1);
 }
 
+vector<RemapReport> remap_reports;
+
+// Always inlined, because it is also used by `MoveRegionToLargePages`, which
+// must not call code that might be moved.
+inline __attribute__((__always_inline__)) uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 // Identify and return the text region in the currently mapped memory regions.
 MapStatus FindTextRegion(MemRange* region, const string& regexpr = "") {
   string exename;
@@ -74,14 +91,20 @@ MapStatus FindTextRegion(MemRange* region, const string& regexpr = "") {
   bool result;
   char selfexe[PATH_MAX] = {0};
 
+  IODLR_PROBE1(find_text_region_entry, regexpr.c_str());
+
   ifstream ifs("/proc/self/maps");
 
   if (!ifs) {
+    IODLR_PROBE4(find_text_region_return, regexpr.c_str(),
+                 map_maps_open_failed, 0, 0);
     return map_maps_open_failed;
   }
 
   ssize_t count = readlink("/proc/self/exe", selfexe, PATH_MAX);
   if (count < 0) {
+    IODLR_PROBE4(find_text_region_return, regexpr.c_str(),
+                 map_exe_path_read_failed, 0, 0);
     return map_exe_path_read_failed;
   }
   exename.assign(selfexe, count);
@@ -120,13 +143,138 @@ MapStatus FindTextRegion(MemRange* region, const string& regexpr = "") {
       if (result) {
         region->set(reinterpret_cast<void*>(start),
                     reinterpret_cast<void*>(end));
+        IODLR_PROBE4(find_text_region_return, regexpr.c_str(), map_ok,
+                     start, end);
         return map_ok;
       }
     }
   }
+  IODLR_PROBE4(find_text_region_return, regexpr.c_str(),
+               map_region_not_found, 0, 0);
   return map_region_not_found;
 }
 
+// The layout of the `.note.iodlr` remap plan written by
+// tools/add-remap-note.py. It is the same as the one documented in
+// large_page-c/large_page.h.
+constexpr char note_name[] = "iodlr";
+constexpr uint32_t note_type_remap_plan = 1;
+constexpr uint32_t remap_plan_version = 1;
+
+struct RemapPlanHeader {
+  uint32_t version;
+  uint32_t min_coverage;
+  uint32_t range_count;
+  uint32_t reserved;
+};
+
+struct RemapPlanRange {
+  uint64_t from;
+  uint64_t to;
+  uint64_t page_size;
+};
+
+struct RemapPlan {
+  uintptr_t base = 0;
+  const ElfW(Phdr)* phdr = nullptr;
+  ElfW(Half) phnum = 0;
+  uint32_t min_coverage = 0;
+  vector<RemapPlanRange> ranges;
+};
+
+struct FindPlanParams {
+  const string& regexpr;
+  const regex& lib_regex;
+  RemapPlan* plan;
+  bool found;
+};
+
+// Find the first ELF note with the given name and type in the PT_NOTE segments
+// of a loaded object and return its descriptor, or nullptr.
+const char* FindNote(const dl_phdr_info* hdr, const char* note_name,
+                     uint32_t note_type, ElfW(Word)* desc_size) {
+  size_t name_size = strlen(note_name) + 1;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum; idx++) {
+    const ElfW(Phdr)& phdr = hdr->dlpi_phdr[idx];
+    if (phdr.p_type != PT_NOTE) continue;
+
+    size_t align = (phdr.p_align == 8 ? 8 : 4);
+    auto align_up = [align](size_t n) {
+      return (n + align - 1) & ~(align - 1);
+    };
+    const char* note = reinterpret_cast<const char*>(hdr->dlpi_addr +
+                                                     phdr.p_vaddr);
+    const char* end = note + phdr.p_memsz;
+
+    while (static_cast<size_t>(end - note) >= sizeof(ElfW(Nhdr))) {
+      ElfW(Nhdr) nhdr;
+      memcpy(&nhdr, note, sizeof(nhdr));
+      const char* name = note + sizeof(nhdr);
+      const char* desc = name + align_up(nhdr.n_namesz);
+      const char* next = desc + align_up(nhdr.n_descsz);
+      if (next > end || next <= note) break;
+
+      if (nhdr.n_type == note_type && nhdr.n_namesz == name_size &&
+          memcmp(name, note_name, name_size) == 0) {
+        *desc_size = nhdr.n_descsz;
+        return desc;
+      }
+      note = next;
+    }
+  }
+  return nullptr;
+}
+
+// Read the remap plan, if any, from the PT_NOTE segments of a loaded object.
+bool ReadRemapPlan(const dl_phdr_info* hdr, RemapPlan* plan) {
+  ElfW(Word) desc_size;
+  const char* desc = FindNote(hdr, note_name, note_type_remap_plan,
+                              &desc_size);
+  RemapPlanHeader header;
+
+  if (desc == nullptr || desc_size < sizeof(header)) return false;
+
+  memcpy(&header, desc, sizeof(header));
+  if (header.version != remap_plan_version ||
+      header.range_count > (desc_size - sizeof(header)) /
+                           sizeof(RemapPlanRange)) {
+    return false;
+  }
+  plan->base = hdr->dlpi_addr;
+  plan->phdr = hdr->dlpi_phdr;
+  plan->phnum = hdr->dlpi_phnum;
+  plan->min_coverage = header.min_coverage;
+  plan->ranges.resize(header.range_count);
+  memcpy(plan->ranges.data(), desc + sizeof(header),
+         header.range_count * sizeof(RemapPlanRange));
+  return true;
+}
+
+int FindRemapPlanCallback(dl_phdr_info* hdr, size_t size, void* data) {
+  FindPlanParams* params = static_cast<FindPlanParams*>(data);
+  bool match;
+
+  if (params->regexpr.size() == 0) {
+    match = (hdr->dlpi_name[0] == 0);
+  } else {
+    match = regex_search(hdr->dlpi_name, params->lib_regex);
+  }
+  if (!match) return 0;
+
+  params->found = ReadRemapPlan(hdr, params->plan);
+  return 1;
+}
+
+// Look for a remap plan embedded in the main executable or, if a regular
+// expression is given, in the first loaded object whose name matches it.
+bool FindRemapPlan(const string& regexpr, RemapPlan* plan) {
+  regex lib_regex(regexpr);
+  FindPlanParams params = { regexpr, lib_regex, plan, false };
+  dl_iterate_phdr(FindRemapPlanCallback, &params);
+  return params.found;
+}
+
 MapStatus IsTransparentHugePagesEnabled(bool* result) {
 #if defined(ENABLE_LARGE_CODE_PAGES) && ENABLE_LARGE_CODE_PAGES
   *result = false;
@@ -177,7 +325,7 @@ MapStatus
 __attribute__((__section__(".lpstub")))
 __attribute__((__aligned__(hps)))
 __attribute__((__noinline__))
-MoveRegionToLargePages(const MemRange& r) {
+MoveRegionToLargePages(const MemRange& r, RemapTimings* timings) {
   void* nmem = nullptr;
   void* tmem = nullptr;
   int ret = 0;
@@ -185,15 +333,22 @@ MoveRegionToLargePages(const MemRange& r) {
   void* start = r.from;
   size_t size = reinterpret_cast<size_t>(r.to) -
                 reinterpret_cast<size_t>(r.from);
+  uint64_t begin = NowNs();
+
+  IODLR_PROBE2(move_region_entry, start, size);
 
 // Allocate temporary region preparing for copy
   nmem = mmap(nullptr, size,
               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (nmem == MAP_FAILED) {
+    IODLR_PROBE3(move_region_return, start, size, map_see_errno);
     return map_see_errno;
   }
+  timings->mmap += NowNs() - begin;
 
+  begin = NowNs();
   memcpy(nmem, r.from, size);
+  timings->copy += NowNs() - begin;
 
 // We already know the original page is r-xp
 // (PROT_READ, PROT_EXEC, MAP_PRIVATE)
@@ -206,13 +361,16 @@ MoveRegionToLargePages(const MemRange& r) {
     if (ret < 0) {                                      \
       status = oper##_munmap_nmem_failed;               \
     }                                                   \
+    IODLR_PROBE3(move_region_return, start, size, status); \
     return status;                                      \
   }
 
+  begin = NowNs();
   tmem = mmap(start, size,
               PROT_READ | PROT_WRITE | PROT_EXEC,
               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1 , 0);
 CLEAN_EXIT_CHECK(map_see_errno_mmap_tmem);
+  timings->mmap += NowNs() - begin;
 
 #undef CLEAN_EXIT_CHECK
 
@@ -229,15 +387,23 @@ CLEAN_EXIT_CHECK(map_see_errno_mmap_tmem);
         ? oper##_munmaps_failed                         \
         : oper##_munmap_nmem_failed;                    \
     }                                                   \
+    IODLR_PROBE3(move_region_return, start, size, status); \
     return status;                                      \
   }
 
+  begin = NowNs();
   ret = madvise(tmem, size, MADV_HUGEPAGE);
   CLEAN_EXIT_CHECK(map_see_errno_madvise_tmem);
+  timings->madvise += NowNs() - begin;
 
+  begin = NowNs();
   memcpy(start, nmem, size);
+  timings->copy += NowNs() - begin;
+
+  begin = NowNs();
   ret = mprotect(start, size, PROT_READ | PROT_EXEC);
   CLEAN_EXIT_CHECK(map_see_errno_mprotect);
+  timings->mprotect += NowNs() - begin;
 
 #undef CLEAN_EXIT_CHECK
 
@@ -247,6 +413,7 @@ CLEAN_EXIT_CHECK(map_see_errno_mmap_tmem);
     status = map_see_errno_munmap_nmem_failed;
   }
 
+  IODLR_PROBE3(move_region_return, start, size, status);
   return status;
 }
 
@@ -271,21 +438,148 @@ MapStatus CheckMemRange(const MemRange& r) {
   return map_ok;
 }
 
+struct FindObjectParams {
+  uintptr_t addr;
+  RemapReport* report;
+};
+
+// Fill in the name and GNU build-id of the loaded object that contains the
+// region of a report.
+int FindReportObject(dl_phdr_info* hdr, size_t size, void* data) {
+  FindObjectParams* params = static_cast<FindObjectParams*>(data);
+  bool found = false;
+
+  for (ElfW(Half) idx = 0; idx < hdr->dlpi_phnum && !found; idx++) {
+    const ElfW(Phdr)& phdr = hdr->dlpi_phdr[idx];
+    uintptr_t start = hdr->dlpi_addr + phdr.p_vaddr;
+    found = (phdr.p_type == PT_LOAD &&
+             params->addr >= start && params->addr < start + phdr.p_memsz);
+  }
+  if (!found) return 0;
+
+  if (hdr->dlpi_name[0] == 0) {
+    char selfexe[PATH_MAX];
+    ssize_t count = readlink("/proc/self/exe", selfexe, PATH_MAX);
+    if (count > 0) params->report->object.assign(selfexe, count);
+  } else {
+    params->report->object = hdr->dlpi_name;
+  }
+
+  ElfW(Word) desc_size;
+  const char* desc = FindNote(hdr, "GNU", NT_GNU_BUILD_ID, &desc_size);
+  if (desc != nullptr) {
+    for (ElfW(Word) idx = 0; idx < desc_size; idx++) {
+      char hex[3];
+      snprintf(hex, sizeof(hex), "%02x", static_cast<uint8_t>(desc[idx]));
+      params->report->build_id += hex;
+    }
+  }
+  return 1;
+}
+
 // Align the region to to be mapped to 2MB page boundaries and then move the
-// region to large pages.
-MapStatus AlignMoveRegionToLargePages(MemRange r) {
+// region to large pages. The outcome is recorded in a remap report, to which
+// `discovery_ns` is credited as the time it took to find the region.
+MapStatus AlignMoveRegionToLargePages(MemRange r, uint64_t discovery_ns = 0) {
+  RemapReport report;
+  rusage before, after;
+
+  report.original_from = r.from;
+  report.original_to = r.to;
+  report.timings_ns.discovery = discovery_ns;
+  getrusage(RUSAGE_THREAD, &before);
+
   AlignRegionToPageBoundary(&r);
 
   MapStatus status = CheckMemRange(r);
-  if (status != map_ok) {
-    return status;
+  if (status == map_ok) {
+    if (r.to <= (void*)MoveRegionToLargePages) {
+      status = MoveRegionToLargePages(r, &report.timings_ns);
+    } else {
+      status = map_mover_overlaps;
+    }
   }
 
-  if (r.to <= (void*)MoveRegionToLargePages) {
-    return MoveRegionToLargePages(r);
+  getrusage(RUSAGE_THREAD, &after);
+  uintptr_t original_size = reinterpret_cast<uintptr_t>(report.original_to) -
+                            reinterpret_cast<uintptr_t>(report.original_from);
+  if (r.from < r.to) {
+    report.aligned_from = r.from;
+    report.aligned_to = r.to;
+  }
+  if (status == map_ok) {
+    report.bytes_covered = reinterpret_cast<uintptr_t>(r.to) -
+                           reinterpret_cast<uintptr_t>(r.from);
+    report.large_page_size = hps;
+  }
+  if (report.original_to > report.original_from) {
+    report.bytes_skipped = original_size - report.bytes_covered;
   }
+  if (report.bytes_skipped > 0) {
+    report.small_page_size = sysconf(_SC_PAGESIZE);
+  }
+  IODLR_PROBE3(remap_region, report.original_from, report.original_to, status);
+  report.minor_faults = after.ru_minflt - before.ru_minflt;
+  report.major_faults = after.ru_majflt - before.ru_majflt;
+  report.status = status;
+
+  FindObjectParams params = { reinterpret_cast<uintptr_t>(report.original_from),
+                              &report };
+  dl_iterate_phdr(FindReportObject, &params);
+  remap_reports.push_back(report);
 
-  return map_mover_overlaps;
+  return status;
+}
+
+// Clip a plan range to the executable PT_LOAD segment it starts in, so that a
+// stale or mistaken plan can never make us copy memory that is not mapped.
+bool ClipToTextSegment(const RemapPlan& plan, RemapPlanRange* range) {
+  for (ElfW(Half) idx = 0; idx < plan.phnum; idx++) {
+    const ElfW(Phdr)& phdr = plan.phdr[idx];
+    if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) &&
+        range->from >= phdr.p_vaddr &&
+        range->from < phdr.p_vaddr + phdr.p_memsz) {
+      if (range->to > phdr.p_vaddr + phdr.p_memsz) {
+        range->to = phdr.p_vaddr + phdr.p_memsz;
+      }
+      return range->to > range->from;
+    }
+  }
+  return false;
+}
+
+// Move the hot ranges listed in a remap plan to large pages. Ranges with a
+// preferred page size below the large page size, or whose large page aligned
+// portion covers less than the plan's minimum coverage, stay on small pages.
+MapStatus ApplyRemapPlan(const RemapPlan& plan, uint64_t discovery_ns) {
+  MapStatus status = map_region_too_small;
+
+  for (RemapPlanRange range : plan.ranges) {
+    if ((range.page_size != 0 && range.page_size < hps) ||
+        !ClipToTextSegment(plan, &range)) {
+      continue;
+    }
+
+    uintptr_t from = LargePageAlignUp(plan.base + range.from);
+    uintptr_t to = LargePageAlignDown(plan.base + range.to);
+    uint64_t covered = (to > from ? to - from : 0);
+    if (covered * 100 <
+        static_cast<uint64_t>(plan.min_coverage) * (range.to - range.from)) {
+      continue;
+    }
+
+    MapStatus range_status = AlignMoveRegionToLargePages(
+        MemRange(reinterpret_cast<void*>(plan.base + range.from),
+                 reinterpret_cast<void*>(plan.base + range.to)),
+        discovery_ns);
+    if (range_status == map_ok) {
+      status = map_ok;
+    } else if (range_status != map_region_too_small) {
+      return range_status;
+    }
+  }
+
+  return status;
 }
 
 }  // namespace
@@ -298,6 +592,8 @@ MapStatus AlignMoveRegionToLargePages(MemRange r) {
 //    * Modify the start address to point to the very beginning of .text segment
 //      (from variable textsegment setup in ld.script).
 //    * Align the address of start and end addresses to large page boundaries.
+//    * If the binary carries a `.note.iodlr` remap plan, use the hot ranges it
+//      lists instead.
 //
 // 2: Move the text region to large pages
 //    * Map a new area and copy the original code there.
@@ -307,12 +603,18 @@ MapStatus AlignMoveRegionToLargePages(MemRange r) {
 //    * If successful, copy the code to the newly mapped area and unmap the
 //      original region.
 MapStatus MapStaticCodeToLargePages(const std::string& regexpr) {
+  uint64_t begin = NowNs();
+  RemapPlan plan;
+  if (FindRemapPlan(regexpr, &plan)) {
+    return ApplyRemapPlan(plan, NowNs() - begin);
+  }
+
   MemRange r;
   MapStatus status = FindTextRegion(&r, regexpr);
   if (status != map_ok) {
     return status;
   }
-  return AlignMoveRegionToLargePages(r);
+  return AlignMoveRegionToLargePages(r, NowNs() - begin);
 }
 
 // This function is similar to the function above. However, the region to be
@@ -321,6 +623,11 @@ MapStatus MapStaticCodeToLargePages(void* from, void* to) {
   return AlignMoveRegionToLargePages(MemRange(from, to));
 }
 
+// Reports on every attempt to move a region to large pages so far, in order.
+const vector<RemapReport>& GetRemapReports() {
+  return remap_reports;
+}
+
 MapStatus IsLargePagesEnabled(bool* result) {
   return IsTransparentHugePagesEnabled(result);
 }
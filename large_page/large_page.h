@@ -23,7 +23,9 @@
 #ifndef LARGE_PAGE_H_
 #define LARGE_PAGE_H_
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace largepage {
     using std::string;
@@ -56,9 +58,41 @@ namespace largepage {
         map_unsupported_platform,
     };
 
+    // Time spent in each step of moving a region, in nanoseconds. Discovery
+    // covers finding the text region or remap plan and is shared by all the
+    // regions moved from one plan.
+    struct RemapTimings {
+        uint64_t discovery = 0;
+        uint64_t copy = 0;
+        uint64_t mmap = 0;
+        uint64_t madvise = 0;
+        uint64_t mprotect = 0;
+    };
+
+    // The outcome of one attempt to move a region to large pages. The original
+    // range is the one asked for and the aligned range the large page aligned
+    // part of it that was actually moved.
+    struct RemapReport {
+        string object;
+        string build_id;  // hexadecimal GNU build-id, if any
+        void* original_from = nullptr;
+        void* original_to = nullptr;
+        void* aligned_from = nullptr;
+        void* aligned_to = nullptr;
+        uint64_t bytes_covered = 0;
+        uint64_t bytes_skipped = 0;
+        uint64_t large_page_size = 0;
+        uint64_t small_page_size = 0;
+        RemapTimings timings_ns;
+        uint64_t minor_faults = 0;
+        uint64_t major_faults = 0;
+        MapStatus status = map_ok;
+    };
+
     MapStatus MapStaticCodeToLargePages(const std::string& regexpr = "");
     MapStatus MapStaticCodeToLargePages(void* from, void* to);
     MapStatus IsLargePagesEnabled(bool* result);
+    const std::vector<RemapReport>& GetRemapReports();
     const string& MapStatusStr(MapStatus status, bool fulltext = true);
 };  // namespace largepage
 
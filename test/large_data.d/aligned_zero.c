@@ -0,0 +1,76 @@
+// Copyright (C) 2018 Intel Corporation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+// OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// SPDX-License-Identifier: MIT
+
+// Zero size allocations with an alignment above 16 bytes must not share
+// memory with each other or with the allocations that follow them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ALIGNED 64
+#define SMALL   256
+#define BLOCKS  (ALIGNED * 8 + SMALL)
+
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+} block;
+
+static int CompareBlocks(const void* a, const void* b) {
+  uintptr_t x = ((const block*)a)->start;
+  uintptr_t y = ((const block*)b)->start;
+  return x < y ? -1 : x > y;
+}
+
+int main(void) {
+  static block blocks[BLOCKS];
+  int count = 0;
+  int misaligned = 0;
+
+  for (size_t alignment = 32; alignment <= 4096; alignment *= 2) {
+    for (int i = 0; i < ALIGNED; i++) {
+      void* p;
+      if (posix_memalign(&p, alignment, 0) != 0) {
+        printf("posix_memalign(%zu, 0) failed\n", alignment);
+        return 1;
+      }
+      misaligned += (uintptr_t)p % alignment != 0;
+      blocks[count].start = (uintptr_t)p;
+      blocks[count++].end = (uintptr_t)p + 1;
+    }
+  }
+  for (int i = 0; i < SMALL; i++) {
+    char* p = malloc(16);
+    blocks[count].start = (uintptr_t)p;
+    blocks[count++].end = (uintptr_t)p + 16;
+  }
+
+  qsort(blocks, count, sizeof(block), CompareBlocks);
+  int overlapping = 0;
+  for (int i = 1; i < count; i++) {
+    overlapping += blocks[i].start < blocks[i - 1].end;
+  }
+  printf("misaligned blocks: %d\n", misaligned);
+  printf("overlapping blocks: %d\n", overlapping);
+  return 0;
+}
@@ -0,0 +1,149 @@
+#!/usr/bin/python3
+#
+# Embed a remap plan into an executable or DSO as a `.note.iodlr` ELF note.
+# The large page runtimes in large_page-c and large_page read the note from
+# the PT_NOTE segments of each loaded object and move only the listed hot
+# ranges to large pages. The note format is described in large_page-c/
+# large_page.h.
+#
+import argparse
+import shutil
+import struct
+import sys
+
+from elf_file import ElfError, ElfFile, PF_X, STT_FUNC
+
+NOTE_NAME = "iodlr"
+NOTE_SECTION = ".note.iodlr"
+NT_IODLR_REMAP_PLAN = 1
+REMAP_PLAN_VERSION = 1
+
+PLAN_HEADER = struct.Struct("<IIII")
+PLAN_RANGE = struct.Struct("<QQQ")
+
+SIZE_SUFFIXES = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+
+
+def parse_size(text):
+    text = text.strip().upper().rstrip("B")
+    if text and text[-1] in SIZE_SUFFIXES:
+        return int(text[:-1], 0) * SIZE_SUFFIXES[text[-1]]
+    return int(text, 0)
+
+
+def split_page_size(spec, default):
+    if "@" in spec:
+        spec, size = spec.rsplit("@", 1)
+        return spec, parse_size(size)
+    return spec, default
+
+
+def resolve_symbols(elf, names):
+    wanted = set(names)
+    found = {}
+    for name, value, size, stype in elf.symbols():
+        if name in wanted and stype == STT_FUNC and size > 0:
+            found.setdefault(name, (value, value + size))
+    missing = wanted - set(found)
+    if missing:
+        raise ElfError("symbols not found: %s" % ", ".join(sorted(missing)))
+    return found
+
+
+def check_ranges(elf, ranges):
+    text = [(seg.vaddr, seg.vaddr + seg.memsz) for seg in elf.loads()
+            if seg.flags & PF_X]
+    for start, end, _ in ranges:
+        if not any(lo <= start < end <= hi for lo, hi in text):
+            raise ElfError("range %#x-%#x is not inside an executable "
+                           "segment" % (start, end))
+
+
+def merge_ranges(ranges, gap):
+    merged = []
+    for start, end, page_size in sorted(ranges):
+        if (merged and merged[-1][2] == page_size and
+                start <= merged[-1][1] + gap):
+            merged[-1][1] = max(merged[-1][1], end)
+        else:
+            merged.append([start, end, page_size])
+    return merged
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Write a .note.iodlr remap plan into an ELF binary.")
+    parser.add_argument("binary", help="executable or shared object")
+    parser.add_argument("-o", "--output", required=True,
+                        help="output file, may be the same as the input")
+    parser.add_argument("--range", action="append", default=[],
+                        metavar="FROM-TO[@SIZE]",
+                        help="hot virtual address range, relative to the "
+                             "object's load base")
+    parser.add_argument("--symbol", action="append", default=[],
+                        metavar="NAME[@SIZE]", help="hot function")
+    parser.add_argument("--symbols-file", metavar="FILE",
+                        help="file with one hot function per line")
+    parser.add_argument("--page-size", default="2M", type=parse_size,
+                        help="default preferred page size (default: 2M)")
+    parser.add_argument("--merge-gap", default="0", type=parse_size,
+                        help="merge ranges closer than this (default: 0)")
+    parser.add_argument("--min-coverage", default=0, type=int,
+                        metavar="PERCENT",
+                        help="minimum share of a range that must be covered "
+                             "by large pages for it to be moved")
+    args = parser.parse_args()
+
+    if not 0 <= args.min_coverage <= 100:
+        parser.error("--min-coverage must be between 0 and 100")
+
+    try:
+        elf = ElfFile(args.binary)
+
+        ranges = []
+        for spec in args.range:
+            spec, page_size = split_page_size(spec, args.page_size)
+            start, end = (parse_size(part) for part in spec.split("-", 1))
+            ranges.append((start, end, page_size))
+
+        symbols = [split_page_size(s, args.page_size) for s in args.symbol]
+        if args.symbols_file:
+            with open(args.symbols_file) as f:
+                symbols += [split_page_size(line.strip(), args.page_size)
+                            for line in f
+                            if line.strip() and not line.startswith("#")]
+        if symbols:
+            found = resolve_symbols(elf, [name for name, _ in symbols])
+            ranges += [found[name] + (page_size,)
+                       for name, page_size in symbols]
+
+        if not ranges:
+            parser.error("no hot ranges given")
+
+        ranges = merge_ranges(ranges, args.merge_gap)
+        check_ranges(elf, ranges)
+        desc = PLAN_HEADER.pack(REMAP_PLAN_VERSION, args.min_coverage,
+                                len(ranges), 0)
+        desc += b"".join(PLAN_RANGE.pack(*r) for r in ranges)
+
+        if not elf.replace_note(NOTE_NAME, NT_IODLR_REMAP_PLAN, desc):
+            if any(name == NOTE_NAME for _, _, name, _, _ in elf.notes()):
+                raise ElfError("%s already has a larger remap plan; start "
+                               "from the original binary" % args.binary)
+            elf.add_note(NOTE_NAME, NT_IODLR_REMAP_PLAN, desc, NOTE_SECTION)
+
+        elf.save(args.output)
+        shutil.copymode(args.binary, args.output)
+    except (ElfError, OSError, ValueError) as e:
+        print("error: %s" % e, file=sys.stderr)
+        return 1
+
+    for start, end, page_size in ranges:
+        print("range %#x-%#x page size %d" % (start, end, page_size))
+    print("wrote %s: %d bytes (%+d)" % (args.output, len(elf.data),
+                                        len(elf.data) - elf.original_size))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
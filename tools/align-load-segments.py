@@ -0,0 +1,109 @@
+#!/usr/bin/python3
+#
+# Raise the p_align of the PT_LOAD segments of an executable or DSO so that
+# glibc 2.35 and later, and the kernel for PIE executables, load it at a large
+# page aligned base address. File offsets are padded where they would not be
+# congruent with the virtual addresses at the new alignment. Virtual addresses
+# are left untouched, so no code or relocation changes.
+#
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+
+from elf_file import ET_DYN, ElfError, ElfFile, PF_X
+
+DEFAULT_INTERPRETER = "/lib64/ld-linux-x86-64.so.2"
+
+
+def parse_size(text):
+    suffixes = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    text = text.strip().upper().rstrip("B")
+    if text and text[-1] in suffixes:
+        return int(text[:-1], 0) * suffixes[text[-1]]
+    return int(text, 0)
+
+
+def glibc_version():
+    try:
+        name, version = os.confstr("CS_GNU_LIBC_VERSION").split()
+        return tuple(int(part) for part in version.split(".")[:2])
+    except (AttributeError, OSError, ValueError):
+        return None
+
+
+# Load the object with the dynamic loader in list mode, which maps it and its
+# dependencies without running any of its code.
+def load_check(interpreter, path):
+    try:
+        result = subprocess.run([interpreter, "--list", os.path.abspath(path)],
+                                stdout=subprocess.DEVNULL,
+                                stderr=subprocess.PIPE)
+    except OSError as e:
+        return None, str(e)
+    return result.returncode, result.stderr.decode(errors="replace").strip()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Raise PT_LOAD p_align so an ELF object loads large page "
+                    "aligned.")
+    parser.add_argument("binary", help="executable or shared object")
+    parser.add_argument("-o", "--output", required=True,
+                        help="output file, may be the same as the input")
+    parser.add_argument("--align", default="2M", type=parse_size,
+                        help="new segment alignment (default: 2M)")
+    parser.add_argument("--no-verify", action="store_true",
+                        help="do not check that the output still loads")
+    args = parser.parse_args()
+
+    if args.align & (args.align - 1) or args.align < 0x1000:
+        parser.error("--align must be a power of two of at least 4K")
+
+    try:
+        elf = ElfFile(args.binary)
+        if elf.e_type != ET_DYN:
+            print("warning: %s is not position independent; its load address "
+                  "is fixed and will not change" % args.binary,
+                  file=sys.stderr)
+        version = glibc_version()
+        if version is not None and version < (2, 35):
+            print("warning: glibc %d.%d ignores p_align when loading shared "
+                  "objects; 2.35 or later is needed" % version,
+                  file=sys.stderr)
+
+        padding = elf.realign_loads(args.align)
+        elf.save(args.output)
+        shutil.copymode(args.binary, args.output)
+    except (ElfError, OSError) as e:
+        print("error: %s" % e, file=sys.stderr)
+        return 1
+
+    for seg in elf.loads():
+        print("LOAD offset %#010x vaddr %#014x memsz %#010x align %#x%s" %
+              (seg.offset, seg.vaddr, seg.memsz, seg.align,
+               " (text)" if seg.flags & PF_X else ""))
+    print("wrote %s: %d bytes (%+d, %d bytes of padding)" %
+          (args.output, len(elf.data), len(elf.data) - elf.original_size,
+           padding))
+
+    if not args.no_verify:
+        interpreter = elf.interpreter() or DEFAULT_INTERPRETER
+        before, message = load_check(interpreter, args.binary)
+        if before != 0:
+            print("warning: cannot verify %s: %s does not load with %s%s" %
+                  (args.output, args.binary, interpreter,
+                   ": " + message if message else ""), file=sys.stderr)
+            return 2
+        after, message = load_check(interpreter, args.output)
+        if after != 0:
+            print("error: %s no longer loads: %s" % (args.output, message),
+                  file=sys.stderr)
+            return 1
+        print("verified: %s loads with %s" % (args.output, interpreter))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,337 @@
+#!/usr/bin/python3
+#
+# Minimal reader and rewriter for 64-bit little-endian ELF files, shared by the
+# binary rewriting tools in this directory. Only the parts of the format needed
+# to inspect symbols and notes and to add or move segments are handled.
+#
+import struct
+
+PT_LOAD = 1
+PT_DYNAMIC = 2
+PT_INTERP = 3
+PT_NOTE = 4
+PT_PHDR = 6
+
+PF_X = 1
+PF_W = 2
+PF_R = 4
+
+SHT_SYMTAB = 2
+SHT_NOTE = 7
+SHT_NOBITS = 8
+SHT_DYNSYM = 11
+
+SHF_ALLOC = 2
+
+STT_FUNC = 2
+
+ET_EXEC = 2
+ET_DYN = 3
+
+PAGE_SIZE = 0x1000
+
+EHDR = struct.Struct("<16sHHIQQQIHHHHHH")
+PHDR = struct.Struct("<IIQQQQQQ")
+SHDR = struct.Struct("<IIQQQQIIQQ")
+SYM = struct.Struct("<IBBHQQ")
+NHDR = struct.Struct("<III")
+
+
+class ElfError(Exception):
+    pass
+
+
+def align_up(value, alignment):
+    return (value + alignment - 1) & ~(alignment - 1)
+
+
+class Segment:
+    FIELDS = ("type", "flags", "offset", "vaddr", "paddr", "filesz", "memsz",
+              "align")
+
+    def __init__(self, *values):
+        for field, value in zip(self.FIELDS, values):
+            setattr(self, field, value)
+
+    def pack(self):
+        return PHDR.pack(*(getattr(self, field) for field in self.FIELDS))
+
+
+class Section:
+    FIELDS = ("name_idx", "type", "flags", "addr", "offset", "size", "link",
+              "info", "addralign", "entsize")
+
+    def __init__(self, *values):
+        for field, value in zip(self.FIELDS, values):
+            setattr(self, field, value)
+        self.name = ""
+
+    def pack(self):
+        return SHDR.pack(*(getattr(self, field) for field in self.FIELDS))
+
+
+class ElfFile:
+    def __init__(self, path):
+        self.path = path
+        with open(path, "rb") as f:
+            self.data = bytearray(f.read())
+        self.original_size = len(self.data)
+
+        if len(self.data) < EHDR.size or self.data[:4] != b"\x7fELF":
+            raise ElfError("%s: not an ELF file" % path)
+        if self.data[4] != 2 or self.data[5] != 1:
+            raise ElfError("%s: only 64-bit little-endian ELF is supported"
+                           % path)
+
+        (self.ident, self.e_type, self.e_machine, self.e_version,
+         self.e_entry, self.e_phoff, self.e_shoff, self.e_flags,
+         self.e_ehsize, self.e_phentsize, self.e_phnum, self.e_shentsize,
+         self.e_shnum, self.e_shstrndx) = EHDR.unpack_from(self.data, 0)
+
+        if self.e_type not in (ET_EXEC, ET_DYN):
+            raise ElfError("%s: not an executable or shared object" % path)
+
+        self.segments = [
+            Segment(*PHDR.unpack_from(self.data, self.e_phoff + i * PHDR.size))
+            for i in range(self.e_phnum)
+        ]
+
+        self.sections = []
+        if self.e_shoff != 0:
+            if self.e_shnum == 0 or self.e_shstrndx >= 0xff00:
+                raise ElfError("%s: extended section numbering is not "
+                               "supported" % path)
+            self.sections = [
+                Section(*SHDR.unpack_from(self.data,
+                                          self.e_shoff + i * SHDR.size))
+                for i in range(self.e_shnum)
+            ]
+            strtab = self.sections[self.e_shstrndx]
+            for section in self.sections:
+                section.name = self._string(strtab.offset + section.name_idx)
+
+    def _string(self, offset):
+        end = self.data.index(b"\0", offset)
+        return self.data[offset:end].decode("utf-8", "replace")
+
+    def interpreter(self):
+        for seg in self.segments:
+            if seg.type == PT_INTERP:
+                return bytes(self.data[seg.offset:seg.offset + seg.filesz]
+                             ).rstrip(b"\0").decode()
+        return None
+
+    def loads(self):
+        return [seg for seg in self.segments if seg.type == PT_LOAD]
+
+    def section(self, name):
+        for section in self.sections:
+            if section.name == name:
+                return section
+        return None
+
+    def symbols(self):
+        """Yield (name, value, size, type) for .symtab and .dynsym entries."""
+        for table in self.sections:
+            if table.type not in (SHT_SYMTAB, SHT_DYNSYM):
+                continue
+            strtab = self.sections[table.link]
+            for i in range(table.size // SYM.size):
+                name_idx, info, _, shndx, value, size = SYM.unpack_from(
+                    self.data, table.offset + i * SYM.size)
+                if name_idx == 0 or shndx == 0:
+                    continue
+                yield (self._string(strtab.offset + name_idx), value, size,
+                       info & 0xf)
+
+    def notes(self):
+        """Yield (segment, note offset, name, type, descriptor) per note."""
+        for seg in self.segments:
+            if seg.type != PT_NOTE:
+                continue
+            alignment = 8 if seg.align == 8 else 4
+            offset = seg.offset
+            end = seg.offset + seg.filesz
+            while offset + NHDR.size <= end:
+                namesz, descsz, ntype = NHDR.unpack_from(self.data, offset)
+                name_off = offset + NHDR.size
+                desc_off = name_off + align_up(namesz, alignment)
+                next_off = desc_off + align_up(descsz, alignment)
+                if next_off > end:
+                    break
+                name = bytes(self.data[name_off:name_off + namesz])
+                yield (seg, offset, name.rstrip(b"\0").decode(), ntype,
+                       bytes(self.data[desc_off:desc_off + descsz]))
+                offset = next_off
+
+    @staticmethod
+    def pack_note(name, ntype, desc):
+        name = name.encode() + b"\0"
+        note = NHDR.pack(len(name), len(desc), ntype)
+        note += name.ljust(align_up(len(name), 4), b"\0")
+        note += desc.ljust(align_up(len(desc), 4), b"\0")
+        return note
+
+    def replace_note(self, name, ntype, desc):
+        """Overwrite an existing note that is alone in its PT_NOTE segment.
+
+        Returns False if there is no such note or the new one does not fit.
+        """
+        for seg, offset, note_name, note_type, _ in list(self.notes()):
+            if note_name != name or note_type != ntype:
+                continue
+            note = self.pack_note(name, ntype, desc)
+            if seg.offset != offset or len(note) > seg.filesz:
+                return False
+            self.data[offset:offset + seg.filesz] = note.ljust(seg.filesz,
+                                                               b"\0")
+            seg.filesz = seg.memsz = len(note)
+            for section in self.sections:
+                if section.type == SHT_NOTE and section.offset == offset:
+                    section.size = len(note)
+            self._write_headers()
+            return True
+        return False
+
+    def add_note(self, name, ntype, desc, section_name):
+        """Add a note in a new PT_NOTE segment and section.
+
+        There is rarely room to grow the program header table in place, so a
+        new table is written at the end of the file together with the note,
+        and both are covered by a new read-only PT_LOAD segment placed above
+        all existing segments. The new segment keeps the vaddr - offset delta
+        of the first PT_LOAD segment, so that the kernel computes AT_PHDR
+        correctly no matter how it locates the program header table.
+        """
+        note = self.pack_note(name, ntype, desc)
+        loads = self.loads()
+        if not loads:
+            raise ElfError("%s: no PT_LOAD segments" % self.path)
+        first = loads[0]
+        delta = first.vaddr - first.offset
+        end_vaddr = max(seg.vaddr + seg.memsz for seg in loads)
+        vaddr = align_up(max(end_vaddr, len(self.data) + delta), PAGE_SIZE)
+        offset = vaddr - delta
+
+        table_size = (len(self.segments) + 2) * PHDR.size
+        note_off = align_up(table_size, 8)
+        blob_size = note_off + len(note)
+
+        load = Segment(PT_LOAD, PF_R, offset, vaddr, vaddr, blob_size,
+                       blob_size, first.align)
+        note_seg = Segment(PT_NOTE, PF_R, offset + note_off, vaddr + note_off,
+                           vaddr + note_off, len(note), len(note), 4)
+
+        for seg in self.segments:
+            if seg.type == PT_PHDR:
+                seg.offset = offset
+                seg.vaddr = seg.paddr = vaddr
+                seg.filesz = seg.memsz = table_size
+        last_load = self.segments.index(loads[-1])
+        self.segments.insert(last_load + 1, load)
+        self.segments.append(note_seg)
+
+        self.data += b"\0" * (offset - len(self.data))
+        self.e_phoff = offset
+        self.e_phnum = len(self.segments)
+        self.data += b"\0" * note_off
+        self.data += note
+
+        if self.sections:
+            strtab = self.sections[self.e_shstrndx]
+            names = bytes(self.data[strtab.offset:strtab.offset + strtab.size])
+            section = Section(len(names), SHT_NOTE, SHF_ALLOC,
+                              vaddr + note_off, offset + note_off, len(note),
+                              0, 0, 4, 0)
+            section.name = section_name
+            strtab.offset = len(self.data)
+            strtab.size = len(names) + len(section_name) + 1
+            self.data += names + section_name.encode() + b"\0"
+            self.sections.append(section)
+            self.e_shnum = len(self.sections)
+            self.e_shoff = 0  # placed by _write_headers
+
+        self._write_headers()
+
+    def realign_loads(self, alignment):
+        """Raise p_align of every PT_LOAD segment to at least `alignment`.
+
+        A segment can only be loaded at that alignment if its file offset is
+        congruent to its virtual address modulo the alignment. Where that does
+        not hold, zero padding is inserted into the file in front of the
+        segment, and every file offset behind the padding is moved. Virtual
+        addresses do not change, so no relocation is needed. Returns the
+        number of padding bytes inserted.
+        """
+        insertions = []
+        shift = 0
+        for seg in sorted(self.loads(), key=lambda seg: seg.offset):
+            pad = (seg.vaddr - (seg.offset + shift)) % alignment
+            if pad == 0:
+                continue
+            if seg.offset == 0:
+                raise ElfError("%s: the first PT_LOAD segment at %#x cannot "
+                               "be aligned to %#x" % (self.path, seg.vaddr,
+                                                      alignment))
+            insertions.append((seg.offset, pad))
+            shift += pad
+
+        if insertions:
+            self._insert_padding(insertions)
+        for seg in self.loads():
+            seg.align = max(seg.align, alignment)
+        self._write_headers()
+        return shift
+
+    def _insert_padding(self, insertions):
+        def moved(offset):
+            return offset + sum(pad for point, pad in insertions
+                                if point <= offset)
+
+        # Anything that straddles an insertion point would be torn apart.
+        extents = [(seg.offset, seg.filesz) for seg in self.segments]
+        extents += [(sec.offset, sec.size) for sec in self.sections
+                    if sec.type != SHT_NOBITS]
+        for point, _ in insertions:
+            for offset, size in extents:
+                if offset < point < offset + size:
+                    raise ElfError("%s: data at %#x spans the start of a "
+                                   "PT_LOAD segment at %#x" % (self.path,
+                                                               offset, point))
+
+        data = bytearray()
+        previous = 0
+        for point, pad in insertions:
+            data += self.data[previous:point] + b"\0" * pad
+            previous = point
+        data += self.data[previous:]
+        self.data = data
+
+        for seg in self.segments:
+            seg.offset = moved(seg.offset)
+        for sec in self.sections:
+            sec.offset = moved(sec.offset)
+        self.e_phoff = moved(self.e_phoff)
+        if self.e_shoff:
+            self.e_shoff = moved(self.e_shoff)
+
+    def _write_headers(self):
+        if self.sections and self.e_shoff == 0:
+            self.data += b"\0" * (align_up(len(self.data), 8) - len(self.data))
+            self.e_shoff = len(self.data)
+            self.data += b"\0" * (len(self.sections) * SHDR.size)
+        for i, seg in enumerate(self.segments):
+            offset = self.e_phoff + i * PHDR.size
+            self.data[offset:offset + PHDR.size] = seg.pack()
+        for i, section in enumerate(self.sections):
+            offset = self.e_shoff + i * SHDR.size
+            self.data[offset:offset + SHDR.size] = section.pack()
+        EHDR.pack_into(self.data, 0, self.ident, self.e_type, self.e_machine,
+                       self.e_version, self.e_entry, self.e_phoff,
+                       self.e_shoff, self.e_flags, self.e_ehsize,
+                       self.e_phentsize, self.e_phnum, self.e_shentsize,
+                       self.e_shnum, self.e_shstrndx)
+
+    def save(self, path):
+        with open(path, "wb") as f:
+            f.write(self.data)